@@ -378,7 +378,7 @@ struct normal_map_layer {
 gpu_image generate_normal_map(const image_data& image, float scale, int blurPasses, sinm_greyscale_type greyscaleType, int flipY = 0)
 {
     gpu_image result = { image.w, image.h };
-    result.gpu = sinm_normal_map_gpu(image.pixels.data(), image.w, image.h, scale, blurPasses, greyscaleType, flipY);
+    result.gpu = sinm_normal_map_gpu(image.pixels.data(), image.w, image.h, scale, blurPasses, greyscaleType, flipY, sinm_gpu_output_rgba8);
     assert(result.gpu.fbo != 0);
     assert(result.gpu.buffer != 0);
     return result;
@@ -397,12 +397,10 @@ create_normal_map_layer(const image_data& image, float scale = 1.0f, int blurPas
     return result;
 }
 
-void regenerate_normal_map_layers(std::vector<normal_map_layer>& layers, const image_data& albedoImage, bool flipY)
+void regenerate_normal_map_layers(std::vector<normal_map_layer>& layers, sinm_gpu_source& albedoSource, bool flipY)
 {
-    int w = albedoImage.w;
-    int h = albedoImage.h;
     for (auto& layer : layers) {
-        sinm__normal_map_gpu(albedoImage.pixels.data(), layer.image.gpu.fbo, w, h, layer.settings.scale, layer.settings.blurPasses, layer.settings.greyscaleType, (int)flipY);
+        sinm_normal_map_gpu_source(&albedoSource, layer.image.gpu.fbo, layer.settings.scale, layer.settings.blurPasses, layer.settings.greyscaleType, (int)flipY);
     }
 }
 
@@ -421,9 +419,121 @@ void generate_normal_map_composite(sinm_gpu_buffer& outImage, const std::vector<
     assert(!glsys::report_errors());
 }
 
-int main()
+//Deterministic noisy texture so the blur and sobel passes do real work
+static std::vector<uint32_t> make_bench_image(int32_t w, int32_t h)
+{
+    std::vector<uint32_t> result((size_t)w * h);
+    uint32_t seed = 0x9E3779B9u;
+    for (int32_t y = 0; y < h; ++y) {
+        for (int32_t x = 0; x < w; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            uint32_t r = ((x * 7 + y * 3) & 0xFFu) ^ ((seed >> 24) & 0x1Fu);
+            uint32_t g = (seed >> 8) & 0xFFu;
+            uint32_t b = (uint32_t)(x ^ y) & 0xFFu;
+            result[(size_t)y * w + x] = r | g << 8u | b << 16u | 255u << 24u;
+        }
+    }
+    return result;
+}
+
+//Modelled texture traffic per pixel of one regeneration. The fragment backend reads the image and writes float
+//heights, each blur draw reads and writes heights(the first one reads the float ones) and sobel reads heights and
+//writes the output. The compute backend keeps the greyscale and blur passes in shared memory so heights are written
+//and read once
+static double gpu_bytes_per_pixel(sinm_gpu_backend backend, int32_t heightBytes, int32_t outputBytes, int32_t passes)
+{
+    if (backend == sinm_gpu_backend_fragment) {
+        return (4 + 4) + (2.0 * std::max(1, passes) * 2 * heightBytes + 4 - heightBytes) + (heightBytes + outputBytes);
+    }
+    return 4 + 2 * heightBytes + (heightBytes + outputBytes);
+}
+
+//opengl_basics bench [sizes...]: one regeneration with each backend, height format and output format. The first row
+//of each backend, float heights and output, is the baseline: what the compute backend ran before the height formats
+//and a quarter of the blur traffic of the RGBA32F intermediates the fragment backend had. "speedup" is its time over
+//the row's and "max diff" the largest 8 bit channel difference from it over every greyscale type, the times are of
+//luminance. Returns the number of rows off by more than one step
+static int32_t gpu_bench(const std::vector<int32_t>& sizes)
+{
+    using clock = std::chrono::steady_clock;
+    const int32_t passes = 4;
+    const char* backendNames[sinm_gpu_backend_count] = { "fragment", "compute" };
+    const char* heightNames[sinm_gpu_height_count] = { "r32f", "r16f", "r16" };
+    const int32_t heightBytes[sinm_gpu_height_count] = { 4, 2, 2 };
+    const char* outputNames[sinm_gpu_output_count] = { "rgba32f", "rgba16", "rgba8", "rg8" };
+    const int32_t outputBytes[sinm_gpu_output_count] = { 16, 8, 4, 2 };
+    const int32_t greyscaleTypes = sinm_greyscale_count - 1;
+    int32_t failures = 0;
+
+    fmt::print("{:>6} {:>9} {:>8} {:>8} {:>9} {:>8} {:>10} {:>9}\n", "size", "backend", "heights", "output", "ms", "speedup", "MB moved", "max diff");
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_bench_image(size, size);
+        std::vector<std::vector<uint32_t>> references(greyscaleTypes, std::vector<uint32_t>((size_t)size * size));
+        std::vector<uint32_t> out((size_t)size * size);
+        double megapixels = (double)size * size / 1e6;
+        for (int b = 0; b < sinm_gpu_backend_count; ++b) {
+            if (!sinm_gpu_set_backend((sinm_gpu_backend)b)) {
+                continue;
+            }
+            double baseline = 0.0;
+            for (int f = 0; f < sinm_gpu_height_count; ++f) {
+                sinm_gpu_set_height_format((sinm_gpu_height_format)f);
+                for (int o = 0; o < sinm_gpu_output_count; ++o) {
+                    sinm_gpu_buffer result = sinm_normal_map_gpu(in.data(), size, size, 2.0f, passes, sinm_greyscale_luminance, 0, (sinm_gpu_output_format)o);
+                    double best = 1e30;
+                    for (int run = 0; run < 5; ++run) {
+                        auto begin = clock::now();
+                        sinm__normal_map_gpu(in.data(), result.fbo, size, size, 2.0f, passes, sinm_greyscale_luminance, 0);
+                        glFinish();
+                        best = std::min(best, std::chrono::duration<double, std::milli>(clock::now() - begin).count());
+                    }
+
+                    int32_t maxDiff = 0;
+                    for (int32_t g = 0; g < greyscaleTypes; ++g) {
+                        std::vector<uint32_t>& reference = references[g];
+                        sinm__normal_map_gpu(in.data(), result.fbo, size, size, 2.0f, passes, (sinm_greyscale_type)(g + 1), 0);
+                        sinm_gpu_normal_map_to_buffer(f == 0 && o == 0 ? reference.data() : out.data(), result.fbo, size, size);
+                        //NOTE: rg8 has no Z to compare
+                        uint32_t channels = o == sinm_gpu_output_rg8 ? 16 : 24;
+                        for (size_t i = 0; (f != 0 || o != 0) && i < out.size(); ++i) {
+                            for (uint32_t c = 0; c < channels; c += 8) {
+                                maxDiff = std::max(maxDiff, std::abs((int32_t)(reference[i] >> c & 0xFFu) - (int32_t)(out[i] >> c & 0xFFu)));
+                            }
+                        }
+                    }
+                    sinm_free_gpu_buffer(&result);
+                    failures += maxDiff > 1;
+                    if (f == 0 && o == 0) {
+                        baseline = best;
+                    }
+                    fmt::print("{:>6} {:>9} {:>8} {:>8} {:>9.2f} {:>8.2f} {:>10.1f} {:>9}\n", size, backendNames[b], heightNames[f], outputNames[o], best, baseline / best,
+                        megapixels * gpu_bytes_per_pixel((sinm_gpu_backend)b, heightBytes[f], outputBytes[o], passes), maxDiff);
+                }
+            }
+        }
+    }
+    sinm_gpu_pool_release();
+    if (failures) {
+        fmt::print("{} rows are more than one step off float\n", failures);
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
 {
     GLFWwindow* window = initialize_glfw();
+    if (argc > 1 && std::string_view(argv[1]) == "bench") {
+        sinm_initialize_opengl();
+        std::vector<int32_t> sizes;
+        for (int i = 2; i < argc; ++i) {
+            sizes.push_back(atoi(argv[i]));
+        }
+        int32_t failures = gpu_bench(sizes.empty() ? std::vector<int32_t> { 1024, 2048 } : sizes);
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return failures ? 1 : 0;
+    }
+
     nk_context* ctx = nk_glfw3_init(window, NK_GLFW3_INSTALL_CALLBACKS, MAX_VERTEX_BUFFER, MAX_ELEMENT_BUFFER);
 
     BEGIN_TIMER(sinm_initialization)
@@ -441,6 +551,8 @@ int main()
 
     image_data albedoImage = load_image("textures/broken_tiles_01.tga");
     //image_data albedoImage = load_image("textures/test_image.png");
+    //NOTE: uploaded once, every layer regenerates from it
+    sinm_gpu_source albedoSource = sinm_gpu_source_create(albedoImage.pixels.data(), albedoImage.w, albedoImage.h);
 
     std::vector<normal_map_layer> normalMapLayers;
     normalMapLayers.push_back(create_normal_map_layer(albedoImage));
@@ -450,7 +562,7 @@ int main()
     int albedoMapTexIndex = nk_glfw3_create_texture(albedoImage.pixels.data(), albedoImage.w, albedoImage.h);
     struct nk_image albedoMapImage = nk_image_id(albedoMapTexIndex);
 
-    sinm_gpu_buffer normalMap = sinm_normal_map_gpu(albedoImage.pixels.data(), albedoImage.w, albedoImage.h, 2.0f, 2, sinm_greyscale_luminance, false);
+    sinm_gpu_buffer normalMap = sinm_normal_map_gpu(albedoImage.pixels.data(), albedoImage.w, albedoImage.h, 2.0f, 2, sinm_greyscale_luminance, false, sinm_gpu_output_rgba8);
     image_data normalMapResult;
     normalMapResult.w = albedoImage.w;
     normalMapResult.h = albedoImage.h;
@@ -471,6 +583,9 @@ int main()
 
     int flipY = 0;
     char filenameInputBuffer[256] = "normal_map.png";
+    //NOTE: saving copies the result back without waiting, it is written out on a later frame once the copy is done
+    sinm_gpu_readback saveReadback = {};
+    std::string savePath;
 
     struct nk_colorf bgColor = { 0.1f, 0.18f, 0.24f, 1.0f };
     while (!glfwWindowShouldClose(window)) {
@@ -500,7 +615,7 @@ int main()
             nk_layout_row_static(ctx, 30, 80, 1);
             if (nk_button_label(ctx, "Apply")) {
                 // BEGIN_TIMER(regenerate)
-                regenerate_normal_map_layers(normalMapLayers, albedoImage, flipY);
+                regenerate_normal_map_layers(normalMapLayers, albedoSource, flipY);
                 // END_TIMER(regenerate)
 
                 //normalMapResultTexIndex = nk_glfw3_create_texture(normalMapResult.pixels.data(), normalMapResult.w, normalMapResult.h);
@@ -512,8 +627,9 @@ int main()
 
             nk_layout_row_static(ctx, 30, 80, 1);
             nk_style_button button = {};
-            if (nk_button_label(ctx, "Save")) {
-                //stbi_write_png(filenameInputBuffer, normalMapResult.w, normalMapResult.h, 4, normalMapResult.pixels.data(), 0);
+            if (nk_button_label(ctx, "Save") && savePath.empty()) {
+                sinm_gpu_readback_begin(&saveReadback, normalMap.fbo, normalMapResult.w, normalMapResult.h);
+                savePath = filenameInputBuffer;
             }
 
             nk_layout_row_static(ctx, 30, 250, 1);
@@ -559,12 +675,19 @@ int main()
         }
 
         if (changedLayers.size() > 0) {
-            regenerate_normal_map_layers(changedLayers, albedoImage, flipY);
+            regenerate_normal_map_layers(changedLayers, albedoSource, flipY);
             //BEGIN_TIMER(compositing)
             generate_normal_map_composite(normalMap, normalMapLayers);
             //END_TIMER(compositing)
         }
 
+        if (!savePath.empty() && sinm_gpu_readback_ready(&saveReadback)) {
+            const uint32_t* pixels = sinm_gpu_readback_wait(&saveReadback);
+            stbi_write_png(savePath.c_str(), normalMapResult.w, normalMapResult.h, 4, pixels, 0);
+            sinm_gpu_readback_end(&saveReadback);
+            savePath.clear();
+        }
+
         if (nk_begin(ctx, "Albedo", nk_rect(500, 700, 230, 250),
                 NK_WINDOW_BORDER | NK_WINDOW_MOVABLE | NK_WINDOW_SCALABLE | NK_WINDOW_MINIMIZABLE | NK_WINDOW_TITLE)) {
             struct nk_command_buffer* canvas = nk_window_get_canvas(ctx);
@@ -587,6 +710,8 @@ int main()
         assert(!glsys::report_errors());
     }
 
+    sinm_gpu_readback_free(&saveReadback);
+    sinm_gpu_source_free(&albedoSource);
     nk_glfw3_shutdown();
     glfwDestroyWindow(window);
     glfwTerminate();
@@ -0,0 +1,441 @@
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#pragma warning(disable : 4312)
+#include "stb_image.h"
+#pragma warning(default : 4312)
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define SI_NORMALMAP_STATIC
+#define SI_NORMALMAP_IMPLEMENTATION
+#include "si_normalmap.h"
+
+//Headless batch converter. Needs no window or GL context so it can run on build machines.
+//
+//  nm_batch [options] <file or directory>...
+//
+//  -o <dir>     output directory(default: next to each input)
+//  -s <scale>   normal intensity(default 2)
+//  -b <radius>  blur radius before generating normals(default 2)
+//  -g <type>    greyscale method: average, luminance, lightness or none(default luminance)
+//  -m <blur>    blur method: box or recursive(default box). recursive costs the same for any radius
+//  -f           flip the Y axis
+//  -j <jobs>    files converted at once(default: every hardware thread)
+//  -w <width>   width of raw heightmaps(default: square)
+//  -r <format>  pixel format of raw results: rgba8, rg8, rgba16, rg16 or oct16(default rgba8)
+//  -c <format>  block compress image results: bc5 or bc3nm
+//  -k <file>    container of block compressed results: dds or ktx2(default dds)
+//
+//Results are written as <name>_normal.png, or as <name>_normal.dds/.ktx2 with -c. Those are compressed as the
+//rows come out of the pipeline straight into the mapped file, so the RGBA normal map is never written out.
+//
+//Raw single channel heightmaps(.r8, .r16 or .r32 holding floats) are memory mapped and written as
+//<name>_normal.<format> raw files, mapped as well, with no decode or copy. .r16 and .r32 heights keep 16 bits
+//through the blur and sobel kernels.
+
+namespace fs = std::filesystem;
+
+struct batch_settings {
+    fs::path outDir;
+    float scale = 2.0f;
+    float blurRadius = 2.0f;
+    sinm_greyscale_type greyscaleType = sinm_greyscale_luminance;
+    sinm_blur_type blurType = sinm_blur_box;
+    int flipY = 0;
+    int32_t jobs = 0;
+    int32_t rawWidth = 0;
+    sinm_output_format rawOutput = sinm_output_rgba8;
+    bool blockCompress = false;
+    sinm_block_format blockFormat = sinm_block_bc5;
+    sinm_container container = sinm_container_dds;
+};
+
+struct batch_result {
+    bool ok = false;
+    int32_t w = 0, h = 0;
+    double loadMs = 0.0;
+    double generateMs = 0.0;
+    double saveMs = 0.0;
+};
+
+//Memory each worker keeps between files so only an image bigger than any before it allocates
+struct worker_scratch {
+    sinm_context ctx;
+    std::vector<uint32_t> normalMap;
+
+    worker_scratch() { sinm_context_init(&ctx, nullptr, 0); }
+    ~worker_scratch() { sinm_context_free(&ctx); }
+};
+
+static const char* outputSuffix = "_normal";
+
+static double elapsed_ms(std::chrono::steady_clock::time_point begin)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static std::string lower_extension(const fs::path& path)
+{
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    return ext;
+}
+
+static bool raw_format(const fs::path& path, sinm_raw_format* out)
+{
+    std::string ext = lower_extension(path);
+    if (ext == ".r8") {
+        *out = sinm_raw_r8;
+    } else if (ext == ".r16") {
+        *out = sinm_raw_r16;
+    } else if (ext == ".r32") {
+        *out = sinm_raw_r32f;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool is_supported_image(const fs::path& path)
+{
+    std::string ext = lower_extension(path);
+    if (path.stem().string().ends_with(outputSuffix)) {
+        return false;
+    }
+    sinm_raw_format format;
+    return ext == ".png" || ext == ".tga" || ext == ".jpg" || ext == ".jpeg" || ext == ".bmp" || ext == ".psd" || ext == ".gif" || raw_format(path, &format);
+}
+
+static bool parse_greyscale_type(std::string_view name, sinm_greyscale_type* out)
+{
+    if (name == "average") {
+        *out = sinm_greyscale_average;
+    } else if (name == "luminance") {
+        *out = sinm_greyscale_luminance;
+    } else if (name == "lightness") {
+        *out = sinm_greyscale_lightness;
+    } else if (name == "none") {
+        *out = sinm_greyscale_none;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_blur_type(std::string_view name, sinm_blur_type* out)
+{
+    if (name == "box") {
+        *out = sinm_blur_box;
+    } else if (name == "recursive") {
+        *out = sinm_blur_recursive;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static const char* outputFormatNames[sinm_output_count] = { "rgba8", "rg8", "rgba16", "rg16", "oct16" };
+
+static bool parse_output_format(std::string_view name, sinm_output_format* out)
+{
+    for (int i = 0; i < sinm_output_count; ++i) {
+        if (name == outputFormatNames[i]) {
+            *out = (sinm_output_format)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char* blockFormatNames[sinm_block_count] = { "bc5", "bc3nm" };
+static const char* containerNames[sinm_container_count] = { "dds", "ktx2" };
+
+static bool parse_block_format(std::string_view name, sinm_block_format* out)
+{
+    for (int i = 0; i < sinm_block_count; ++i) {
+        if (name == blockFormatNames[i]) {
+            *out = (sinm_block_format)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_container(std::string_view name, sinm_container* out)
+{
+    for (int i = 0; i < sinm_container_count; ++i) {
+        if (name == containerNames[i]) {
+            *out = (sinm_container)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static fs::path output_path(const fs::path& input, const batch_settings& settings, const char* extension)
+{
+    fs::path dir = settings.outDir.empty() ? input.parent_path() : settings.outDir;
+    return dir / (input.stem().string() + outputSuffix + extension);
+}
+
+//Maps the heightmap and the result so the pipeline reads and writes the page cache directly. "load" is only
+//the mapping, pages are read as the rows get to them and written back by the OS after the unmap
+static batch_result convert_raw_file(const fs::path& input, sinm_raw_format format, const batch_settings& settings)
+{
+    batch_result result;
+
+    auto loadBegin = std::chrono::steady_clock::now();
+    sinm_mapped_file heights;
+    if (!sinm_map_file(&heights, input.string().c_str())) {
+        return result;
+    }
+    size_t pixels = heights.size / sinm_raw_pixel_size(format);
+    result.w = settings.rawWidth > 0 ? settings.rawWidth : (int32_t)std::lround(std::sqrt((double)pixels));
+    result.h = result.w > 0 ? (int32_t)(pixels / result.w) : 0;
+    if (result.w <= 0 || result.h <= 0 || (size_t)result.w * result.h != pixels) {
+        fmt::print(stderr, "{}: {} pixels don't make rows of {}, pass the width with -w\n", input.string(), pixels, result.w);
+        sinm_unmap_file(&heights);
+        return result;
+    }
+
+    sinm_mapped_file normals;
+    fs::path output = output_path(input, settings, (std::string(".") + outputFormatNames[settings.rawOutput]).c_str());
+    if (!sinm_map_file_write(&normals, output.string().c_str(), pixels * sinm_output_pixel_size(settings.rawOutput))) {
+        sinm_unmap_file(&heights);
+        return result;
+    }
+    result.loadMs = elapsed_ms(loadBegin);
+
+    auto generateBegin = std::chrono::steady_clock::now();
+    result.ok = sinm_normal_map_raw(heights.data, format, normals.data, settings.rawOutput, result.w, result.h, settings.scale, settings.blurRadius, settings.flipY) != 0;
+    result.generateMs = elapsed_ms(generateBegin);
+
+    auto saveBegin = std::chrono::steady_clock::now();
+    sinm_unmap_file(&normals);
+    sinm_unmap_file(&heights);
+    result.saveMs = elapsed_ms(saveBegin);
+    return result;
+}
+
+//Maps the result file, writes the container header and compresses the normal map into it right after. With the box
+//blur the rows are compressed as the pipeline makes them, the recursive blur makes the whole RGBA map first
+static bool convert_to_blocks(const fs::path& input, const uint32_t* pixels, const batch_settings& settings, worker_scratch& scratch, batch_result* result)
+{
+    int32_t w = result->w;
+    int32_t h = result->h;
+    uint8_t header[SINM_CONTAINER_HEADER_MAX];
+    size_t headerSize = sinm_container_header(header, settings.container, w, h, settings.blockFormat);
+    fs::path output = output_path(input, settings, (std::string(".") + containerNames[settings.container]).c_str());
+    sinm_mapped_file file;
+    if (!sinm_map_file_write(&file, output.string().c_str(), headerSize + sinm_block_compressed_size(w, h))) {
+        return false;
+    }
+    memcpy(file.data, header, headerSize);
+
+    auto generateBegin = std::chrono::steady_clock::now();
+    int generated;
+    if (settings.blurType == sinm_blur_box) {
+        generated = sinm_normal_map_compressed(pixels, file.data + headerSize, w, h, settings.scale, settings.blurRadius, settings.greyscaleType, settings.flipY, settings.blockFormat);
+    } else {
+        scratch.normalMap.resize((size_t)w * h);
+        generated = sinm_context_reserve(&scratch.ctx, sinm_scratch_size(w, h, settings.blurRadius, settings.blurType));
+        if (generated) {
+            generated = sinm_normal_map_buffer_ctx(&scratch.ctx, pixels, scratch.normalMap.data(), w, h, settings.scale, settings.blurRadius, settings.greyscaleType, settings.flipY, settings.blurType);
+        }
+        if (generated) {
+            generated = sinm_compress_normal_map(scratch.normalMap.data(), file.data + headerSize, w, h, settings.blockFormat);
+        }
+    }
+    result->generateMs = elapsed_ms(generateBegin);
+
+    auto saveBegin = std::chrono::steady_clock::now();
+    sinm_unmap_file(&file);
+    result->saveMs = elapsed_ms(saveBegin);
+    return generated != 0;
+}
+
+static batch_result convert_file(const fs::path& input, const batch_settings& settings, worker_scratch& scratch)
+{
+    batch_result result;
+    sinm_raw_format format;
+    if (raw_format(input, &format)) {
+        return convert_raw_file(input, format, settings);
+    }
+
+    auto loadBegin = std::chrono::steady_clock::now();
+    uint32_t* pixels = reinterpret_cast<uint32_t*>(stbi_load(input.string().c_str(), &result.w, &result.h, nullptr, 4));
+    result.loadMs = elapsed_ms(loadBegin);
+    if (!pixels) {
+        return result;
+    }
+    if (settings.blockCompress) {
+        result.ok = convert_to_blocks(input, pixels, settings, scratch, &result);
+        stbi_image_free(pixels);
+        return result;
+    }
+
+    scratch.normalMap.resize((size_t)result.w * result.h);
+    auto generateBegin = std::chrono::steady_clock::now();
+    int generated = sinm_context_reserve(&scratch.ctx, sinm_scratch_size(result.w, result.h, settings.blurRadius, settings.blurType));
+    if (generated) {
+        generated = sinm_normal_map_buffer_ctx(&scratch.ctx, pixels, scratch.normalMap.data(), result.w, result.h, settings.scale, settings.blurRadius, settings.greyscaleType, settings.flipY, settings.blurType);
+    }
+    result.generateMs = elapsed_ms(generateBegin);
+    stbi_image_free(pixels);
+    if (!generated) {
+        return result;
+    }
+
+    auto saveBegin = std::chrono::steady_clock::now();
+    fs::path output = output_path(input, settings, ".png");
+    result.ok = stbi_write_png(output.string().c_str(), result.w, result.h, 4, scratch.normalMap.data(), 0) != 0;
+    result.saveMs = elapsed_ms(saveBegin);
+    return result;
+}
+
+static void print_usage()
+{
+    fmt::print(stderr, "usage: nm_batch [-o dir] [-s scale] [-b blurRadius] [-g average|luminance|lightness|none] [-m box|recursive] [-f] [-j jobs] [-w rawWidth] [-r rgba8|rg8|rgba16|rg16|oct16] [-c bc5|bc3nm] [-k dds|ktx2] <file or directory>...\n");
+}
+
+int main(int argc, char** argv)
+{
+    batch_settings settings;
+    std::vector<fs::path> inputs;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-o" && hasValue) {
+            settings.outDir = argv[++i];
+        } else if (arg == "-s" && hasValue) {
+            settings.scale = (float)atof(argv[++i]);
+        } else if (arg == "-b" && hasValue) {
+            settings.blurRadius = (float)atof(argv[++i]);
+        } else if (arg == "-g" && hasValue) {
+            if (!parse_greyscale_type(argv[++i], &settings.greyscaleType)) {
+                fmt::print(stderr, "unknown greyscale type \"{}\"\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "-m" && hasValue) {
+            if (!parse_blur_type(argv[++i], &settings.blurType)) {
+                fmt::print(stderr, "unknown blur type \"{}\"\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "-f") {
+            settings.flipY = 1;
+        } else if (arg == "-j" && hasValue) {
+            settings.jobs = atoi(argv[++i]);
+        } else if (arg == "-w" && hasValue) {
+            settings.rawWidth = atoi(argv[++i]);
+        } else if (arg == "-r" && hasValue) {
+            if (!parse_output_format(argv[++i], &settings.rawOutput)) {
+                fmt::print(stderr, "unknown raw output format \"{}\"\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "-c" && hasValue) {
+            settings.blockCompress = true;
+            if (!parse_block_format(argv[++i], &settings.blockFormat)) {
+                fmt::print(stderr, "unknown block format \"{}\"\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "-k" && hasValue) {
+            if (!parse_container(argv[++i], &settings.container)) {
+                fmt::print(stderr, "unknown container \"{}\"\n", argv[i]);
+                return 1;
+            }
+        } else if (arg.starts_with("-")) {
+            print_usage();
+            return 1;
+        } else {
+            inputs.push_back(fs::path(arg));
+        }
+    }
+
+    std::vector<fs::path> files;
+    for (const auto& input : inputs) {
+        std::error_code ec;
+        if (fs::is_directory(input, ec)) {
+            for (const auto& entry : fs::directory_iterator(input, ec)) {
+                if (entry.is_regular_file() && is_supported_image(entry.path())) {
+                    files.push_back(entry.path());
+                }
+            }
+        } else if (fs::is_regular_file(input, ec)) {
+            files.push_back(input);
+        } else {
+            fmt::print(stderr, "skipping \"{}\": not a file or directory\n", input.string());
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    if (files.empty()) {
+        print_usage();
+        return 1;
+    }
+    if (!settings.outDir.empty()) {
+        fs::create_directories(settings.outDir);
+    }
+
+    int32_t jobs = settings.jobs > 0 ? settings.jobs : (int32_t)std::thread::hardware_concurrency();
+    jobs = std::max(1, std::min(jobs, (int32_t)files.size()));
+
+    std::atomic<size_t> nextFile = 0;
+    std::atomic<int32_t> failures = 0;
+    std::atomic<int64_t> totalPixels = 0;
+    std::mutex printMutex;
+
+    auto batchBegin = std::chrono::steady_clock::now();
+    auto worker = [&] {
+        worker_scratch scratch;
+        for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+            batch_result r = convert_file(files[i], settings, scratch);
+            std::lock_guard<std::mutex> lock(printMutex);
+            if (!r.ok) {
+                failures++;
+                fmt::print(stderr, "failed: {}\n", files[i].string());
+                continue;
+            }
+
+            double mpix = (double)r.w * r.h / 1e6;
+            totalPixels += (int64_t)r.w * r.h;
+            fmt::print("{} ({}x{}): load {:.1f} ms, generate {:.1f} ms ({:.1f} MPix/s), save {:.1f} ms\n",
+                files[i].string(), r.w, r.h, r.loadMs, r.generateMs, mpix / (r.generateMs / 1000.0), r.saveMs);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int32_t i = 1; i < jobs; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    double totalMs = elapsed_ms(batchBegin);
+    double totalMPix = (double)totalPixels / 1e6;
+    fmt::print("{} files, {:.1f} MPix in {:.1f} ms using {} jobs: {:.1f} MPix/s end to end\n",
+        files.size() - failures, totalMPix, totalMs, jobs, totalMPix / (totalMs / 1000.0));
+
+    return failures > 0 ? 1 : 0;
+}
@@ -6,6 +6,6 @@ uniform sampler2D image;
 
 void main() {
     vec3 c = texture(image, TexCoords).rgb;
-    float avg = (c.r+c.g+c.b)/2.0;
+    float avg = (c.r+c.g+c.b)/3.0;
     FragColor = vec4(avg, avg, avg, 1.0);
 }
\ No newline at end of file
@@ -56,10 +56,152 @@ typedef enum {
     sinm_greyscale_count, //Used for iterating, not a valid option
 } sinm_greyscale_type;
 
+//Blur applied to the height before generating normals. Both approximate a gaussian with sigma = blurRadius
+typedef enum {
+    sinm_blur_box, //Three box passes. Cheap for small radii
+    sinm_blur_recursive, //Young-van Vliet recursive filter. Same cost for any radius
+    sinm_blur_count, //Used for iterating, not a valid option
+} sinm_blur_type;
+
+//Instruction sets the CPU kernels are compiled for, in increasing order
+typedef enum {
+    sinm_isa_sse41,
+    sinm_isa_avx2,
+    sinm_isa_avx512,
+    sinm_isa_count, //Used for iterating, not a valid option
+} sinm_isa;
+
+//Height plane of an image and its summed-area table, see sinm_integral_build()
+typedef struct {
+    int32_t w, h;
+    uint8_t* height;
+    uint32_t* sums; //(w + 1) x (h + 1), the first row and column are 0
+} sinm_integral;
+
+#define SINM_PYRAMID_LEVELS 8 //Most levels a sinm_pyramid keeps, full resolution included
+
+//Height plane of an image and its 2x2 box downsampled levels, see sinm_pyramid_build()
+typedef struct {
+    int32_t levels;
+    int32_t w[SINM_PYRAMID_LEVELS], h[SINM_PYRAMID_LEVELS];
+    uint8_t* planes[SINM_PYRAMID_LEVELS]; //Level 0 is full resolution, all of them share one allocation
+} sinm_pyramid;
+
+//Callbacks of sinm_normal_map_stream. Row "y" is "w" pixels, RGBA for the reader and the stream's
+//sinm_output_format for the writer, and rows come once each, top to bottom. Return 0 to stop the stream
+typedef int (*sinm_row_reader)(void* user, int64_t y, uint32_t* row);
+typedef int (*sinm_row_writer)(void* user, int64_t y, const void* row);
+
+//Single channel heightmaps sinm_normal_map_raw() reads as they are stored on disk, without a header.
+//Rows are top to bottom and tightly packed
+typedef enum {
+    sinm_raw_r8,
+    sinm_raw_r16, //Little endian unsigned, 65535 is the top
+    sinm_raw_r32f, //Little endian float, 0 to 1
+    sinm_raw_count, //Used for iterating, not a valid option
+} sinm_raw_format;
+
+//Pixel layouts sinm_normal_map_raw() and sinm_normal_map_stream() write. 16 bit channels are little endian
+//and map [-1, 1] to [0, 65535]
+typedef enum {
+    sinm_output_rgba8, //Same bytes as sinm_normal_map_buffer
+    sinm_output_rg8, //X and Y only, the shader rebuilds Z = sqrt(1 - x * x - y * y)
+    sinm_output_rgba16, //X, Y, Z and alpha 65535
+    sinm_output_rg16, //X and Y only, like sinm_output_rg8
+    sinm_output_oct16, //Octahedral X and Y, the shader rebuilds n = normalize(x, y, 1 - |x| - |y|)
+    sinm_output_count, //Used for iterating, not a valid option
+} sinm_output_format;
+
+//A file mapped into memory by sinm_map_file() or sinm_map_file_write()
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    intptr_t file; //Platform handles, only for sinm_unmap_file()
+    intptr_t mapping;
+} sinm_mapped_file;
+
+//Block compressed layouts for normal maps, 4x4 pixels in 16 bytes
+typedef enum {
+    sinm_block_bc5, //X and Y as two BC4 blocks, the shader rebuilds Z like sinm_output_rg8
+    sinm_block_bc3nm, //X in the BC4 alpha block and Y in the green of the BC1 color block, for targets without BC5
+    sinm_block_count, //Used for iterating, not a valid option
+} sinm_block_format;
+
+//Texture files sinm_container_header() writes a header for
+typedef enum {
+    sinm_container_dds,
+    sinm_container_ktx2,
+    sinm_container_count, //Used for iterating, not a valid option
+} sinm_container;
+
+#define SINM_CONTAINER_HEADER_MAX 192 //Most bytes sinm_container_header() writes
+
+#define SINM_SCRATCH_ALIGN 64 //Alignment sinm_context_init() expects of caller memory
+
+//Scratch memory sinm_normal_map_buffer_ctx() works in, see sinm_context_init() and sinm_context_reserve()
+typedef struct {
+    uint8_t* memory; //SINM_SCRATCH_ALIGN aligned
+    size_t size;
+    void* allocation; //Set when the memory came from sinm_context_reserve() and belongs to the context
+} sinm_context;
+
 #ifdef SI_NORMALMAP_GPU
 typedef struct {
     uint32_t fbo, buffer;
 } sinm_gpu_buffer;
+
+//How sinm__normal_map_gpu runs, see sinm_gpu_set_backend()
+typedef enum {
+    sinm_gpu_backend_fragment, //Full screen passes: greyscale, 2 blur draws per blur pass and sobel
+    sinm_gpu_backend_compute, //Greyscale + horizontal blur and vertical blur + sobel dispatches on tiles in shared memory
+    sinm_gpu_backend_count, //Used for iterating, not a valid option
+} sinm_gpu_backend;
+
+//Single channel format the GPU path blurs heights in, see sinm_gpu_set_height_format()
+typedef enum {
+    sinm_gpu_height_r32f, //Float, for comparing against
+    sinm_gpu_height_r16f, //Half float. Rounds to 11 bits near 1, steep maps drift a few 8 bit steps from float
+    sinm_gpu_height_r16, //16 bit unorm, the default. Every greyscale type gives heights of 0 to 1, within one 8 bit step of float
+    sinm_gpu_height_count, //Used for iterating, not a valid option
+} sinm_gpu_height_format;
+
+//Texture format of the sinm_normal_map_gpu() result
+typedef enum {
+    sinm_gpu_output_rgba32f, //What it always made
+    sinm_gpu_output_rgba16,
+    sinm_gpu_output_rgba8, //Enough to show and save as an 8 bit image
+    sinm_gpu_output_rg8, //X and Y only, the shader rebuilds Z
+    sinm_gpu_output_count, //Used for iterating, not a valid option
+} sinm_gpu_output_format;
+
+//Textures the GPU path has created, see sinm_gpu_get_stats()
+typedef struct {
+    uint64_t allocations; //Textures created since the start
+    uint64_t poolHits; //sinm__normal_map_gpu calls whose image size already had intermediates in the pool
+    int32_t textures; //Alive right now, pooled intermediates and sinm_gpu_buffer results
+    size_t bytesResident; //Of the textures alive right now
+} sinm_gpu_stats;
+
+//GPU -> RAM copy in flight, see sinm_gpu_readback_begin(). Zero initialize, the pixel buffer is kept for the next copy
+typedef struct {
+    uint32_t pbo;
+    size_t capacity; //Bytes "pbo" holds
+    void* fence; //GLsync of the copy, NULL once it is known to be done
+    int32_t w, h;
+    const uint32_t* mapped; //Between sinm_gpu_readback_wait() and sinm_gpu_readback_end()
+} sinm_gpu_readback;
+
+//Source image uploaded once and shared by every layer made from it, see sinm_gpu_source_create()
+typedef struct {
+    uint32_t texture; //RGBA8
+    uint32_t heights[sinm_greyscale_count]; //R32F greyscale of "texture" per type, made by the first layer needing it
+    uint32_t heightsFBO[sinm_greyscale_count]; //Rendering into "heights", made with it
+    uint32_t heightsValid; //Bit per greyscale type, cleared by sinm_gpu_source_update()
+    uint32_t pbo; //Upload buffer
+    void* mapped; //"pbo" mapped for good when the driver has buffer storage(OpenGL 4.4)
+    void* fence; //GLsync of the last copy out of a mapped "pbo"
+    int32_t w, h;
+} sinm_gpu_source;
 #endif
 
 #endif //SINM_TYPES
@@ -71,59 +213,216 @@ SINM_DEF void sinm_greyscale(const uint32_t* in, uint32_t* out, int32_t w, int32
 //lightness, average or luminance methods
 //Result can be produced in-place if "in" and "out" are the same buffers
 
-SINM_DEF uint32_t* sinm_normal_map(const uint32_t* in, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY);
+SINM_DEF uint32_t* sinm_normal_map(const uint32_t* in, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_blur_type blurType = sinm_blur_box);
 //Converts input buffer to a normal map and returns a pointer to it.
 //  "scale" controls the intensity of the result
 //  "blurRadius" controls the radius for gaussian blurring before generating normals
 //  "greyscaleType" specifies the conversion method from color to greyscale before
 //   generating the normal map. This step is skipped when using sinm_greyscale_none.
+//  "blurType" picks how the blur is done. sinm_blur_recursive is faster for large radii
+//The result is malloc'd per call, use sinm_normal_map_buffer_ctx to reuse memory across images
+
+SINM_DEF int sinm_normal_map_buffer(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_blur_type blurType = sinm_blur_box);
+//Same as sinm_normal_map but writes into "out". Returns 0 if scratch memory could not be allocated.
+
+SINM_DEF size_t sinm_scratch_size(int32_t w, int32_t h, float blurRadius, sinm_blur_type blurType);
+//Bytes of scratch sinm_normal_map_buffer_ctx needs for these settings with the current sinm_thread_count().
+//Call it again after sinm_initialize_threads(), every extra thread needs a little more
+
+SINM_DEF void sinm_context_init(sinm_context* ctx, void* memory, size_t size);
+//Uses "size" bytes of caller owned "memory"(aligned to SINM_SCRATCH_ALIGN) as scratch. The caller keeps
+//ownership and the memory must outlive every call made with "ctx". Pass NULL and 0 for an empty context
+//that sinm_context_reserve() allocates for.
+
+SINM_DEF int sinm_context_reserve(sinm_context* ctx, size_t size);
+//Grows "ctx" to at least "size" bytes, usually sinm_scratch_size() of the largest image it will see.
+//Only allocates when the context is smaller than that, so calling it before every image is cheap.
+//Returns 0 and leaves "ctx" unchanged if memory could not be allocated.
+
+SINM_DEF void sinm_context_free(sinm_context* ctx);
+//Frees memory sinm_context_reserve() allocated. Caller memory is left alone
+
+SINM_DEF int sinm_normal_map_buffer_ctx(sinm_context* ctx, const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_blur_type blurType = sinm_blur_box);
+//Same as sinm_normal_map_buffer but every intermediate lives in "ctx" and nothing is allocated.
+//Returns 0 without touching "out" if "ctx" is smaller than sinm_scratch_size() for these settings.
+//A context must not be used by two calls at once.
+
+SINM_DEF void sinm_initialize_threads(int32_t threadCount);
+//Starts a persistent pool of "threadCount" threads(counting the calling thread) that
+//sinm_normal_map_buffer, sinm_greyscale, sinm_normalize and sinm_composite split their
+//stages over in row bands. Pass 0 to use every hardware thread. Without it everything runs
+//on the calling thread. Calls made while the pool is busy with another caller run serially.
+
+SINM_DEF void sinm_shutdown_threads();
+//Joins and frees the pool started by sinm_initialize_threads()
+
+SINM_DEF int32_t sinm_thread_count();
+//Number of threads CPU stages are currently split over
+
+SINM_DEF sinm_isa sinm_detect_isa();
+//Best instruction set the CPU(and OS) supports. The kernels for it are picked on first use
+
+SINM_DEF int sinm_force_isa(sinm_isa isa);
+//Runs every CPU stage with the kernels for "isa" instead, mostly for benchmarking.
+//Returns 0 and changes nothing if the CPU does not support it. Not thread safe, call it
+//while no other work is running
+
+SINM_DEF sinm_isa sinm_active_isa();
+//Instruction set the CPU stages currently run with
+
+SINM_DEF const char* sinm_isa_name(sinm_isa isa);
+
+SINM_DEF int sinm_normal_map_buffer_tiled(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY);
+//Same result as sinm_normal_map_buffer but runs every stage on SINM_TILE_SIZE tiles(plus the
+//halo the blur and sobel kernels need) so intermediate data stays in cache instead of making
+//full image passes. Row bands of tiles run on the thread pool like the other stages. "in" and "out" must not
+//overlap. Returns 0 if scratch memory could not be allocated.
+//Always uses sinm_blur_box, the recursive blur has no finite halo.
+
+SINM_DEF int sinm_normal_map_buffer_rows(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY);
+//Same result as sinm_normal_map_buffer with sinm_blur_box, for when memory matters more than speed. Rows go
+//through greyscale, blur and sobel one at a time and each stage only keeps the rows its kernel still reaches,
+//so scratch is a few rows per thread(about w * (6 * blurRadius + 20) bytes) instead of two planes the size of
+//the image. "in" and "out" must not overlap. Returns 0 if scratch memory could not be allocated.
+
+SINM_DEF int sinm_normal_map_stream(sinm_row_reader read, sinm_row_writer write, void* user, int32_t w, int64_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_output_format format = sinm_output_rgba8);
+//Same result as sinm_normal_map_buffer_rows for images that never have to be in memory at once. Input rows
+//are pulled from "read" and every output row is pushed to "write" as soon as the blur and sobel kernels have
+//seen all the rows they reach, so memory is the same few rows whatever "h" is. Rows are encoded as "format"
+//on the way out, e.g. sinm_output_rg8 halves what the writer has to store. Runs on the calling thread.
+//Returns 0 if scratch memory could not be allocated or a callback returned 0.
+
+SINM_DEF int sinm_map_file(sinm_mapped_file* file, const char* path);
+//Maps "path" read only. Pages are read by the OS as they are touched, so a file already in the page cache is
+//used where it lies with no read or copy. Returns 0 if the file can't be opened or is empty
+
+SINM_DEF int sinm_map_file_write(sinm_mapped_file* file, const char* path, size_t size);
+//Creates(or truncates) "path" at "size" bytes and maps it for writing. Whatever is written to "data" ends up in
+//the file once it is unmapped. Returns 0 if the file can't be created
+
+SINM_DEF void sinm_unmap_file(sinm_mapped_file* file);
+//Unmaps a file from sinm_map_file() or sinm_map_file_write() and closes it
+
+SINM_DEF size_t sinm_block_compressed_size(int32_t w, int32_t h);
+//Bytes a "w" x "h" image takes in any sinm_block_format, rounded up to whole 4x4 blocks
+
+SINM_DEF int sinm_compress_normal_map(const uint32_t* normals, void* out, int32_t w, int32_t h, sinm_block_format format);
+//Compresses RGBA normals(e.g. from sinm_normal_map_buffer) into sinm_block_compressed_size() bytes of "format"
+//blocks, one row of blocks after the other. Each block channel takes its highest and lowest value as endpoints
+//and every pixel the nearest palette entry. Rows of blocks are spread over the threads. Edges that aren't a
+//multiple of 4 repeat the last row and column. Returns 1, there is nothing to allocate
+
+SINM_DEF int sinm_normal_map_compressed(const uint32_t* in, void* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_block_format format);
+//Same result as sinm_normal_map_buffer_rows followed by sinm_compress_normal_map, but every 4 rows that come out of
+//the row pipeline are compressed right away, so the RGBA normal map is never in memory. Writing "out" straight into a
+//file from sinm_map_file_write() after sinm_container_header() leaves a finished texture with no other copy.
+//Returns 0 if scratch memory could not be allocated.
+
+SINM_DEF size_t sinm_container_header(uint8_t* out, sinm_container container, int32_t w, int32_t h, sinm_block_format format);
+//Writes the header of a "container" file holding one 2D "w" x "h" mip level of "format" blocks into "out"(up to
+//SINM_CONTAINER_HEADER_MAX bytes) and returns its size. The sinm_block_compressed_size() bytes of blocks follow
+//right after it. DDS uses the DX10 header for BC5 and DXT5 for BC3nm, KTX2 has no supercompression
+
+SINM_DEF size_t sinm_raw_pixel_size(sinm_raw_format format);
+SINM_DEF size_t sinm_output_pixel_size(sinm_output_format format);
+
+SINM_DEF int sinm_normal_map_raw(const void* heights, sinm_raw_format heightFormat, void* out, sinm_output_format format, int32_t w, int32_t h, float scale, float blurRadius, int flipY);
+//Same result as sinm_normal_map_buffer_rows for a raw single channel heightmap, e.g. the "data" of a .r16 file from
+//sinm_map_file() or a stbi_load_16(path, &w, &h, NULL, 1) image, written as "format" pixels to "out", e.g. a file
+//from sinm_map_file_write(). There is no greyscale or RGBA step: sinm_raw_r8 and sinm_raw_r16 rows go into the blur
+//as they are and sinm_output_rgba8 rows come out of the sobel kernel straight into "out", so nothing else is copied.
+//sinm_raw_r16 and sinm_raw_r32f keep 16 bits through the blur and sobel kernels, so slopes finer than one 8 bit step
+//don't band. Floats are rounded to 16 bits a row at a time. The 16 bit output formats are encoded straight from
+//the sobel gradients, so they carry more than the 8 bits an RGBA8 result has.
+//Returns 0 if scratch memory could not be allocated.
+
+SINM_DEF size_t sinm_memory_high_water();
+//Most bytes the library has had allocated at once(scratch, contexts, tables and pyramids) since the start or
+//the last sinm_memory_reset_high_water(). Results returned by sinm_normal_map and sinm_composite_alloc belong
+//to the caller and aren't counted
+
+SINM_DEF size_t sinm_memory_in_use();
+//Bytes the library has allocated right now, counted like sinm_memory_high_water()
+
+SINM_DEF void sinm_memory_reset_high_water();
+//Starts a new high-water mark from what is in use right now, e.g. before the call to measure
+
+SINM_DEF int sinm_integral_build(sinm_integral* integral, const uint32_t* in, int32_t w, int32_t h, sinm_greyscale_type greyscaleType);
+//Converts "in" to a height plane and builds its summed-area table once. Normal maps of the same image
+//that only differ in blur radius and scale(layers) then come from sinm_normal_map_integral without
+//going back to "in", and each blur costs the same for any radius.
+//Returns 0 if memory could not be allocated. Free with sinm_integral_free()
+
+SINM_DEF void sinm_integral_free(sinm_integral* integral);
+
+SINM_DEF int sinm_normal_map_integral(const sinm_integral* integral, uint32_t* out, float scale, float blurRadius, int flipY);
+//Same as sinm_normal_map_buffer on the image "integral" was built from, but the gaussian is approximated by a
+//weighted stack of boxes read from the table, with edges clamped like the other paths. Closer to a true
+//gaussian than sinm_blur_box(compare with sinm_bench blur). The blur and sobel kernels run in one pass, so
+//nothing the size of the image is allocated. Returns 0 if scratch memory could not be allocated.
+
+SINM_DEF int sinm_pyramid_build(sinm_pyramid* pyramid, const uint32_t* in, int32_t w, int32_t h, sinm_greyscale_type greyscaleType);
+//Converts "in" to a height plane and halves it up to SINM_PYRAMID_LEVELS - 1 times. Keep it around for as long as
+//the source image doesn't change and every layer and blur radius reuses it through sinm_normal_map_pyramid.
+//Returns 0 if memory could not be allocated. Free with sinm_pyramid_free()
+
+SINM_DEF void sinm_pyramid_free(sinm_pyramid* pyramid);
+
+SINM_DEF int sinm_normal_map_pyramid(const sinm_pyramid* pyramid, uint32_t* out, float scale, float blurRadius, int flipY);
+//Same as sinm_normal_map_buffer with sinm_blur_box on the image "pyramid" was built from. Large radii blur and take
+//gradients on the coarsest level that still has SINM_PYRAMID_MIN_SIGMA pixels of blur left to do, and the
+//gradients are interpolated back up to full resolution. Small radii run at full resolution from level 0.
+//Returns 0 if scratch memory could not be allocated.
 
 #else //SI_NORMALMAP_IMPLEMENTATION
 
-#include <emmintrin.h>
-#include <intrin.h>
+#include <immintrin.h>
+#include <math.h>
 
-#ifdef __AVX__
-#define simd_prefix_float(name) _mm256_##name
-#define SINM_SIMD_WIDTH 8
-#define simd__int __m256i
-#define simd__float __m256
-#define simd__and_ix(a, b) _mm256_and_si256(a, b)
-#define simd__or_ix(a, b) _mm256_or_si256(a, b)
-#define simd__loadu_ix(a) _mm256_loadu_si256(a)
-#define simd__storeu_ix(ptr, v) _mm256_storeu_si256(ptr, v)
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
 #else
-#define simd_prefix_float(name) _mm_##name
-#define SINM_SIMD_WIDTH 4
-#define simd__int __m128i
-#define simd__float __m128
-#define simd__and_ix(a, b) _mm_and_si128(a, b)
-#define simd__or_ix(a, b) _mm_or_si128(a, b)
-#define simd__loadu_ix(a) _mm_loadu_si128(a)
-#define simd__storeu_ix(ptr, v) _mm_storeu_si128(ptr, v)
-#endif // __AVX__
-
-#define simd__set1_epi32(a) simd_prefix_float(set1_epi32(a))
-#define simd__setzero_ix() simd_prefix_float(setzero_si256())
-#define simd__setzero_ps() simd_prefix_float(setzero_ps())
-#define simd__andnot_ps(a, b) simd_prefix_float(andnot_ps(a, b))
-#define simd__add_epi32(a, b) simd_prefix_float(add_epi32(a, b))
-#define simd__sub_epi32(a, b) simd_prefix_float(sub_epi32(a, b))
-#define simd__max_epi32(a, b) simd_prefix_float(max_epi32(a, b))
-#define simd__min_epi32(a, b) simd_prefix_float(min_epi32(a, b))
-#define simd__loadu_ps(a) simd_prefix_float(loadu_ps(a))
-#define simd__srli_epi32(a, i) simd_prefix_float(srli_epi32(a, i))
-#define simd__slli_epi32(a, i) simd_prefix_float(slli_epi32(a, i))
-#define simd__set1_ps(a) simd_prefix_float(set1_ps(a))
-#define simd__cvtepi32_ps(a) simd_prefix_float(cvtepi32_ps(a))
-#define simd__cvtps_epi32(a) simd_prefix_float(cvtps_epi32(a))
-#define simd__add_ps(a, b) simd_prefix_float(add_ps(a, b))
-#define simd__mul_ps(a, b) simd_prefix_float(mul_ps(a, b))
-#define simd__sqrt_ps(a) simd_prefix_float(sqrt_ps(a))
-#define simd__cmp_ps(a, b, c) simd_prefix_float(cmp_ps(a, b, c))
-#define simd__div_ps(a, b) simd_prefix_float(div_ps(a, b))
-#define simd__hadd_ps(a, b) simd_prefix_float(hadd_ps(a, b))
-#define simd__cvtss_f32(a) simd_prefix_float(cvtss_f32(a))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//NOTE: the timers are normally provided by the application(see engine.cpp)
+#ifndef BEGIN_TIMER
+#define BEGIN_TIMER(name)
+#endif
+#ifndef END_TIMER
+#define END_TIMER(name)
+#endif
+
+#ifndef SINM_MAX_THREADS
+#define SINM_MAX_THREADS 256 //Upper bound for sinm_initialize_threads()
+#endif
+
+#ifndef SINM_TILE_SIZE
+#define SINM_TILE_SIZE 256 //Output tile edge in pixels for the tiled pipeline. Should be a multiple of 16
+#endif
+
+#define SINM__MAX_SIMD_WIDTH 16 //Widest kernel set, in 32 bit lanes
+#define SINM__BLUR_STRIP 256 //Columns the vertical box blur keeps running sums for at once
+#define SINM__BOX_ROWS 32 //Rows the horizontal box blur transposes and runs through the vertical pass at once
+#define SINM__RECURSIVE_ROWS 16 //Rows the horizontal recursive gaussian transposes at once
+#define SINM__BOX_NARROW_RADIUS 64 //Widest box blur that runs on 16 bit sums, see sinm__box_divisor
+#define SINM__BOX_MAX_RADIUS16 16383 //Widest box blur of 16 bit samples sinm__box_divisor divides exactly
 
 #define sinm__min(a, b) ((a) < (b) ? (a) : (b))
 #define sinm__max(a, b) ((a) > (b) ? (a) : (b))
@@ -133,21 +432,217 @@ typedef struct
     int32_t x, y;
 } sinm__v2i;
 
+//NOTE: every block the library frees itself goes through sinm__malloc/sinm__free so sinm_memory_high_water()
+//sees it. Results handed to the caller(sinm_normal_map, sinm_composite_alloc) stay plain malloc
+static std::atomic<size_t> sinm__memoryCurrent;
+static std::atomic<size_t> sinm__memoryPeak;
+
+#define SINM__ALLOC_HEADER 16 //Keeps malloc's alignment for the block after the size
+
+static void*
+sinm__malloc(size_t size)
+{
+    uint8_t* block = (uint8_t*)malloc(size + SINM__ALLOC_HEADER);
+    if (!block) {
+        return NULL;
+    }
+    memcpy(block, &size, sizeof(size));
+    size_t current = sinm__memoryCurrent += size;
+    size_t peak = sinm__memoryPeak.load();
+    while (current > peak && !sinm__memoryPeak.compare_exchange_weak(peak, current)) {
+    }
+    return block + SINM__ALLOC_HEADER;
+}
+
+static void
+sinm__free(void* memory)
+{
+    if (!memory) {
+        return;
+    }
+    uint8_t* block = (uint8_t*)memory - SINM__ALLOC_HEADER;
+    size_t size;
+    memcpy(&size, block, sizeof(size));
+    sinm__memoryCurrent -= size;
+    free(block);
+}
+
+SINM_DEF size_t
+sinm_memory_high_water()
+{
+    return sinm__memoryPeak.load();
+}
+
+SINM_DEF size_t
+sinm_memory_in_use()
+{
+    return sinm__memoryCurrent.load();
+}
+
+SINM_DEF void
+sinm_memory_reset_high_water()
+{
+    sinm__memoryPeak = sinm__memoryCurrent.load();
+}
+
 typedef struct
 {
     float x, y, z;
 } sinm__v3;
 
-sinm__inline static float
-sinm__length(float x, float y, float z)
+//NOTE: Persistent worker pool used to split CPU stages into row bands.
+//Stages call sinm__parallel_rows() which runs serially until sinm_initialize_threads() is called.
+//"slot" is unique among the threads running bands of the same call and below sinm_thread_count(), for per thread scratch
+typedef void (*sinm__band_func)(void* data, int32_t ys, int32_t ye, int32_t slot);
+
+typedef struct
 {
-    return sqrtf(x * x + y * y + z * z);
+    sinm__band_func func;
+    void* data;
+    int32_t h;
+    int32_t bandHeight;
+    int32_t bandCount;
+    int32_t nextBand;
+    int32_t bandsDone;
+    int32_t slotsTaken;
+} sinm__band_job;
+
+typedef struct
+{
+    int32_t threadCount; //Includes the thread that submits work
+    std::thread workers[SINM_MAX_THREADS];
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint32_t generation;
+    int quit;
+    sinm__band_job* job;
+} sinm__thread_ctx;
+
+static sinm__thread_ctx* sinm__threadCtx = NULL;
+
+//Runs bands of "job" until none are left. Expects "lock" to be held and returns with it held
+static void
+sinm__run_bands(sinm__thread_ctx* ctx, sinm__band_job* job, std::unique_lock<std::mutex>& lock)
+{
+    int32_t slot = job->slotsTaken++;
+    while (job->nextBand < job->bandCount) {
+        int32_t band = job->nextBand++;
+        lock.unlock();
+        int32_t ys = band * job->bandHeight;
+        int32_t ye = sinm__min(job->h, ys + job->bandHeight);
+        job->func(job->data, ys, ye, slot);
+        lock.lock();
+        if (++job->bandsDone == job->bandCount) {
+            ctx->done.notify_all();
+        }
+    }
+}
+
+static void
+sinm__worker_main(sinm__thread_ctx* ctx)
+{
+    uint32_t seen = 0;
+    std::unique_lock<std::mutex> lock(ctx->mutex);
+    for (;;) {
+        ctx->wake.wait(lock, [&] { return ctx->quit || ctx->generation != seen; });
+        if (ctx->quit) {
+            break;
+        }
+        seen = ctx->generation;
+        if (ctx->job) {
+            sinm__run_bands(ctx, ctx->job, lock);
+        }
+    }
+}
+
+SINM_DEF void
+sinm_shutdown_threads()
+{
+    sinm__thread_ctx* ctx = sinm__threadCtx;
+    if (!ctx) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ctx->mutex);
+        ctx->quit = 1;
+    }
+    ctx->wake.notify_all();
+    for (int32_t i = 0; i < ctx->threadCount - 1; ++i) {
+        ctx->workers[i].join();
+    }
+
+    delete ctx;
+    sinm__threadCtx = NULL;
+}
+
+SINM_DEF void
+sinm_initialize_threads(int32_t threadCount)
+{
+    sinm_shutdown_threads();
+
+    if (threadCount <= 0) {
+        threadCount = (int32_t)std::thread::hardware_concurrency();
+    }
+    threadCount = sinm__max(1, sinm__min(SINM_MAX_THREADS, threadCount));
+    if (threadCount == 1) {
+        return;
+    }
+
+    sinm__thread_ctx* ctx = new sinm__thread_ctx();
+    ctx->threadCount = threadCount;
+    for (int32_t i = 0; i < threadCount - 1; ++i) {
+        ctx->workers[i] = std::thread(sinm__worker_main, ctx);
+    }
+    sinm__threadCtx = ctx;
+}
+
+SINM_DEF int32_t
+sinm_thread_count()
+{
+    return sinm__threadCtx ? sinm__threadCtx->threadCount : 1;
+}
+
+//Calls "func" over row bands covering [0, h). Band heights are multiples of SINM__MAX_SIMD_WIDTH so a
+//band of any image whose pixel count is a multiple of the SIMD width is one as well.
+//Runs on the calling thread alone if there is no pool or the pool is busy with another caller
+static void
+sinm__parallel_rows(int32_t h, sinm__band_func func, void* data)
+{
+    sinm__thread_ctx* ctx = sinm__threadCtx;
+    if (!ctx || h < 2 * SINM__MAX_SIMD_WIDTH) {
+        func(data, 0, h, 0);
+        return;
+    }
+
+    sinm__band_job job = { 0 };
+    job.func = func;
+    job.data = data;
+    job.h = h;
+    job.bandHeight = (h + ctx->threadCount * 4 - 1) / (ctx->threadCount * 4);
+    job.bandHeight = sinm__max(2 * SINM__MAX_SIMD_WIDTH, (job.bandHeight + SINM__MAX_SIMD_WIDTH - 1) / SINM__MAX_SIMD_WIDTH * SINM__MAX_SIMD_WIDTH);
+    job.bandCount = (h + job.bandHeight - 1) / job.bandHeight;
+
+    std::unique_lock<std::mutex> lock(ctx->mutex);
+    if (ctx->job) {
+        lock.unlock();
+        func(data, 0, h, 0);
+        return;
+    }
+    ctx->job = &job;
+    ctx->generation++;
+    ctx->wake.notify_all();
+
+    sinm__run_bands(ctx, &job, lock);
+    ctx->done.wait(lock, [&] { return job.bandsDone == job.bandCount; });
+    ctx->job = NULL;
 }
 
-sinm__inline static simd__float
-sinm__length_simd(simd__float x, simd__float y, simd__float z)
+sinm__inline static float
+sinm__length(float x, float y, float z)
 {
-    return simd__sqrt_ps(simd__add_ps(simd__add_ps(simd__mul_ps(x, x), simd__mul_ps(y, y)), simd__mul_ps(z, z)));
+    return sqrtf(x * x + y * y + z * z);
 }
 
 sinm__inline static sinm__v3
@@ -205,16 +700,6 @@ sinm__rgba_to_v3(uint32_t c)
     return result;
 }
 
-static sinm__inline void
-sinm__rgba_to_v3_simd(simd__int c, simd__float* x, simd__float* y, simd__float* z)
-{
-    simd__int ff = simd__set1_epi32(0xFF);
-    simd__int v127 = simd__set1_epi32(127);
-    *x = simd__cvtepi32_ps(simd__sub_epi32(simd__and_ix(simd__srli_epi32(c, 0), ff), v127));
-    *y = simd__cvtepi32_ps(simd__sub_epi32(simd__and_ix(simd__srli_epi32(c, 8), ff), v127));
-    *z = simd__cvtepi32_ps(simd__sub_epi32(simd__and_ix(simd__srli_epi32(c, 16), ff), v127));
-}
-
 static sinm__inline uint32_t
 sinm__unit_vector_to_rgba(sinm__v3 v)
 {
@@ -224,19 +709,6 @@ sinm__unit_vector_to_rgba(sinm__v3 v)
     return r | g << 8u | b << 16u | 255u << 24u;
 }
 
-static sinm__inline simd__int
-sinm__v3_to_rgba_simd(simd__float x, simd__float y, simd__float z)
-{
-    simd__float one = simd__set1_ps(1.0f);
-    simd__float v127 = simd__set1_ps(127.0f);
-    simd__int a = simd__set1_epi32(255u << 24u);
-    simd__int r = simd__cvtps_epi32(simd__mul_ps(simd__add_ps(one, x), v127));
-    simd__int g = simd__cvtps_epi32(simd__mul_ps(simd__add_ps(one, y), v127));
-    simd__int b = simd__cvtps_epi32(simd__mul_ps(simd__add_ps(one, z), v127));
-    simd__int c = simd__or_ix(simd__or_ix(simd__or_ix(r, simd__slli_epi32(g, 8)), simd__slli_epi32(b, 16)), a);
-    return c;
-}
-
 SINM_DEF void
 sinm__generate_gaussian_box(float* outBoxes, int32_t n, float sigma)
 {
@@ -254,159 +726,803 @@ sinm__generate_gaussian_box(float* outBoxes, int32_t n, float sigma)
     }
 }
 
-//NOTE: decently optimized box blur based on http://blog.ivank.net/fastest-gaussian-blur.html
-SINM_DEF void
-sinm__box_blur_h(uint32_t* in, uint32_t* out, int32_t w, int32_t h, float r)
-{
-    float invR = 1.0f / (r + r + 1);
-    for (int i = 0; i < h; ++i) {
-        int32_t oi = i * w;
-        int32_t li = oi;
-        int32_t ri = (int32_t)(oi + r);
-        uint32_t fv = in[oi] & 0xFFu;
-        uint32_t lv = in[oi + w - 1] & 0xFFu;
-        uint32_t sum = (uint32_t)((r + 1.0f) * fv);
-
-        for (int j = 0; j < r; ++j) {
-            sum += in[oi + j] & 0xFFu;
-        }
-        for (int j = 0; j <= r; ++j) {
-            sum += (in[ri++] & 0xFFu) - fv;
-            out[oi++] = sinm__greyscale_from_byte((uint8_t)(sum * invR));
-        }
-        for (int j = (int)r + 1; j < (w - r); ++j) {
-            sum += (in[ri++] & 0xFFu) - (in[li++] & 0xFFu);
-            out[oi++] = sinm__greyscale_from_byte((uint8_t)(sum * invR));
-        }
-        for (int j = (int)(w - r); j < w; ++j) {
-            sum += lv - (in[li++] & 0xFFu);
-            out[oi++] = sinm__greyscale_from_byte((uint8_t)(sum * invR));
-        }
+//Young-van Vliet recursive gaussian, "Recursive implementation of the Gaussian filter"(1995).
+//Coefficients are divided by b0 so each pass is out[n] = B * in[n] + a1 * out[n - 1] + a2 * out[n - 2] + a3 * out[n - 3].
+//"M" gives the anticausal pass at the last sample and the two past it as if the line went on with its
+//last sample forever(Triggs and Sdika, "Boundary conditions for Young-van Vliet recursive filtering", 2006)
+typedef struct
+{
+    double B, a1, a2, a3;
+    double M[3][3];
+} sinm__recursive_coefs;
+
+static void
+sinm__recursive_coefs_init(sinm__recursive_coefs* c, float sigma)
+{
+    double q;
+    if (sigma >= 2.5f) {
+        q = 0.98711 * sigma - 0.96330;
+    } else {
+        q = 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sinm__max(0.5f, sigma));
     }
+    double q2 = q * q;
+    double q3 = q2 * q;
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+    double b2 = -(1.4281 * q2 + 1.26661 * q3);
+    double b3 = 0.422205 * q3;
+
+    double a1 = c->a1 = b1 / b0;
+    double a2 = c->a2 = b2 / b0;
+    double a3 = c->a3 = b3 / b0;
+    //NOTE: not 1 - (a1 + a2 + a3), that cancels to almost nothing for large sigma
+    c->B = (b0 - b1 - b2 - b3) / b0;
+
+    //NOTE: the paper's filters have no gain, ours have B in each pass which scales M by B
+    double m = c->B / ((1.0 + a1 - a2 + a3) * (1.0 - a1 - a2 - a3) * (1.0 + a2 + (a1 - a3) * a3));
+    c->M[0][0] = m * (-a3 * a1 + 1.0 - a3 * a3 - a2);
+    c->M[0][1] = m * (a3 + a1) * (a2 + a3 * a1);
+    c->M[0][2] = m * a3 * (a1 + a3 * a2);
+    c->M[1][0] = m * (a1 + a3 * a2);
+    c->M[1][1] = -m * (a2 - 1.0) * (a2 + a3 * a1);
+    c->M[1][2] = -m * a3 * (a3 * a1 + a3 * a3 + a2 - 1.0);
+    c->M[2][0] = m * (a3 * a1 + a2 + a1 * a1 - a2 * a2);
+    c->M[2][1] = m * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3);
+    c->M[2][2] = m * a3 * (a1 + a3 * a2);
 }
 
-SINM_DEF void
-sinm__box_blur_v(uint32_t* in, uint32_t* out, int32_t w, int32_t h, float r)
-{
-    float invR = 1.0f / (r + r + 1);
-    for (int i = 0; i < w; ++i) {
-        int32_t oi = i;
-        int32_t li = oi;
-        int32_t ri = (int32_t)(oi + r * w);
-        uint32_t fv = in[oi] & 0xFFu;
-        uint32_t lv = in[oi + w * (h - 1)] & 0xFFu;
-        uint32_t sum = (uint32_t)((r + 1) * fv);
-
-        for (int j = 0; j < r; j++) {
-            sum += in[oi + j * w] & 0xFFu;
+//Divides the running sum of a box of radius "r" by its width d = 2r + 1 with a multiply and shift.
+//Both forms give floor(sum / d) exactly for every sum of 8 bit samples:
+//  16 bit: mulhi(sum, mul16) >> shift16, only while "narrow" so the sums fit 16 bits
+//  32 bit: (sum * mul32) >> shift32 with a 64 bit product
+//NOTE: with mul = ceil(2^k / d) the result is exact while 255 * d * (mul * d - 2^k) < 2^k. k = 16 + floor(log2(d))
+//holds up to d = 129(SINM__BOX_NARROW_RADIUS), k = 32 + floor(log2(d)) for any line length. The 32 bit form also
+//divides sums of 16 bit samples(65535 instead of 255 above) exactly up to d = 32767, see SINM__BOX_MAX_RADIUS16
+typedef struct
+{
+    int32_t r;
+    int narrow;
+    uint32_t mul16, shift16;
+    uint32_t mul32, shift32;
+} sinm__box_divisor;
+
+//NOTE: r = 0 is a copy and has no multiplier that fits, callers skip those passes
+static void
+sinm__box_divisor_init(sinm__box_divisor* d, int32_t r)
+{
+    assert(r > 0);
+    uint64_t width = (uint64_t)(r + r + 1);
+    uint32_t log2Width = 0;
+    while ((2ull << log2Width) <= width) {
+        ++log2Width;
+    }
+    d->r = r;
+    d->narrow = r <= SINM__BOX_NARROW_RADIUS;
+    d->shift16 = log2Width;
+    d->mul16 = (uint32_t)(((1ull << (16 + log2Width)) + width - 1) / width);
+    d->shift32 = 32 + log2Width;
+    d->mul32 = (uint32_t)(((1ull << (32 + log2Width)) + width - 1) / width);
+}
+
+static sinm__inline uint32_t
+sinm__box_divide(uint32_t sum, const sinm__box_divisor* d)
+{
+    return (uint32_t)(((uint64_t)sum * d->mul32) >> d->shift32);
+}
+
+#ifndef SINM_PYRAMID_MIN_SIGMA
+//NOTE: with less blur left the gradients interpolated up from the level are off by up to 18 of 255 at 2.0, the
+//first coarse level barely saves any time there
+#define SINM_PYRAMID_MIN_SIGMA 4.0f //Least blur, in pixels of the level, sinm_normal_map_pyramid leaves for a coarse level
+#endif
+#define SINM__PYRAMID_MIN_SIZE 8 //Levels stop halving before either side gets smaller than this
+
+#define SINM__INTEGRAL_BOXES 3
+#define SINM__INTEGRAL_MAX_RADIUS 1448 //Largest box whose sum of 8 bit samples fits in 31 bits
+
+//Gaussian approximated by a weighted sum of centered boxes that all read from one summed-area table
+//(Bhatia, Snyder and Bilbro, "Stacked integral image", 2010). The weights sum to 1
+typedef struct
+{
+    int32_t count;
+    int32_t r[SINM__INTEGRAL_BOXES];
+    float weight[SINM__INTEGRAL_BOXES];
+} sinm__integral_boxes;
+
+//Weights for the boxes of "b" that are closest, in the least squares sense, to the sampled 2D gaussian of "sigma"
+//while summing to 1. Normalized boxes of sizes a and b overlap by 1 / max(a, b)^2 and a box of size a covers
+//m^2 / a^2 of the gaussian, where m is the 1D gaussian's sum over the box, so only those 1D sums are needed
+static void
+sinm__integral_fit_weights(sinm__integral_boxes* b, float sigma)
+{
+    int32_t n = b->count;
+    double m[SINM__INTEGRAL_BOXES] = { 0 };
+    double total = 0.0;
+    int32_t reach = (int32_t)ceilf(4.0f * sigma);
+    for (int32_t i = -reach; i <= reach; ++i) {
+        double g = exp(-(double)i * i / (2.0 * sigma * sigma));
+        total += g;
+        for (int32_t k = 0; k < n; ++k) {
+            m[k] += (i >= -b->r[k] && i <= b->r[k]) ? g : 0.0;
         }
-        for (int j = 0; j <= r; j++) {
-            sum += (in[ri] & 0xFFu) - fv;
-            out[oi] = sinm__greyscale_from_byte((uint8_t)(sum * invR));
-            ri += w;
-            oi += w;
+    }
+
+    //NOTE: normal equations with a Lagrange multiplier for the sum in the last row and column
+    double a[SINM__INTEGRAL_BOXES + 1][SINM__INTEGRAL_BOXES + 2] = { { 0 } };
+    for (int32_t i = 0; i < n; ++i) {
+        double sizeI = 2.0 * b->r[i] + 1.0;
+        for (int32_t j = 0; j < n; ++j) {
+            double larger = 2.0 * sinm__max(b->r[i], b->r[j]) + 1.0;
+            a[i][j] = 1.0 / (larger * larger);
+        }
+        a[i][n] = 1.0;
+        a[n][i] = 1.0;
+        a[i][n + 1] = (m[i] / total) * (m[i] / total) / (sizeI * sizeI);
+    }
+    a[n][n + 1] = 1.0;
+
+    for (int32_t c = 0; c <= n; ++c) {
+        int32_t pivot = c;
+        for (int32_t row = c + 1; row <= n; ++row) {
+            pivot = (fabs(a[row][c]) > fabs(a[pivot][c])) ? row : pivot;
         }
-        for (int j = (int)(r + 1); j < h - r; j++) {
-            sum += (in[ri] & 0xFFu) - (in[li] & 0xFFu);
-            out[oi] = sinm__greyscale_from_byte((uint8_t)(sum * invR));
-            li += w;
-            ri += w;
-            oi += w;
+        for (int32_t col = 0; col <= n + 1; ++col) {
+            double t = a[c][col];
+            a[c][col] = a[pivot][col];
+            a[pivot][col] = t;
         }
-        for (int j = (int)(h - r); j < h; j++) {
-            sum += lv - (in[li] & 0xFFu);
-            out[oi] = sinm__greyscale_from_byte((uint8_t)(sum * invR));
-            li += w;
-            oi += w;
+        for (int32_t row = 0; row <= n; ++row) {
+            if (row != c) {
+                double f = a[row][c] / a[c][c];
+                for (int32_t col = c; col <= n + 1; ++col) {
+                    a[row][col] -= f * a[c][col];
+                }
+            }
         }
     }
+    for (int32_t k = 0; k < n; ++k) {
+        b->weight[k] = (float)(a[k][n + 1] / a[k][k]);
+    }
 }
 
-SINM_DEF void
-sinm__gaussian_box(uint32_t* in, uint32_t* out, int32_t w, int32_t h, float r)
+static void
+sinm__integral_boxes_init(sinm__integral_boxes* b, float sigma)
 {
-    float boxes[3];
-    sinm__generate_gaussian_box(boxes, sizeof(boxes) / sizeof(boxes[0]), r);
-
-    for (int i = 0; i < 3; ++i) {
-        sinm__box_blur_h(in, out, w, h, (boxes[i] - 1) / 2);
-        sinm__box_blur_v(out, in, w, h, (boxes[i] - 1) / 2);
+    //NOTE: half widths in sigmas that leave the least squares error against the 2D gaussian smallest. A fourth box
+    //only took the largest error on sinm_bench blur from about 7 to 6 of 255. Rounding to whole pixels moves small
+    //boxes off that fit(and can make two the same), so the weights are fit for the radii actually used
+    static const float halfWidths[SINM__INTEGRAL_BOXES] = { 0.90f, 1.40f, 2.15f };
+    b->count = 0;
+    for (int i = 0; i < SINM__INTEGRAL_BOXES; ++i) {
+        int32_t r = (int32_t)roundf(sinm__max(0.0f, halfWidths[i] * sigma - 0.5f));
+        r = sinm__min(SINM__INTEGRAL_MAX_RADIUS, r);
+        if (b->count == 0 || r != b->r[b->count - 1]) {
+            b->r[b->count++] = r;
+        }
     }
+    sinm__integral_fit_weights(b, sigma);
+}
 
-    memcpy(out, in, w * h * sizeof(uint32_t));
+//Scratch bytes sinm__integral_blur_row needs for rows "w" pixels wide: the column sums under each box, padded by
+//its radius on both sides
+static size_t
+sinm__integral_scratch_size(int32_t w, const sinm__integral_boxes* b)
+{
+    size_t size = 0;
+    for (int32_t k = 0; k < b->count; ++k) {
+        size += ((size_t)w + 1 + 2 * (size_t)b->r[k]) * sizeof(uint32_t);
+    }
+    return size;
 }
 
-#ifdef SI_NORMALMAP_GPU
-static const char* sinm__gaussian_blur_vert_shader_source = {
+//Every CPU stage with a SIMD version. si_normalmap_simd.h builds one table per instruction set
+typedef struct
+{
+    sinm_isa isa;
+    int32_t simdWidth; //Every kernel takes any pixel count, the remainder past a multiple of this is masked or padded
+    void (*greyscale)(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, sinm_greyscale_type type);
+    void (*greyscaleRow)(const uint32_t* in, uint8_t* out, int64_t n, sinm_greyscale_type type);
+    void (*floatHeightRow)(const float* in, uint16_t* out, int64_t n);
+    void (*boxBlurLine)(const uint8_t* in, uint8_t* out, int32_t n, int32_t stride, const sinm__box_divisor* d);
+    void (*boxBlurLine16)(const uint16_t* in, uint16_t* out, int32_t n, int32_t stride, const sinm__box_divisor* d);
+    void (*boxBlurH)(const uint8_t* in, uint8_t* out, int32_t ys, int32_t ye, int32_t w, int32_t h, const sinm__box_divisor* d, uint8_t* scratch);
+    void (*boxBlurV)(const uint8_t* in, uint8_t* out, int32_t ys, int32_t ye, int32_t w, int32_t h, const sinm__box_divisor* d);
+    void (*boxSlideRow)(uint32_t* sums, const uint8_t* add, const uint8_t* sub, uint8_t* out, int32_t n, const sinm__box_divisor* d);
+    void (*boxSlideRow16)(uint32_t* sums, const uint16_t* add, const uint16_t* sub, uint16_t* out, int32_t n, const sinm__box_divisor* d);
+    void (*recursiveGaussian)(const uint8_t* in, uint8_t* out, int32_t lines, int32_t lineStride, int32_t n, int32_t stride, const sinm__recursive_coefs* c, double* scratch);
+    void (*integralBlurRow)(const uint32_t* sums, uint8_t* out, int32_t y, int32_t w, int32_t h, const sinm__integral_boxes* b, uint8_t* scratch);
+    void (*sobelRow)(const uint8_t* rows[3], int32_t rx, uint32_t* out, int32_t xs, int32_t xe, int32_t w, float scale, int flipY);
+    void (*sobelRow16)(const uint16_t* rows[3], int32_t rx, uint32_t* out, int32_t xs, int32_t xe, int32_t w, float scale, int flipY);
+    void (*sobelGradientRow)(const uint8_t* rows[3], float* gx, float* gy, int32_t w);
+    void (*sobelGradientRow16)(const uint16_t* rows[3], float* gx, float* gy, int32_t w);
+    void (*encodeNormalsRow)(const float* gx, const float* gy, void* out, int32_t n, float scale, int flipY, sinm_output_format format);
+    void (*packRG8Row)(const uint32_t* in, uint8_t* out, int32_t n);
+    void (*compressBlockRow)(const uint32_t* rows[4], uint8_t* out, int32_t w, sinm_block_format format);
+    void (*gradientRow)(const float* gx0, const float* gy0, const float* gx1, const float* gy1, float t, uint32_t* out, int32_t n, float scale, int flipY);
+    void (*normalize)(uint32_t* in, int32_t w, int32_t h, float scale, int flipY);
+    void (*composite)(const uint32_t* in1, const uint32_t* in2, uint32_t* out, int32_t w, int32_t h);
+} sinm__kernel_table;
+
+//NOTE: must match the sinm_isa values, the preprocessor can't see enums
+#define SINM__ISA_SSE41 0
+#define SINM__ISA_AVX2 1
+#define SINM__ISA_AVX512 2
+
+#define SINM__PRAGMA_STRING(x) _Pragma(#x)
+#define SINM__PRAGMA(x) SINM__PRAGMA_STRING(x)
+
+#define SINM__ISA SINM__ISA_SSE41
+#include "si_normalmap_simd.h"
+#define SINM__ISA SINM__ISA_AVX2
+#include "si_normalmap_simd.h"
+#ifndef SINM_NO_AVX512
+#define SINM__ISA SINM__ISA_AVX512
+#include "si_normalmap_simd.h"
+#endif
 
-    "#version 410 core\n"
-    "layout (location = 0) in vec3 iPos;\n"
-    "layout (location = 1) in vec2 iTexCoords;\n"
-    "out vec2 TexCoords;\n"
-    "void main(){\n"
-    "   TexCoords = iTexCoords;\n"
-    "   gl_Position = vec4(iPos, 1.0);\n"
-    "}\n"
-};
-static const char* sinm__gaussian_blur_frag_shader_source = {
+static const sinm__kernel_table* sinm__forcedKernels = NULL;
 
-    "#version 410 core\n"
-    "out vec4 FragColor;\n"
-    "in vec2 TexCoords;\n"
-    "uniform sampler2D image;\n"
-    "uniform bool horizontal;\n"
-    "uniform float weight[5] = float[] (0.227027, 0.1945946, 0.1216216, 0.054054, 0.016216);\n"
-    "void main() {\n"
-    "    vec2 tex_offset = 1.0 / textureSize(image, 0); // gets size of single texel\n"
-    "    vec3 result = texture(image, TexCoords).rgb * weight[0]; // current fragment's contribution\n"
-    "    if(horizontal) {\n"
-    "        for(int i = 1; i < 5; ++i) {\n"
-    "            result += texture(image, TexCoords + vec2(tex_offset.x * i, 0.0)).rgb * weight[i];\n"
-    "            result += texture(image, TexCoords - vec2(tex_offset.x * i, 0.0)).rgb * weight[i];\n"
-    "        }\n"
-    "    } else {\n"
-    "        for(int i = 1; i < 5; ++i) {\n"
-    "            result += texture(image, TexCoords + vec2(0.0, tex_offset.y * i)).rgb * weight[i];\n"
-    "            result += texture(image, TexCoords - vec2(0.0, tex_offset.y * i)).rgb * weight[i];\n"
-    "        }\n"
-    "    }\n"
-    "    FragColor = vec4(result, 1.0);\n"
-    "}\n"
-};
+static const sinm__kernel_table*
+sinm__kernels_for(sinm_isa isa)
+{
+    switch (isa) {
+#ifndef SINM_NO_AVX512
+    case sinm_isa_avx512: return &sinm__avx512::kernels;
+#endif
+    case sinm_isa_avx2: return &sinm__avx2::kernels;
+    default: return &sinm__sse41::kernels;
+    }
+}
 
-typedef struct
+SINM_DEF sinm_isa
+sinm_detect_isa()
 {
-    int initialized;
-    uint32_t inTex;
-    uint32_t quadVAO;
-    uint32_t pingpongFBO[2];
-    uint32_t pingpongBuffers[2];
+    int sse41, avx2, avx512;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    sse41 = (info[2] >> 19) & 1;
+    unsigned long long xcr0 = ((info[2] >> 27) & 1) ? _xgetbv(0) : 0; //OSXSAVE
+    avx2 = avx512 = 0;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = ((info[1] >> 5) & 1) && (xcr0 & 0x6) == 0x6;
+        //F, DQ, BW and VL plus OS support for the zmm/mask registers
+        avx512 = ((unsigned)info[1] & 0xC0030000u) == 0xC0030000u && (xcr0 & 0xE6) == 0xE6;
+    }
+#else
+    __builtin_cpu_init();
+    sse41 = __builtin_cpu_supports("sse4.1");
+    avx2 = __builtin_cpu_supports("avx2");
+    avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+#endif
+    assert(sse41); //SSE4.1 is the minimum the kernels are built for
+    (void)sse41;
 
-    uint32_t greyscaleAverageShader;
-    uint32_t greyscaleLuminanceShader;
-    uint32_t greyscaleLightnessShader;
-    uint32_t blurShader;
-    uint32_t normalMapShader;
-    uint32_t normalizeShader;
-    uint32_t compositeShader;
-} sinm__opengl_ctx;
+#ifndef SINM_NO_AVX512
+    if (avx512) {
+        return sinm_isa_avx512;
+    }
+#endif
+    return avx2 ? sinm_isa_avx2 : sinm_isa_sse41;
+}
 
-static sinm__opengl_ctx sinm__glCtx = { 0 };
+//Kernels for the best instruction set the CPU supports unless sinm_force_isa() picked one
+static const sinm__kernel_table*
+sinm__kernels()
+{
+    if (sinm__forcedKernels) {
+        return sinm__forcedKernels;
+    }
+    static const sinm__kernel_table* detected = sinm__kernels_for(sinm_detect_isa());
+    return detected;
+}
 
-SINM_DEF void
-sinm_initialize_opengl()
+SINM_DEF int
+sinm_force_isa(sinm_isa isa)
 {
-    const float quadVertices[] = {
-        // positions        // texture Coords
-        -1.0f, 1.0f, 0.0f, 0.0f, 1.0f, //1
-        -1.0f, -1.0f, 0.0f, 0.0f, 0.0f, //2
-        1.0f, 1.0f, 0.0f, 1.0f, 1.0f, //3
-        1.0f, -1.0f, 0.0f, 1.0f, 0.0f, //4
-    };
+    if (isa > sinm_detect_isa()) {
+        return 0;
+    }
+    sinm__forcedKernels = sinm__kernels_for(isa);
+    return 1;
+}
 
-    if (!sinm__glCtx.initialized) {
-        glGenTextures(1, &sinm__glCtx.inTex);
+SINM_DEF sinm_isa
+sinm_active_isa()
+{
+    return sinm__kernels()->isa;
+}
+
+SINM_DEF const char*
+sinm_isa_name(sinm_isa isa)
+{
+    switch (isa) {
+    case sinm_isa_sse41: return "sse4.1";
+    case sinm_isa_avx2: return "avx2";
+    case sinm_isa_avx512: return "avx512";
+    default: return "unknown";
+    }
+}
+
+//Box radii used by sinm__gaussian_box. Returns the number of pixels the blur reaches.
+static int32_t
+sinm__gaussian_box_radii(int32_t* outRadii, float r)
+{
+    float boxes[3];
+    sinm__generate_gaussian_box(boxes, sizeof(boxes) / sizeof(boxes[0]), r);
+
+    int32_t reach = 0;
+    for (int i = 0; i < 3; ++i) {
+        outRadii[i] = (int32_t)((boxes[i] - 1) / 2);
+        reach += outRadii[i];
+    }
+    return reach;
+}
+
+//Scratch bytes the horizontal box blur needs for rows "w" pixels wide
+static size_t
+sinm__box_blur_h_scratch_size(int32_t w)
+{
+    return 2 * (size_t)w * SINM__BOX_ROWS;
+}
+
+//Scratch bytes the recursive gaussian needs for lines "n" pixels long: the causal pass of a register of lines, then
+//a block of rows transposed and blurred
+static size_t
+sinm__recursive_scratch_size(int32_t n)
+{
+    return (size_t)n * SINM__MAX_SIMD_WIDTH / 2 * sizeof(double) + 2 * (size_t)n * SINM__RECURSIVE_ROWS;
+}
+
+static size_t
+sinm__align_scratch(size_t size)
+{
+    return (size + SINM_SCRATCH_ALIGN - 1) / SINM_SCRATCH_ALIGN * SINM_SCRATCH_ALIGN;
+}
+
+//Per thread scratch bytes the bands of a "blurType" blur need, rounded so every slot stays aligned
+static size_t
+sinm__blur_slot_size(int32_t w, int32_t h, sinm_blur_type blurType)
+{
+    if (blurType == sinm_blur_recursive) {
+        return sinm__align_scratch(sinm__recursive_scratch_size(sinm__max(w, h)));
+    }
+    return sinm__align_scratch(sinm__box_blur_h_scratch_size(w));
+}
+
+//Returns 0 if scratch memory could not be allocated
+SINM_DEF int
+sinm__box_blur_h(const uint8_t* in, uint8_t* out, int32_t w, int32_t h, int32_t r)
+{
+    uint8_t* scratch = (uint8_t*)sinm__malloc(sinm__box_blur_h_scratch_size(w));
+    if (!scratch) {
+        return 0;
+    }
+    sinm__box_divisor d;
+    sinm__box_divisor_init(&d, r);
+    sinm__kernels()->boxBlurH(in, out, 0, h, w, h, &d, scratch);
+    sinm__free(scratch);
+    return 1;
+}
+
+SINM_DEF void
+sinm__box_blur_v(const uint8_t* in, uint8_t* out, int32_t w, int32_t h, int32_t r)
+{
+    sinm__box_divisor d;
+    sinm__box_divisor_init(&d, r);
+    sinm__kernels()->boxBlurV(in, out, 0, h, w, h, &d);
+}
+
+typedef struct
+{
+    const uint32_t* in;
+    const uint32_t* in2;
+    uint32_t* out;
+    int32_t w, h;
+    float scale;
+    int flipY;
+    sinm_greyscale_type greyscaleType;
+    const uint8_t* height; //Single channel planes the blur and sobel stages work on
+    uint8_t* heightOut;
+    const sinm__box_divisor* divisor;
+    const sinm__recursive_coefs* coefs;
+    const sinm__integral_boxes* boxes;
+    uint8_t* scratch; //Per thread scratch, "scratchStride" bytes for each slot. NULL makes bands allocate their own
+    size_t scratchStride;
+    float* gradients; //gx then gy planes of a pyramid level "level" that is levelW x levelH
+    int32_t level, levelW, levelH;
+    int failed; //Set by bands that could not allocate their scratch
+} sinm__band_args;
+
+//"size" bytes of scratch for the band running in "slot", from the caller's scratch if there is any.
+//Hand it back with sinm__band_scratch_release()
+static void*
+sinm__band_scratch(const sinm__band_args* a, int32_t slot, size_t size)
+{
+    if (a->scratch) {
+        assert(size <= a->scratchStride);
+        return a->scratch + slot * a->scratchStride;
+    }
+    return sinm__malloc(size);
+}
+
+static void
+sinm__band_scratch_release(const sinm__band_args* a, void* scratch)
+{
+    if (!a->scratch) {
+        sinm__free(scratch);
+    }
+}
+
+static void
+sinm__box_blur_h_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    uint8_t* scratch = (uint8_t*)sinm__band_scratch(a, slot, sinm__box_blur_h_scratch_size(a->w));
+    if (!scratch) {
+        a->failed = 1;
+        return;
+    }
+    sinm__kernels()->boxBlurH(a->height, a->heightOut, ys, ye, a->w, a->h, a->divisor, scratch);
+    sinm__band_scratch_release(a, scratch);
+}
+
+static void
+sinm__box_blur_v_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    sinm__kernels()->boxBlurV(a->height, a->heightOut, ys, ye, a->w, a->h, a->divisor);
+}
+
+//Blurs the single channel plane "height" in place. "temp" is scratch of the same size and "scratch" holds
+//sinm_thread_count() slots of sinm__blur_slot_size() bytes, or is NULL to allocate per band.
+//Returns 0 if scratch memory could not be allocated
+SINM_DEF int
+sinm__gaussian_box(uint8_t* height, uint8_t* temp, uint8_t* scratch, int32_t w, int32_t h, float r)
+{
+    int32_t radii[3];
+    sinm__gaussian_box_radii(radii, r);
+
+    sinm__band_args horizontal = { NULL, NULL, NULL, w, h };
+    sinm__band_args vertical = { NULL, NULL, NULL, w, h };
+    horizontal.height = height;
+    horizontal.heightOut = temp;
+    horizontal.scratch = scratch;
+    horizontal.scratchStride = sinm__blur_slot_size(w, h, sinm_blur_box);
+    vertical.height = temp;
+    vertical.heightOut = height;
+    for (int i = 0; i < 3; ++i) {
+        if (radii[i] == 0) {
+            continue;
+        }
+        sinm__box_divisor d;
+        sinm__box_divisor_init(&d, radii[i]);
+        horizontal.divisor = vertical.divisor = &d;
+        sinm__parallel_rows(h, sinm__box_blur_h_band, &horizontal);
+        sinm__parallel_rows(h, sinm__box_blur_v_band, &vertical);
+    }
+    return !horizontal.failed;
+}
+
+//Filters rows [ys, ye) of "height" into "heightOut"
+static void
+sinm__recursive_gaussian_h_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    double* scratch = (double*)sinm__band_scratch(a, slot, sinm__recursive_scratch_size(a->w));
+    if (!scratch) {
+        a->failed = 1;
+        return;
+    }
+    sinm__kernels()->recursiveGaussian(&a->height[(size_t)ys * a->w], &a->heightOut[(size_t)ys * a->w], ye - ys, a->w, a->w, 1, a->coefs, scratch);
+    sinm__band_scratch_release(a, scratch);
+}
+
+//Filters columns [xs, xe) of "height" into "heightOut". Split with sinm__parallel_rows over the
+//width since every column runs from the top of the image to the bottom
+static void
+sinm__recursive_gaussian_v_band(void* data, int32_t xs, int32_t xe, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    double* scratch = (double*)sinm__band_scratch(a, slot, sinm__recursive_scratch_size(a->h));
+    if (!scratch) {
+        a->failed = 1;
+        return;
+    }
+    sinm__kernels()->recursiveGaussian(&a->height[xs], &a->heightOut[xs], xe - xs, 1, a->h, a->w, a->coefs, scratch);
+    sinm__band_scratch_release(a, scratch);
+}
+
+//Recursive gaussian of the single channel plane "height" in place. "temp" and "scratch" are the same as for
+//sinm__gaussian_box. Costs the same for any sigma. Returns 0 if scratch memory could not be allocated
+SINM_DEF int
+sinm__gaussian_recursive(uint8_t* height, uint8_t* temp, uint8_t* scratch, int32_t w, int32_t h, float sigma)
+{
+    sinm__recursive_coefs coefs;
+    sinm__recursive_coefs_init(&coefs, sigma);
+
+    sinm__band_args horizontal = { NULL, NULL, NULL, w, h };
+    horizontal.height = height;
+    horizontal.heightOut = temp;
+    horizontal.coefs = &coefs;
+    horizontal.scratch = scratch;
+    horizontal.scratchStride = sinm__blur_slot_size(w, h, sinm_blur_recursive);
+    sinm__parallel_rows(h, sinm__recursive_gaussian_h_band, &horizontal);
+
+    sinm__band_args vertical = { NULL, NULL, NULL, w, h };
+    vertical.height = temp;
+    vertical.heightOut = height;
+    vertical.coefs = &coefs;
+    vertical.scratch = scratch;
+    vertical.scratchStride = horizontal.scratchStride;
+    sinm__parallel_rows(w, sinm__recursive_gaussian_v_band, &vertical);
+
+    return !horizontal.failed && !vertical.failed;
+}
+
+#ifdef SI_NORMALMAP_GPU
+static const char* sinm__gaussian_blur_vert_shader_source = {
+
+    "#version 410 core\n"
+    "layout (location = 0) in vec3 iPos;\n"
+    "layout (location = 1) in vec2 iTexCoords;\n"
+    "out vec2 TexCoords;\n"
+    "void main(){\n"
+    "   TexCoords = iTexCoords;\n"
+    "   gl_Position = vec4(iPos, 1.0);\n"
+    "}\n"
+};
+static const char* sinm__gaussian_blur_frag_shader_source = {
+
+    "#version 410 core\n"
+    "out vec4 FragColor;\n"
+    "in vec2 TexCoords;\n"
+    "uniform sampler2D image;\n"
+    "uniform bool horizontal;\n"
+    "uniform float weight[5] = float[] (0.227027, 0.1945946, 0.1216216, 0.054054, 0.016216);\n"
+    "void main() {\n"
+    "    vec2 tex_offset = 1.0 / textureSize(image, 0); // gets size of single texel\n"
+    "    vec3 result = texture(image, TexCoords).rgb * weight[0]; // current fragment's contribution\n"
+    "    if(horizontal) {\n"
+    "        for(int i = 1; i < 5; ++i) {\n"
+    "            result += texture(image, TexCoords + vec2(tex_offset.x * i, 0.0)).rgb * weight[i];\n"
+    "            result += texture(image, TexCoords - vec2(tex_offset.x * i, 0.0)).rgb * weight[i];\n"
+    "        }\n"
+    "    } else {\n"
+    "        for(int i = 1; i < 5; ++i) {\n"
+    "            result += texture(image, TexCoords + vec2(0.0, tex_offset.y * i)).rgb * weight[i];\n"
+    "            result += texture(image, TexCoords - vec2(0.0, tex_offset.y * i)).rgb * weight[i];\n"
+    "        }\n"
+    "    }\n"
+    "    FragColor = vec4(result, 1.0);\n"
+    "}\n"
+};
+
+#define SINM_GPU_MAX_PASSES 16 //Blur passes per direction one compute dispatch does, more take extra dispatches
+#define SINM__GPU_STRING_(x) #x
+#define SINM__GPU_STRING(x) SINM__GPU_STRING_(x)
+
+//Compute backend, horizontal half: greyscale(greyscaleType 0 reads red, like a height texture) and "passes" horizontal
+//blur passes over a row segment and its halo in shared memory.
+//NOTE: the images have no format qualifiers, they are bound with the format of the height or output texture
+//NOTE: greyscaleType values must match sinm_greyscale_type, the formulas match the greyscale_*.frag shaders
+static const char* sinm__blur_h_compute_source = {
+    "#define SINM_LINE 256\n"
+    "layout (local_size_x = SINM_LINE) in;\n"
+    "uniform sampler2D image;\n"
+    "uniform writeonly image2D blurred;\n"
+    "uniform int greyscaleType;\n"
+    "uniform int passes;\n"
+    "const float weight[5] = float[] (0.227027, 0.1945946, 0.1216216, 0.054054, 0.016216);\n"
+    "shared float line[2][SINM_LINE + 8 * SINM_MAX_PASSES];\n"
+    "int x0, n, w;\n"
+    "float height(vec4 c) {\n"
+    "    if (greyscaleType == 1) return max(c.r, max(c.g, c.b));\n"
+    "    if (greyscaleType == 2) return (c.r + c.g + c.b) / 3.0;\n"
+    "    if (greyscaleType == 3) return 0.21 * c.r + 0.72 * c.g + 0.07 * c.b;\n"
+    "    return c.r;\n"
+    "}\n"
+    "//Pixel i of the segment, clamped to the image like a texture fetch\n"
+    "float tap(int src, int i) {\n"
+    "    return line[src][clamp(clamp(x0 + i, 0, w - 1) - x0, 0, n - 1)];\n"
+    "}\n"
+    "void main() {\n"
+    "    w = textureSize(image, 0).x;\n"
+    "    int reach = 4 * passes;\n"
+    "    n = SINM_LINE + 2 * reach;\n"
+    "    x0 = int(gl_WorkGroupID.x) * SINM_LINE - reach;\n"
+    "    int y = int(gl_WorkGroupID.y);\n"
+    "    int id = int(gl_LocalInvocationIndex);\n"
+    "    for (int i = id; i < n; i += SINM_LINE) {\n"
+    "        line[0][i] = height(texelFetch(image, ivec2(clamp(x0 + i, 0, w - 1), y), 0));\n"
+    "    }\n"
+    "    barrier();\n"
+    "    int src = 0;\n"
+    "    for (int p = 0; p < passes; ++p) {\n"
+    "        //NOTE: pixels within 4 of the last pass's edge are never read again, each pass skips 4 more\n"
+    "        for (int i = 4 * (p + 1) + id; i < n - 4 * (p + 1); i += SINM_LINE) {\n"
+    "            float r = line[src][i] * weight[0];\n"
+    "            for (int t = 1; t < 5; ++t) {\n"
+    "                r += tap(src, i + t) * weight[t];\n"
+    "                r += tap(src, i - t) * weight[t];\n"
+    "            }\n"
+    "            line[1 - src][i] = r;\n"
+    "        }\n"
+    "        barrier();\n"
+    "        src = 1 - src;\n"
+    "    }\n"
+    "    int x = x0 + reach + id;\n"
+    "    if (x < w) {\n"
+    "        imageStore(blurred, ivec2(x, y), vec4(line[src][reach + id]));\n"
+    "    }\n"
+    "}\n"
+};
+
+//Compute backend, vertical half: "passes" vertical blur passes over a tile and its halo in shared memory, then with
+//SINM_SOBEL the sobel kernels of normal_map.frag on the same tile. Tiles are taller than wide so less of the shared
+//memory goes to the halo
+static const char* sinm__blur_v_compute_source = {
+    "#define SINM_TILE_W 16\n"
+    "#define SINM_TILE_H 32\n"
+    "layout (local_size_x = SINM_TILE_W, local_size_y = 16) in;\n"
+    "uniform sampler2D image;\n"
+    "#ifdef SINM_SOBEL\n"
+    "uniform writeonly image2D normals;\n"
+    "uniform float scale;\n"
+    "uniform float flipY;\n"
+    "#define SINM_BORDER 1\n"
+    "#else\n"
+    "uniform writeonly image2D blurred;\n"
+    "#define SINM_BORDER 0\n"
+    "#endif\n"
+    "#define SINM_COLUMNS (SINM_TILE_W + 2 * SINM_BORDER)\n"
+    "#define SINM_THREADS (SINM_TILE_W * 16)\n"
+    "uniform int passes;\n"
+    "const float weight[5] = float[] (0.227027, 0.1945946, 0.1216216, 0.054054, 0.016216);\n"
+    "shared float columns[2][SINM_COLUMNS * (SINM_TILE_H + 2 * (4 * SINM_MAX_PASSES + SINM_BORDER))];\n"
+    "int y0, rows;\n"
+    "ivec2 size;\n"
+    "//Tile row of image row gy, clamped to the image like a texture fetch\n"
+    "int row(int gy) {\n"
+    "    return clamp(clamp(gy, 0, size.y - 1) - y0, 0, rows - 1);\n"
+    "}\n"
+    "void main() {\n"
+    "    size = textureSize(image, 0);\n"
+    "    int reach = 4 * passes + SINM_BORDER;\n"
+    "    rows = SINM_TILE_H + 2 * reach;\n"
+    "    int x0 = int(gl_WorkGroupID.x) * SINM_TILE_W - SINM_BORDER;\n"
+    "    y0 = int(gl_WorkGroupID.y) * SINM_TILE_H - reach;\n"
+    "    int id = int(gl_LocalInvocationIndex);\n"
+    "    for (int i = id; i < SINM_COLUMNS * rows; i += SINM_THREADS) {\n"
+    "        ivec2 p = clamp(ivec2(x0 + i % SINM_COLUMNS, y0 + i / SINM_COLUMNS), ivec2(0), size - 1);\n"
+    "        columns[0][i] = texelFetch(image, p, 0).r;\n"
+    "    }\n"
+    "    barrier();\n"
+    "    int src = 0;\n"
+    "    for (int p = 0; p < passes; ++p) {\n"
+    "        //NOTE: rows within 4 of the last pass's edge are never read again, each pass skips 4 more\n"
+    "        int first = 4 * (p + 1) * SINM_COLUMNS;\n"
+    "        for (int i = first + id; i < SINM_COLUMNS * rows - first; i += SINM_THREADS) {\n"
+    "            int c = i % SINM_COLUMNS;\n"
+    "            int r = i / SINM_COLUMNS;\n"
+    "            float v = columns[src][i] * weight[0];\n"
+    "            for (int t = 1; t < 5; ++t) {\n"
+    "                v += columns[src][row(y0 + r + t) * SINM_COLUMNS + c] * weight[t];\n"
+    "                v += columns[src][row(y0 + r - t) * SINM_COLUMNS + c] * weight[t];\n"
+    "            }\n"
+    "            columns[1 - src][i] = v;\n"
+    "        }\n"
+    "        barrier();\n"
+    "        src = 1 - src;\n"
+    "    }\n"
+    "    for (int ty = int(gl_LocalInvocationID.y); ty < SINM_TILE_H; ty += 16) {\n"
+    "        ivec2 g = ivec2(x0 + SINM_BORDER + int(gl_LocalInvocationID.x), y0 + reach + ty);\n"
+    "        if (g.x >= size.x || g.y >= size.y) {\n"
+    "            continue;\n"
+    "        }\n"
+    "#ifdef SINM_SOBEL\n"
+    "        float xmag = 0.0;\n"
+    "        float ymag = 0.0;\n"
+    "        for (int a = 0; a < 3; ++a) {\n"
+    "            for (int b = 0; b < 3; ++b) {\n"
+    "                float v = columns[src][row(g.y + a - 1) * SINM_COLUMNS + clamp(g.x + b - 1, 0, size.x - 1) - x0];\n"
+    "                xmag += v * float(b - 1) * (a == 1 ? 2.0 : 1.0);\n"
+    "                ymag += v * float(a - 1) * (b == 1 ? 2.0 : 1.0);\n"
+    "            }\n"
+    "        }\n"
+    "        vec3 n = normalize(vec3(xmag * scale, ymag * scale * flipY, 1.0)) * 0.5 + 0.5;\n"
+    "        imageStore(normals, g, vec4(n, 1.0));\n"
+    "#else\n"
+    "        imageStore(blurred, g, vec4(columns[src][(g.y - y0) * SINM_COLUMNS + g.x - x0]));\n"
+    "#endif\n"
+    "    }\n"
+    "}\n"
+};
+
+#define SINM_GPU_POOL_SIZE 4 //Image sizes sinm__normal_map_gpu keeps intermediates for
+
+//Intermediates of sinm__normal_map_gpu for one image size. Every layer of an image shares them
+typedef struct
+{
+    int32_t w, h; //0 when the slot is empty
+    uint32_t inTex; //Upload target of sinm__normal_map_gpu, created on first use
+    uint32_t greyscaleFBO; //R32F heights of the fragment backend's greyscale pass, created on first use
+    uint32_t greyscaleTex;
+    uint32_t pingpongFBO[2];
+    uint32_t pingpongBuffers[2];
+    uint32_t computeBuffers[2]; //Heights of the compute backend, created on first use
+    uint64_t lastUse;
+} sinm__gpu_pool_entry;
+
+typedef struct
+{
+    int initialized;
+    uint32_t quadVAO;
+    sinm__gpu_pool_entry pool[SINM_GPU_POOL_SIZE];
+    uint64_t useCount;
+    sinm_gpu_stats stats;
+
+    uint32_t greyscaleAverageShader;
+    uint32_t greyscaleLuminanceShader;
+    uint32_t greyscaleLightnessShader;
+    uint32_t blurShader;
+    uint32_t normalMapShader;
+    uint32_t normalizeShader;
+    uint32_t compositeShader;
+    uint32_t blurHCompute; //0 when compute shaders aren't available(before OpenGL 4.3)
+    uint32_t blurVCompute;
+    uint32_t blurVSobelCompute;
+    sinm_gpu_backend backend;
+    sinm_gpu_height_format heightFormat;
+    int bufferStorage; //glBufferStorage is there(OpenGL 4.4), sinm_gpu_source keeps its upload buffer mapped
+} sinm__opengl_ctx;
+
+static sinm__opengl_ctx sinm__glCtx = { 0 };
+
+//Compute program from "source" with "defines" in front, or 0 if it doesn't compile(e.g. in an OpenGL 4.1 context)
+static uint32_t
+sinm__gpu_compute_program(const char* defines, const char* source)
+{
+    const char* sources[3] = { "#version 430 core\n", defines, source };
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    if (!shader) {
+        glGetError();
+        return 0;
+    }
+    glShaderSource(shader, 3, sources, NULL);
+    glCompileShader(shader);
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    GLuint program = 0;
+    if (ok) {
+        program = glCreateProgram();
+        glAttachShader(program, shader);
+        glLinkProgram(program);
+        glGetProgramiv(program, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+    glDeleteShader(shader);
+    return program;
+}
+
+SINM_DEF void
+sinm_initialize_opengl()
+{
+    const float quadVertices[] = {
+        // positions        // texture Coords
+        -1.0f, 1.0f, 0.0f, 0.0f, 1.0f, //1
+        -1.0f, -1.0f, 0.0f, 0.0f, 0.0f, //2
+        1.0f, 1.0f, 0.0f, 1.0f, 1.0f, //3
+        1.0f, -1.0f, 0.0f, 1.0f, 0.0f, //4
+    };
 
+    if (!sinm__glCtx.initialized) {
         uint32_t quadVBO;
         glGenVertexArrays(1, &sinm__glCtx.quadVAO);
         glGenBuffers(1, &quadVBO);
@@ -478,554 +1594,2121 @@ sinm_initialize_opengl()
             assert(program != 0);
             sinm__glCtx.compositeShader = program;
         }
+        {
+            const char* defines = "#define SINM_MAX_PASSES " SINM__GPU_STRING(SINM_GPU_MAX_PASSES) "\n";
+            const char* sobelDefines = "#define SINM_MAX_PASSES " SINM__GPU_STRING(SINM_GPU_MAX_PASSES) "\n#define SINM_SOBEL\n";
+            sinm__glCtx.blurHCompute = sinm__gpu_compute_program(defines, sinm__blur_h_compute_source);
+            sinm__glCtx.blurVCompute = sinm__gpu_compute_program(defines, sinm__blur_v_compute_source);
+            sinm__glCtx.blurVSobelCompute = sinm__gpu_compute_program(sobelDefines, sinm__blur_v_compute_source);
+            if (sinm__glCtx.blurHCompute && sinm__glCtx.blurVCompute && sinm__glCtx.blurVSobelCompute) {
+                sinm__glCtx.backend = sinm_gpu_backend_compute;
+            } else {
+                //NOTE: glDeleteProgram ignores 0, so whichever programs did compile are freed here
+                glDeleteProgram(sinm__glCtx.blurHCompute);
+                glDeleteProgram(sinm__glCtx.blurVCompute);
+                glDeleteProgram(sinm__glCtx.blurVSobelCompute);
+                sinm__glCtx.blurHCompute = 0;
+                sinm__glCtx.blurVCompute = 0;
+                sinm__glCtx.blurVSobelCompute = 0;
+            }
+        }
+        {
+            GLint major = 0, minor = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            glGetIntegerv(GL_MINOR_VERSION, &minor);
+            sinm__glCtx.bufferStorage = major > 4 || (major == 4 && minor >= 4);
+        }
+        sinm__glCtx.heightFormat = sinm_gpu_height_r16;
         sinm__glCtx.initialized = 1;
         assert(!glsys::report_errors());
     }
 }
 
-//NOTE: GPU -> RAM copy is slow. Only use this function if you really need to(such as writing the data to a file)
-SINM_DEF void
-sinm_gpu_normal_map_to_buffer(uint32_t* out, uint32_t inFBO, int32_t w, int32_t h)
+//Picks how sinm__normal_map_gpu runs. The compute backend is the default when the context has OpenGL 4.3.
+//Returns 0 if "backend" isn't available
+SINM_DEF int
+sinm_gpu_set_backend(sinm_gpu_backend backend)
+{
+    assert(sinm__glCtx.initialized);
+    if (backend == sinm_gpu_backend_compute && !sinm__glCtx.blurHCompute) {
+        return 0;
+    }
+    sinm__glCtx.backend = backend;
+    return 1;
+}
+
+SINM_DEF sinm_gpu_backend
+sinm_gpu_get_backend()
+{
+    return sinm__glCtx.backend;
+}
+
+static uint32_t
+sinm__gpu_height_internal_format()
+{
+    switch (sinm__glCtx.heightFormat) {
+    case sinm_gpu_height_r32f: return GL_R32F;
+    case sinm_gpu_height_r16f: return GL_R16F;
+    case sinm_gpu_height_r16: return GL_R16;
+    default: assert(false); return 0;
+    }
+}
+
+static uint32_t
+sinm__gpu_output_internal_format(sinm_gpu_output_format format)
+{
+    switch (format) {
+    case sinm_gpu_output_rgba32f: return GL_RGBA32F;
+    case sinm_gpu_output_rgba16: return GL_RGBA16;
+    case sinm_gpu_output_rgba8: return GL_RGBA8;
+    case sinm_gpu_output_rg8: return GL_RG8;
+    default: assert(false); return 0;
+    }
+}
+
+SINM_DEF sinm_gpu_stats
+sinm_gpu_get_stats()
+{
+    return sinm__glCtx.stats;
+}
+
+static size_t
+sinm__gl_texel_size(int32_t internalFormat)
+{
+    switch (internalFormat) {
+    case GL_R8: return 1;
+    case GL_RG8: return 2;
+    case GL_R16: return 2;
+    case GL_R16F: return 2;
+    case GL_RGBA8: return 4;
+    case GL_R32F: return 4;
+    case GL_RGBA16: return 8;
+    case GL_RGBA16F: return 8;
+    case GL_RGBA32F: return 16;
+    default: assert(false); return 0;
+    }
+}
+
+//Immutable single level texture with clamped linear sampling, counted in sinm_gpu_get_stats()
+static uint32_t
+sinm__gpu_texture_create(int32_t w, int32_t h, uint32_t internalFormat)
+{
+    uint32_t result;
+    glGenTextures(1, &result);
+    glBindTexture(GL_TEXTURE_2D, result);
+    glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, w, h);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    sinm__glCtx.stats.allocations++;
+    sinm__glCtx.stats.textures++;
+    sinm__glCtx.stats.bytesResident += (size_t)w * h * sinm__gl_texel_size(internalFormat);
+    return result;
+}
+
+static void
+sinm__gpu_texture_delete(uint32_t texture)
+{
+    if (!texture) {
+        return;
+    }
+    GLint w, h, internalFormat;
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDeleteTextures(1, &texture);
+
+    sinm__glCtx.stats.textures--;
+    sinm__glCtx.stats.bytesResident -= (size_t)w * h * sinm__gl_texel_size(internalFormat);
+}
+
+//Framebuffer rendering into "texture"
+static uint32_t
+sinm__gpu_framebuffer_create(uint32_t texture)
+{
+    uint32_t result;
+    glGenFramebuffers(1, &result);
+    glBindFramebuffer(GL_FRAMEBUFFER, result);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return result;
+}
+
+static void
+sinm__gpu_pool_release_entry(sinm__gpu_pool_entry* e)
+{
+    if (e->w == 0) {
+        return;
+    }
+    sinm__gpu_texture_delete(e->inTex);
+    glDeleteFramebuffers(1, &e->greyscaleFBO);
+    sinm__gpu_texture_delete(e->greyscaleTex);
+    glDeleteFramebuffers(2, e->pingpongFBO);
+    for (int i = 0; i < 2; ++i) {
+        sinm__gpu_texture_delete(e->pingpongBuffers[i]);
+        sinm__gpu_texture_delete(e->computeBuffers[i]);
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+//Intermediates for a "w" x "h" image. Sizes not in the pool take an empty slot or the least recently used one
+static sinm__gpu_pool_entry*
+sinm__gpu_pool_get(int32_t w, int32_t h)
+{
+    sinm__gpu_pool_entry* result = NULL;
+    for (int i = 0; i < SINM_GPU_POOL_SIZE && !result; ++i) {
+        if (sinm__glCtx.pool[i].w == w && sinm__glCtx.pool[i].h == h) {
+            result = &sinm__glCtx.pool[i];
+        }
+    }
+
+    if (result) {
+        sinm__glCtx.stats.poolHits++;
+    } else {
+        //NOTE: empty slots have lastUse 0 so they go before any size in use
+        result = &sinm__glCtx.pool[0];
+        for (int i = 1; i < SINM_GPU_POOL_SIZE; ++i) {
+            if (sinm__glCtx.pool[i].lastUse < result->lastUse) {
+                result = &sinm__glCtx.pool[i];
+            }
+        }
+        sinm__gpu_pool_release_entry(result);
+        result->w = w;
+        result->h = h;
+        for (int i = 0; i < 2; ++i) {
+            result->pingpongBuffers[i] = sinm__gpu_texture_create(w, h, sinm__gpu_height_internal_format());
+            result->pingpongFBO[i] = sinm__gpu_framebuffer_create(result->pingpongBuffers[i]);
+        }
+    }
+    result->lastUse = ++sinm__glCtx.useCount;
+    return result;
+}
+
+//Deletes every pooled intermediate, e.g. after the image being edited is closed. Results are not touched
+SINM_DEF void
+sinm_gpu_pool_release()
+{
+    for (int i = 0; i < SINM_GPU_POOL_SIZE; ++i) {
+        sinm__gpu_pool_release_entry(&sinm__glCtx.pool[i]);
+    }
+}
+
+//Picks the format sinm__normal_map_gpu blurs heights in. The 16 bit formats move an eighth of the bytes per blur pass
+//that the RGBA32F intermediates of the fragment backend used to. Empties the pool when the format changes.
+//NOTE: greyscale heights stay float(the compute backend keeps them in shared memory, the fragment backend and
+//sinm_gpu_source in R32F) so every backend and sinm_normal_map_gpu_source() blur the same values
+SINM_DEF void
+sinm_gpu_set_height_format(sinm_gpu_height_format format)
+{
+    assert(sinm__glCtx.initialized);
+    assert(format >= 0 && format < sinm_gpu_height_count);
+    if (format != sinm__glCtx.heightFormat) {
+        sinm_gpu_pool_release();
+        sinm__glCtx.heightFormat = format;
+    }
+}
+
+SINM_DEF sinm_gpu_height_format
+sinm_gpu_get_height_format()
+{
+    return sinm__glCtx.heightFormat;
+}
+
+//Deletes a result of sinm_normal_map_gpu
+SINM_DEF void
+sinm_free_gpu_buffer(sinm_gpu_buffer* buffer)
+{
+    glDeleteFramebuffers(1, &buffer->fbo);
+    sinm__gpu_texture_delete(buffer->buffer);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+//NOTE: GPU -> RAM copy is slow. Only use this function if you really need to(such as writing the data to a file).
+//It waits for every queued pass, sinm_gpu_readback_begin() doesn't
+SINM_DEF void
+sinm_gpu_normal_map_to_buffer(uint32_t* out, uint32_t inFBO, int32_t w, int32_t h)
+{
+    assert(inFBO != 0); //opengl context not initialized
+    assert(out);
+    assert(w > 0 && h > 0);
+
+    BEGIN_TIMER(gpu_to_buffer_copy)
+    glBindFramebuffer(GL_FRAMEBUFFER, inFBO);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, out);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    END_TIMER(gpu_to_buffer_copy)
+}
+
+//Queues a copy of the RGBA8 contents of "inFBO" into a pixel buffer and returns without waiting for the GPU. Poll
+//with sinm_gpu_readback_ready() and get the pixels with sinm_gpu_readback_wait(). A readback that is done can be begun
+//again and reuses its buffer when the image fits
+SINM_DEF void
+sinm_gpu_readback_begin(sinm_gpu_readback* readback, uint32_t inFBO, int32_t w, int32_t h)
+{
+    assert(inFBO != 0); //opengl context not initialized
+    assert(readback && !readback->fence && !readback->mapped);
+    assert(w > 0 && h > 0);
+
+    size_t size = (size_t)w * h * sizeof(uint32_t);
+    if (!readback->pbo) {
+        glGenBuffers(1, &readback->pbo);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    if (readback->capacity < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        readback->capacity = size;
+    }
+    readback->w = w;
+    readback->h = h;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, inFBO);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    //NOTE: with a pack buffer bound the last argument is an offset into it and the call only queues the copy
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback->fence = (void*)glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    //NOTE: a fence that is never flushed never signals, so polling alone could wait forever
+    glFlush();
+}
+
+//1 when the copy of "readback" is done and sinm_gpu_readback_wait() won't block. Never blocks itself
+SINM_DEF int
+sinm_gpu_readback_ready(sinm_gpu_readback* readback)
+{
+    if (!readback->fence) {
+        return readback->pbo != 0;
+    }
+    GLenum status = glClientWaitSync((GLsync)readback->fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+        return 0;
+    }
+    glDeleteSync((GLsync)readback->fence);
+    readback->fence = NULL;
+    return 1;
+}
+
+//Waits for the copy of "readback" and maps its w * h RGBA8 pixels. They stay valid until sinm_gpu_readback_end(), which
+//has to come before the readback is begun again or freed
+SINM_DEF const uint32_t*
+sinm_gpu_readback_wait(sinm_gpu_readback* readback)
+{
+    assert(readback->pbo);
+    if (readback->mapped) {
+        return readback->mapped;
+    }
+
+    BEGIN_TIMER(gpu_readback_wait)
+    while (!sinm_gpu_readback_ready(readback)) {
+        glClientWaitSync((GLsync)readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    }
+    END_TIMER(gpu_readback_wait)
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    readback->mapped = (const uint32_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (size_t)readback->w * readback->h * sizeof(uint32_t), GL_MAP_READ_BIT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return readback->mapped;
+}
+
+SINM_DEF void
+sinm_gpu_readback_end(sinm_gpu_readback* readback)
+{
+    if (!readback->mapped) {
+        return;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback->mapped = NULL;
+}
+
+//Deletes the pixel buffer of "readback". A copy still in flight is waited for by the driver, not by the caller
+SINM_DEF void
+sinm_gpu_readback_free(sinm_gpu_readback* readback)
+{
+    sinm_gpu_readback_end(readback);
+    if (readback->fence) {
+        glDeleteSync((GLsync)readback->fence);
+    }
+    glDeleteBuffers(1, &readback->pbo);
+    memset(readback, 0, sizeof(*readback));
+}
+
+SINM_DEF void
+sinm_composite_gpu(sinm_gpu_buffer outBuffer, const sinm_gpu_buffer* inBuffers, int32_t count, int32_t w, int32_t h)
+{
+    assert(sinm__glCtx.initialized);
+    assert(inBuffers);
+
+    if (count <= 1) {
+        return;
+    }
+
+    count = sinm__min(5, count);
+    glUseProgram(sinm__glCtx.compositeShader);
+    glViewport(0, 0, w, h);
+
+#define MAX_COMPOSITE_LAYERS 5
+    int texUnis[MAX_COMPOSITE_LAYERS] = {};
+    texUnis[0] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[0]");
+    texUnis[1] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[1]");
+    texUnis[2] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[2]");
+    texUnis[3] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[3]");
+    texUnis[4] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[4]");
+    for (int i = 0; i < count; ++i) {
+        glUniform1i(texUnis[i], i);
+    }
+
+    glUniform1i(glGetUniformLocation(sinm__glCtx.compositeShader, "numImages"), count);
+    glBindVertexArray(sinm__glCtx.quadVAO);
+    glBindFramebuffer(GL_FRAMEBUFFER, outBuffer.fbo);
+    for (int i = 0; i < count; ++i) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        uint32_t buffer = inBuffers[i].buffer;
+        glBindTexture(GL_TEXTURE_2D, buffer);
+    }
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+//sinm__normal_map_texture on the compute backend: greyscale + horizontal blur, then vertical blur + sobel straight into
+//the texture of "outFBO". Each SINM_GPU_MAX_PASSES blur passes past the first ones take two more dispatches
+static void
+sinm__normal_map_compute(sinm__gpu_pool_entry* pool, uint32_t inTex, uint32_t outFBO, int32_t w, int32_t h, float scale, int numBlurPasses, sinm_greyscale_type greyscaleType, int flipY)
+{
+    for (int i = 0; i < 2; ++i) {
+        if (!pool->computeBuffers[i]) {
+            pool->computeBuffers[i] = sinm__gpu_texture_create(w, h, sinm__gpu_height_internal_format());
+        }
+    }
+    GLint outTexture = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, outFBO);
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_NAME, &outTexture);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    //NOTE: "normals" has no format qualifier so it takes whatever format the output texture has
+    GLint outFormat = GL_RGBA32F;
+    glBindTexture(GL_TEXTURE_2D, (GLuint)outTexture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &outFormat);
+
+    //NOTE: the same blur as the fragment backend. Its sobel pass reads the texture of the last horizontal pass, so it
+    //gets at least one horizontal pass and one vertical pass fewer. Horizontal and vertical passes commute, so all the
+    //horizontal ones go first
+    int passes = sinm__max(1, numBlurPasses);
+    uint32_t src = inTex;
+    int dst = 0;
+    glActiveTexture(GL_TEXTURE0);
+
+    uint32_t program = sinm__glCtx.blurHCompute;
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "image"), 0);
+    glUniform1i(glGetUniformLocation(program, "blurred"), 0);
+    for (int left = passes; left > 0; left -= SINM_GPU_MAX_PASSES) {
+        glUniform1i(glGetUniformLocation(program, "greyscaleType"), src == inTex ? greyscaleType : sinm_greyscale_none);
+        glUniform1i(glGetUniformLocation(program, "passes"), sinm__min(left, SINM_GPU_MAX_PASSES));
+        glBindTexture(GL_TEXTURE_2D, src);
+        glBindImageTexture(0, pool->computeBuffers[dst], 0, GL_FALSE, 0, GL_WRITE_ONLY, sinm__gpu_height_internal_format());
+        glDispatchCompute((w + 255) / 256, h, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        src = pool->computeBuffers[dst];
+        dst = !dst;
+    }
+
+    int left = passes - 1;
+    program = sinm__glCtx.blurVCompute;
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "image"), 0);
+    glUniform1i(glGetUniformLocation(program, "blurred"), 0);
+    glUniform1i(glGetUniformLocation(program, "passes"), SINM_GPU_MAX_PASSES);
+    for (; left > SINM_GPU_MAX_PASSES; left -= SINM_GPU_MAX_PASSES) {
+        glBindTexture(GL_TEXTURE_2D, src);
+        glBindImageTexture(0, pool->computeBuffers[dst], 0, GL_FALSE, 0, GL_WRITE_ONLY, sinm__gpu_height_internal_format());
+        glDispatchCompute((w + 15) / 16, (h + 31) / 32, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        src = pool->computeBuffers[dst];
+        dst = !dst;
+    }
+
+    program = sinm__glCtx.blurVSobelCompute;
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "image"), 0);
+    glUniform1i(glGetUniformLocation(program, "normals"), 0);
+    glUniform1i(glGetUniformLocation(program, "passes"), left);
+    glUniform1f(glGetUniformLocation(program, "scale"), sinm__max(1.0f, scale));
+    glUniform1f(glGetUniformLocation(program, "flipY"), flipY ? -1.0f : 1.0f);
+    glBindTexture(GL_TEXTURE_2D, src);
+    glBindImageTexture(0, (GLuint)outTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, (GLenum)outFormat);
+    glDispatchCompute((w + 15) / 16, (h + 31) / 32, 1);
+    //NOTE: the result is read by draws, texture fetches and glReadPixels
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+    assert(!glsys::report_errors());
+}
+
+static uint32_t
+sinm__greyscale_program(sinm_greyscale_type greyscaleType)
+{
+    switch (greyscaleType) {
+    case sinm_greyscale_average: return sinm__glCtx.greyscaleAverageShader;
+    case sinm_greyscale_luminance: return sinm__glCtx.greyscaleLuminanceShader;
+    case sinm_greyscale_lightness: return sinm__glCtx.greyscaleLightnessShader;
+    default: {
+        //INVALID OPTION
+        assert(false);
+        return 0;
+    }
+    }
+}
+
+//Sobel scale of heights made with "greyscaleType". The average shaders divide the channel sum by 3 so the heights fit
+//the unorm height format, they divided it by 2 before and the gradients are scaled back up to keep the same normals
+static float
+sinm__gpu_greyscale_scale(sinm_greyscale_type greyscaleType)
+{
+    return greyscaleType == sinm_greyscale_average ? 1.5f : 1.0f;
+}
+
+//Normal map of the image in "inTex" into "outFBO". With sinm_greyscale_none the red channel of "inTex" is the height
+static void
+sinm__normal_map_texture(sinm__gpu_pool_entry* pool, uint32_t inTex, uint32_t outFBO, int32_t w, int32_t h, float scale, int numBlurPasses, sinm_greyscale_type greyscaleType, int flipY)
+{
+    scale = sinm__max(1.0f, scale) * sinm__gpu_greyscale_scale(greyscaleType);
+    if (sinm__glCtx.backend == sinm_gpu_backend_compute) {
+        sinm__normal_map_compute(pool, inTex, outFBO, w, h, scale, numBlurPasses, greyscaleType, flipY);
+        return;
+    }
+
+    glViewport(0, 0, w, h);
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(sinm__glCtx.quadVAO);
+
+    uint32_t heights = inTex;
+    if (greyscaleType != sinm_greyscale_none) {
+        if (!pool->greyscaleTex) {
+            pool->greyscaleTex = sinm__gpu_texture_create(w, h, GL_R32F);
+            pool->greyscaleFBO = sinm__gpu_framebuffer_create(pool->greyscaleTex);
+        }
+        glUseProgram(sinm__greyscale_program(greyscaleType));
+        glBindFramebuffer(GL_FRAMEBUFFER, pool->greyscaleFBO);
+        glBindTexture(GL_TEXTURE_2D, inTex);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        heights = pool->greyscaleTex;
+    }
+
+    { //Blur passes
+        glUseProgram(sinm__glCtx.blurShader);
+        GLint texUni = glGetUniformLocation(sinm__glCtx.blurShader, "image");
+        GLint horizontalUni = glGetUniformLocation(sinm__glCtx.blurShader, "horizontal");
+        glUniform1i(texUni, 0);
+
+        int blurPasses = sinm__max(2, numBlurPasses * 2);
+        int horizontal = 1;
+        int firstIteration = 1;
+        for (int i = 0; i < blurPasses; ++i) {
+            glBindFramebuffer(GL_FRAMEBUFFER, pool->pingpongFBO[horizontal]);
+            glUniform1i(horizontalUni, horizontal);
+            glBindTexture(GL_TEXTURE_2D, firstIteration ? heights : pool->pingpongBuffers[!horizontal]);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            horizontal = !horizontal;
+            firstIteration = false;
+        }
+    }
+    assert(!glsys::report_errors());
+
+    { //Conversion to normal map
+        glUseProgram(sinm__glCtx.normalMapShader);
+        GLint texUni = glGetUniformLocation(sinm__glCtx.normalMapShader, "image");
+        GLint scaleUni = glGetUniformLocation(sinm__glCtx.normalMapShader, "scale");
+        GLint flipYUni = glGetUniformLocation(sinm__glCtx.normalMapShader, "flipY");
+        glUniform1i(texUni, 0);
+        glUniform1f(scaleUni, sinm__max(1.0f, scale));
+        float yDir = (flipY) ? -1.0f : 1.0f;
+
+        glUniform1f(flipYUni, yDir);
+        glBindFramebuffer(GL_FRAMEBUFFER, outFBO);
+        glBindTexture(GL_TEXTURE_2D, pool->pingpongBuffers[1]);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        assert(!glsys::report_errors());
+    }
+    assert(!glsys::report_errors());
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(0);
+}
+
+//Uploads "inBuffer" and makes its normal map in "outFBO". Layers of the same image are cheaper with sinm_gpu_source
+SINM_DEF void
+sinm__normal_map_gpu(const uint32_t* inBuffer, uint32_t outFBO, int32_t w, int32_t h, float scale, int numBlurPasses, sinm_greyscale_type greyscaleType, int flipY = 0)
+{
+    assert(sinm__glCtx.initialized);
+    assert(outFBO != 0);
+    assert(inBuffer);
+
+    //NOTE: the textures are reused by every call with the same size, only their contents are replaced
+    sinm__gpu_pool_entry* pool = sinm__gpu_pool_get(w, h);
+    if (!pool->inTex) {
+        pool->inTex = sinm__gpu_texture_create(w, h, GL_RGBA8);
+    }
+    glBindTexture(GL_TEXTURE_2D, pool->inTex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, inBuffer);
+    sinm__normal_map_texture(pool, pool->inTex, outFBO, w, h, scale, numBlurPasses, greyscaleType, flipY);
+}
+
+//Copies "in" into the upload buffer of "source" and from there into its texture. The copy to the texture runs on the
+//GPU after this returns
+static void
+sinm__gpu_source_upload(sinm_gpu_source* source, const uint32_t* in)
+{
+    size_t size = (size_t)source->w * source->h * sizeof(uint32_t);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, source->pbo);
+    if (source->mapped) {
+        //NOTE: the mapping is coherent, the previous copy out of it only has to be finished before it is overwritten
+        if (source->fence) {
+            while (glClientWaitSync((GLsync)source->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+            }
+            glDeleteSync((GLsync)source->fence);
+        }
+        memcpy(source->mapped, in, size);
+    } else {
+        glBufferSubData(GL_PIXEL_UNPACK_BUFFER, 0, size, in);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, source->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, source->w, source->h, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (source->mapped) {
+        source->fence = (void*)glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    source->heightsValid = 0;
+}
+
+//Uploads a "w" x "h" RGBA8 image once for every layer made from it with sinm_normal_map_gpu_source(). Free with
+//sinm_gpu_source_free()
+SINM_DEF sinm_gpu_source
+sinm_gpu_source_create(const uint32_t* in, int32_t w, int32_t h)
+{
+    assert(sinm__glCtx.initialized);
+    assert(w > 0 && h > 0);
+    assert(in);
+
+    sinm_gpu_source result = {};
+    result.w = w;
+    result.h = h;
+    result.texture = sinm__gpu_texture_create(w, h, GL_RGBA8);
+
+    size_t size = (size_t)w * h * sizeof(uint32_t);
+    glGenBuffers(1, &result.pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, result.pbo);
+    if (sinm__glCtx.bufferStorage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+        result.mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+    } else {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    sinm__gpu_source_upload(&result, in);
+    return result;
+}
+
+//Replaces the image of "source" with "in", the same size. Heights are made again by the next layer that needs them
+SINM_DEF void
+sinm_gpu_source_update(sinm_gpu_source* source, const uint32_t* in)
+{
+    assert(source->texture);
+    assert(in);
+    sinm__gpu_source_upload(source, in);
+}
+
+SINM_DEF void
+sinm_gpu_source_free(sinm_gpu_source* source)
+{
+    if (source->fence) {
+        glDeleteSync((GLsync)source->fence);
+    }
+    if (source->mapped) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, source->pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &source->pbo);
+    sinm__gpu_texture_delete(source->texture);
+    glDeleteFramebuffers(sinm_greyscale_count, source->heightsFBO);
+    for (int i = 0; i < sinm_greyscale_count; ++i) {
+        sinm__gpu_texture_delete(source->heights[i]);
+    }
+    memset(source, 0, sizeof(*source));
+}
+
+//Heights of "source" for "greyscaleType", the greyscale pass runs the first time a layer asks for them
+static uint32_t
+sinm__gpu_source_heights(sinm_gpu_source* source, sinm_greyscale_type greyscaleType)
+{
+    if (greyscaleType == sinm_greyscale_none) {
+        return source->texture;
+    }
+    uint32_t* heights = &source->heights[greyscaleType];
+    if (source->heightsValid & (1u << greyscaleType)) {
+        return *heights;
+    }
+    if (!*heights) {
+        *heights = sinm__gpu_texture_create(source->w, source->h, GL_R32F);
+        source->heightsFBO[greyscaleType] = sinm__gpu_framebuffer_create(*heights);
+    }
+
+    glViewport(0, 0, source->w, source->h);
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(sinm__glCtx.quadVAO);
+    glUseProgram(sinm__greyscale_program(greyscaleType));
+    glBindFramebuffer(GL_FRAMEBUFFER, source->heightsFBO[greyscaleType]);
+    glBindTexture(GL_TEXTURE_2D, source->texture);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(0);
+
+    source->heightsValid |= 1u << greyscaleType;
+    return *heights;
+}
+
+//sinm__normal_map_gpu for a layer of an uploaded image: no upload, and the greyscale pass only runs for the first
+//layer with each greyscale type, so regenerating a layer only costs its blur and sobel
+SINM_DEF void
+sinm_normal_map_gpu_source(sinm_gpu_source* source, uint32_t outFBO, float scale, int numBlurPasses, sinm_greyscale_type greyscaleType, int flipY)
+{
+    assert(sinm__glCtx.initialized);
+    assert(source->texture);
+    assert(outFBO != 0);
+
+    sinm__gpu_pool_entry* pool = sinm__gpu_pool_get(source->w, source->h);
+    uint32_t heights = sinm__gpu_source_heights(source, greyscaleType);
+    scale = sinm__max(1.0f, scale) * sinm__gpu_greyscale_scale(greyscaleType);
+    sinm__normal_map_texture(pool, heights, outFBO, source->w, source->h, scale, numBlurPasses, sinm_greyscale_none, flipY);
+}
+#endif
+
+#if 0
+SINM_DEF void
+sinm__normalize_gpu(uint32_t* in, )
+{
+}
+#endif
+
+static void
+sinm__normalize_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    sinm__kernels()->normalize(&a->out[(size_t)ys * a->w], a->w, ye - ys, a->scale, a->flipY);
+}
+
+SINM_DEF sinm__inline void
+sinm_normalize(uint32_t* in, int32_t w, int32_t h, float scale, int flipY)
+{
+    sinm__band_args args = { NULL, NULL, in, w, h };
+    args.scale = scale;
+    args.flipY = flipY;
+    sinm__parallel_rows(h, sinm__normalize_band, &args);
+}
+
+static void
+sinm__composite_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    size_t offset = (size_t)ys * a->w;
+    sinm__kernels()->composite(&a->in[offset], &a->in2[offset], &a->out[offset], a->w, ye - ys);
+}
+
+SINM_DEF sinm__inline void
+sinm_composite(const uint32_t* in1, const uint32_t* in2, uint32_t* out, int32_t w, int32_t h)
+{
+    sinm__band_args args = { in1, in2, out, w, h };
+    sinm__parallel_rows(h, sinm__composite_band, &args);
+}
+
+SINM_DEF sinm__inline uint32_t*
+sinm_composite_alloc(const uint32_t* in1, const uint32_t* in2, int32_t w, int32_t h)
+{
+    uint32_t* result = (uint32_t*)malloc(sizeof(uint32_t) * w * h);
+    if (result) {
+        sinm_composite(in1, in2, result, w, h);
+    }
+    return result;
+}
+
+static void
+sinm__greyscale_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    size_t offset = (size_t)ys * a->w;
+    sinm__kernels()->greyscale(&a->in[offset], &a->out[offset], a->w, ye - ys, a->greyscaleType);
+}
+
+SINM_DEF void
+sinm_greyscale(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, sinm_greyscale_type type)
+{
+    sinm__band_args args = { in, NULL, out, w, h };
+    args.greyscaleType = type;
+    sinm__parallel_rows(h, sinm__greyscale_band, &args);
+}
+
+//Greyscale straight into the single channel plane "heightOut"
+static void
+sinm__height_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    sinm__kernels()->greyscaleRow(&a->in[(size_t)ys * a->w], &a->heightOut[(size_t)ys * a->w], (int64_t)(ye - ys) * a->w, a->greyscaleType);
+}
+
+//Sobel normals of the plane "height" into "out"
+static void
+sinm__sobel_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    int32_t w = a->w;
+    int32_t h = a->h;
+    const sinm__kernel_table* k = sinm__kernels();
+    for (int32_t y = ys; y < ye; ++y) {
+        const uint8_t* rows[3] = {
+            &a->height[(size_t)sinm__min(h - 1, sinm__max(1, y - 1)) * w],
+            &a->height[(size_t)sinm__min(h - 1, sinm__max(1, y)) * w],
+            &a->height[(size_t)sinm__min(h - 1, sinm__max(1, y + 1)) * w],
+        };
+        k->sobelRow(rows, 0, &a->out[(size_t)y * w], 0, w, w, a->scale, a->flipY);
+    }
+}
+
+typedef struct
+{
+    int32_t w;
+    int64_t h; //Only streamed images go past 32 bits
+    float scale;
+    int flipY;
+    const sinm__kernel_table* kernels;
+    sinm_greyscale_type greyscaleType;
+    int32_t blurPasses;
+    sinm__box_divisor blurDivisors[3];
+    int32_t halo; //Pixels of input needed around a tile: blur reach + 1 for the sobel kernel
+    sinm_output_format format; //Only the row pipeline writes anything but sinm_output_rgba8
+    int32_t sampleSize; //Bytes per height in the row pipeline: 1, or 2 for 16 bit heights from sinm_normal_map_raw
+} sinm__tile_params;
+
+static void
+sinm__tile_params_init(sinm__tile_params* p, int32_t w, int64_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY)
+{
+    memset(p, 0, sizeof(*p));
+    p->w = w;
+    p->h = h;
+    p->scale = scale;
+    p->flipY = flipY;
+    p->greyscaleType = greyscaleType;
+    //NOTE: same kernels as sinm__height_band/sinm__sobel_band so both paths produce the same bytes
+    p->kernels = sinm__kernels();
+    p->halo = 1;
+    p->sampleSize = 1;
+
+    float radius = sinm__min((float)sinm__min(w, h), sinm__max(0, blurRadius));
+    if (radius >= 1.0f) {
+        int32_t radii[3];
+        p->halo += sinm__gaussian_box_radii(radii, radius);
+        for (int i = 0; i < 3; ++i) {
+            if (radii[i] > 0) {
+                sinm__box_divisor_init(&p->blurDivisors[p->blurPasses++], radii[i]);
+            }
+        }
+    }
+}
+
+//Bytes of scratch one tile needs(two height planes covering the tile and its halo, then the horizontal blur's)
+static size_t
+sinm__tile_scratch_size(const sinm__tile_params* p)
+{
+    size_t rw = sinm__min(p->w, SINM_TILE_SIZE + 2 * p->halo);
+    size_t rh = (size_t)sinm__min(p->h, SINM_TILE_SIZE + 2 * p->halo);
+    return sinm__align_scratch(2 * rw * rh) + sinm__box_blur_h_scratch_size((int32_t)rw);
+}
+
+//Runs greyscale -> blur -> sobel -> encode for the output rect [tx0, tx1) x [ty0, ty1).
+//Every stage works on the tile's height planes in "scratch" so nothing but the input and output touch main memory
+static void
+sinm__normal_map_tile(const sinm__tile_params* p, const uint32_t* in, uint32_t* out, uint8_t* scratch, int32_t tx0, int32_t ty0, int32_t tx1, int32_t ty1)
+{
+    int32_t w = p->w;
+    int32_t h = (int32_t)p->h;
+    int32_t rx0 = sinm__max(0, tx0 - p->halo);
+    int32_t ry0 = sinm__max(0, ty0 - p->halo);
+    int32_t rx1 = sinm__min(w, tx1 + p->halo);
+    int32_t ry1 = sinm__min(h, ty1 + p->halo);
+    int32_t rw = rx1 - rx0;
+    int32_t rh = ry1 - ry0;
+
+    uint8_t* height = scratch;
+    uint8_t* temp = scratch + (size_t)rw * rh;
+    uint8_t* blurScratch = scratch + sinm__align_scratch(2 * (size_t)rw * rh);
+
+    for (int32_t y = 0; y < rh; ++y) {
+        p->kernels->greyscaleRow(&in[(size_t)(ry0 + y) * w + rx0], &height[y * rw], rw, p->greyscaleType);
+    }
+
+    //NOTE: the region edges clamp like image edges. Pixels within the blur reach of an edge that
+    //is not an image edge come out wrong, but the halo keeps them out of the tile
+    for (int i = 0; i < p->blurPasses; ++i) {
+        const sinm__box_divisor* d = &p->blurDivisors[i];
+        p->kernels->boxBlurH(height, temp, 0, rh, rw, rh, d, blurScratch);
+        p->kernels->boxBlurV(temp, height, 0, rh, rw, rh, d);
+    }
+
+    for (int32_t y = ty0; y < ty1; ++y) {
+        const uint8_t* rows[3] = {
+            &height[(sinm__min(h - 1, sinm__max(1, y - 1)) - ry0) * rw],
+            &height[(sinm__min(h - 1, sinm__max(1, y)) - ry0) * rw],
+            &height[(sinm__min(h - 1, sinm__max(1, y + 1)) - ry0) * rw],
+        };
+        p->kernels->sobelRow(rows, rx0, &out[(size_t)y * w], tx0, tx1, w, p->scale, p->flipY);
+    }
+}
+
+typedef struct
+{
+    const uint32_t* in;
+    uint32_t* out;
+    const sinm__tile_params* p;
+    int failed; //Set by bands that could not allocate their scratch
+} sinm__tile_band_args;
+
+//Tiles of output rows [ys, ye), a band's rows are cut into tiles the same way the whole image is
+static void
+sinm__normal_map_tile_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__tile_band_args* a = (sinm__tile_band_args*)data;
+    const sinm__tile_params* p = a->p;
+    uint8_t* scratch = (uint8_t*)sinm__malloc(sinm__tile_scratch_size(p));
+    if (!scratch) {
+        a->failed = 1;
+        return;
+    }
+
+    for (int32_t ty = ys; ty < ye; ty += SINM_TILE_SIZE) {
+        for (int32_t tx = 0; tx < p->w; tx += SINM_TILE_SIZE) {
+            sinm__normal_map_tile(p, a->in, a->out, scratch, tx, ty, sinm__min(p->w, tx + SINM_TILE_SIZE), sinm__min(ye, ty + SINM_TILE_SIZE));
+        }
+    }
+    sinm__free(scratch);
+}
+
+SINM_DEF int
+sinm_normal_map_buffer_tiled(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY)
+{
+    assert(w > 0 && h > 0);
+    assert(in != out);
+
+    sinm__tile_params params;
+    sinm__tile_params_init(&params, w, h, scale, blurRadius, greyscaleType, flipY);
+
+    sinm__tile_band_args args = { in, out, &params };
+    sinm__parallel_rows(h, sinm__normal_map_tile_band, &args);
+    return !args.failed;
+}
+
+SINM_DEF size_t
+sinm_raw_pixel_size(sinm_raw_format format)
+{
+    switch (format) {
+    case sinm_raw_r8: return 1;
+    case sinm_raw_r16: return 2;
+    case sinm_raw_r32f: return 4;
+    default: assert(false); return 0;
+    }
+}
+
+SINM_DEF size_t
+sinm_output_pixel_size(sinm_output_format format)
+{
+    switch (format) {
+    case sinm_output_rgba8: return 4;
+    case sinm_output_rg8: return 2;
+    case sinm_output_rgba16: return 8;
+    case sinm_output_rg16: return 4;
+    case sinm_output_oct16: return 4;
+    default: assert(false); return 0;
+    }
+}
+
+//Row "y" of a raw heightmap as pipeline samples: 8 bit for sinm_raw_r8, 16 bit for the others. sinm_raw_r8 and
+//sinm_raw_r16 rows are returned where they lie, float rows are rounded into "dst"
+static const uint8_t*
+sinm__raw_row(const sinm__tile_params* p, const void* heights, sinm_raw_format format, int64_t y, uint8_t* dst)
+{
+    const uint8_t* src = (const uint8_t*)heights + (size_t)y * p->w * sinm_raw_pixel_size(format);
+    if (format != sinm_raw_r32f) {
+        return src;
+    }
+    p->kernels->floatHeightRow((const float*)src, (uint16_t*)dst, p->w);
+    return dst;
+}
+
+#define SINM__ROW_SOBEL_RING 3 //Rows the sobel stage of sinm__row_pipeline keeps: above, at and below the output row
+
+//One blur pass of sinm__row_pipeline: the horizontally blurred rows its vertical pass still reaches, in a ring
+typedef struct
+{
+    const sinm__box_divisor* divisor;
+    uint8_t* ring; //Row i of the region is in slot i % ringRows
+    int32_t ringRows;
+    uint32_t* sums; //Running column sums of the vertical pass
+    int64_t pushed;
+    int64_t emitted;
+} sinm__row_blur;
+
+//Greyscale -> blur -> sobel over the input rows [ry0, ry1) one row at a time, writing output rows [ys, ye)
+//to "out" as p->format pixels, or to "write" as RGBA when that is set. Rows are 64 bit so streams can be any height.
+//Heights are p->sampleSize bytes each. 16 bit heights run through the 16 bit kernels and their gradients are
+//scaled down by 257 so "scale" means the same as for 8 bit ones
+//NOTE: the region's first and last rows clamp like image edges, same as sinm__normal_map_tile, so [ys, ye)
+//has to stay the halo away from any region edge that isn't an image edge
+typedef struct
+{
+    const sinm__tile_params* p;
+    void* out;
+    sinm_row_writer write;
+    void* user;
+    int failed; //Set when "write" returned 0, nothing is written after that
+    int64_t ry0, ry1;
+    int64_t ye;
+    size_t stride; //Between rows of every ring
+    uint8_t* row; //Row handed from one blur pass to the next
+    uint8_t* encoded; //Row handed to "write"
+    float* gradients; //Two rows of sobel gradients for the 16 bit formats, or the RGBA row sinm_output_rg8 is packed from
+    sinm__row_blur blur[3];
+    uint8_t* heights; //Ring of the last SINM__ROW_SOBEL_RING blurred rows
+    int64_t heightRows;
+    int64_t nextOut;
+} sinm__row_pipeline;
+
+//Bytes of memory sinm__row_pipeline_init needs
+static size_t
+sinm__row_pipeline_size(const sinm__tile_params* p)
+{
+    size_t stride = sinm__align_scratch((size_t)p->w * p->sampleSize);
+    size_t size = stride * (1 + SINM__ROW_SOBEL_RING) + sinm__align_scratch(p->w * sinm_output_pixel_size(p->format));
+    size += sinm__align_scratch(2 * p->w * sizeof(float));
+    for (int i = 0; i < p->blurPasses; ++i) {
+        size += stride * (2 * p->blurDivisors[i].r + 2) + sinm__align_scratch(p->w * sizeof(uint32_t));
+    }
+    return size;
+}
+
+static void
+sinm__row_pipeline_init(sinm__row_pipeline* pl, const sinm__tile_params* p, uint8_t* memory, void* out, int64_t ry0, int64_t ry1, int64_t ys, int64_t ye)
+{
+    memset(pl, 0, sizeof(*pl));
+    pl->p = p;
+    pl->out = out;
+    pl->ry0 = ry0;
+    pl->ry1 = ry1;
+    pl->ye = ye;
+    pl->nextOut = ys;
+    pl->stride = sinm__align_scratch((size_t)p->w * p->sampleSize);
+
+    pl->row = memory;
+    memory += pl->stride;
+    pl->encoded = memory;
+    memory += sinm__align_scratch(p->w * sinm_output_pixel_size(p->format));
+    pl->gradients = (float*)memory;
+    memory += sinm__align_scratch(2 * p->w * sizeof(float));
+    pl->heights = memory;
+    memory += pl->stride * SINM__ROW_SOBEL_RING;
+    for (int i = 0; i < p->blurPasses; ++i) {
+        sinm__row_blur* b = &pl->blur[i];
+        b->divisor = &p->blurDivisors[i];
+        b->ringRows = 2 * b->divisor->r + 2;
+        assert(p->sampleSize == 1 || b->divisor->r <= SINM__BOX_MAX_RADIUS16);
+        b->ring = memory;
+        memory += pl->stride * b->ringRows;
+        b->sums = (uint32_t*)memory;
+        memory += sinm__align_scratch(p->w * sizeof(uint32_t));
+    }
+}
+
+//Where the next input row of "stage" can be written before sinm__row_pipeline_push() without a copy. Blur
+//passes read their row from anywhere, the sobel stage(stage == blurPasses) keeps it in its ring
+static uint8_t*
+sinm__row_pipeline_input(sinm__row_pipeline* pl, int32_t stage)
+{
+    if (stage < pl->p->blurPasses) {
+        return pl->row;
+    }
+    return &pl->heights[(pl->heightRows % SINM__ROW_SOBEL_RING) * pl->stride];
+}
+
+//Sobel normals of the row between "rows", encoded as p->format into "out"
+static void
+sinm__row_pipeline_encode(sinm__row_pipeline* pl, const uint8_t* rows[3], uint8_t* out)
+{
+    const sinm__tile_params* p = pl->p;
+    const uint16_t* rows16[3] = { (const uint16_t*)rows[0], (const uint16_t*)rows[1], (const uint16_t*)rows[2] };
+    float scale = p->sampleSize == 2 ? p->scale / 257.0f : p->scale;
+    if (p->format == sinm_output_rgba8 || p->format == sinm_output_rg8) {
+        uint32_t* rgba = p->format == sinm_output_rgba8 ? (uint32_t*)out : (uint32_t*)pl->gradients;
+        if (p->sampleSize == 2) {
+            p->kernels->sobelRow16(rows16, 0, rgba, 0, p->w, p->w, scale, p->flipY);
+        } else {
+            p->kernels->sobelRow(rows, 0, rgba, 0, p->w, p->w, scale, p->flipY);
+        }
+        if (p->format == sinm_output_rg8) {
+            p->kernels->packRG8Row(rgba, out, p->w);
+        }
+        return;
+    }
+
+    float* gx = pl->gradients;
+    float* gy = pl->gradients + p->w;
+    if (p->sampleSize == 2) {
+        p->kernels->sobelGradientRow16(rows16, gx, gy, p->w);
+    } else {
+        p->kernels->sobelGradientRow(rows, gx, gy, p->w);
+    }
+    p->kernels->encodeNormalsRow(gx, gy, out, p->w, scale, p->flipY, p->format);
+}
+
+static void
+sinm__row_pipeline_sobel(sinm__row_pipeline* pl, const uint8_t* row)
+{
+    const sinm__tile_params* p = pl->p;
+    int64_t h = p->h;
+    uint8_t* slot = sinm__row_pipeline_input(pl, p->blurPasses);
+    if (row != slot) {
+        memcpy(slot, row, (size_t)p->w * p->sampleSize);
+    }
+    pl->heightRows++;
+    while (!pl->failed && pl->nextOut < pl->ye && pl->ry0 + pl->heightRows > sinm__min(h - 1, pl->nextOut + 1)) {
+        int64_t y = pl->nextOut++;
+        int64_t above = sinm__min(h - 1, sinm__max(1, y - 1)) - pl->ry0;
+        int64_t at = sinm__min(h - 1, sinm__max(1, y)) - pl->ry0;
+        int64_t below = sinm__min(h - 1, sinm__max(1, y + 1)) - pl->ry0;
+        const uint8_t* rows[3] = {
+            &pl->heights[(above % SINM__ROW_SOBEL_RING) * pl->stride],
+            &pl->heights[(at % SINM__ROW_SOBEL_RING) * pl->stride],
+            &pl->heights[(below % SINM__ROW_SOBEL_RING) * pl->stride],
+        };
+        uint8_t* encoded = pl->write ? pl->encoded : (uint8_t*)pl->out + (size_t)y * p->w * sinm_output_pixel_size(p->format);
+        sinm__row_pipeline_encode(pl, rows, encoded);
+        if (pl->write && !pl->write(pl->user, y, encoded)) {
+            pl->failed = 1;
+        }
+    }
+}
+
+static void sinm__row_pipeline_push(sinm__row_pipeline* pl, int32_t stage, const uint8_t* row);
+
+static sinm__inline uint8_t*
+sinm__row_blur_ring(const sinm__row_blur* b, size_t stride, int64_t i)
+{
+    return &b->ring[(i % b->ringRows) * stride];
+}
+
+//Blurs the new row horizontally into the ring, then runs the vertical pass for every row whose window is complete
+static void
+sinm__row_pipeline_blur(sinm__row_pipeline* pl, int32_t stage, const uint8_t* row)
+{
+    const sinm__tile_params* p = pl->p;
+    sinm__row_blur* b = &pl->blur[stage];
+    int64_t n = pl->ry1 - pl->ry0;
+    int32_t r = b->divisor->r;
+    int deep = p->sampleSize == 2;
+    uint8_t* blurred = sinm__row_blur_ring(b, pl->stride, b->pushed);
+    if (deep) {
+        p->kernels->boxBlurLine16((const uint16_t*)row, (uint16_t*)blurred, p->w, 1, b->divisor);
+    } else {
+        p->kernels->boxBlurLine(row, blurred, p->w, 1, b->divisor);
+    }
+    b->pushed++;
+    while (b->emitted < n && b->pushed > sinm__min(n - 1, b->emitted + r)) {
+        int64_t j = b->emitted++;
+        if (j == 0) {
+            //NOTE: window of the row before the first, clamped like sinm__box_blur_v_row_range
+            memset(b->sums, 0, p->w * sizeof(uint32_t));
+            for (int32_t k = -r - 1; k < r; ++k) {
+                const uint8_t* src = sinm__row_blur_ring(b, pl->stride, sinm__min(n - 1, sinm__max(0, k)));
+                for (int32_t x = 0; x < p->w; ++x) {
+                    b->sums[x] += deep ? ((const uint16_t*)src)[x] : src[x];
+                }
+            }
+        }
+        const uint8_t* add = sinm__row_blur_ring(b, pl->stride, sinm__min(n - 1, j + r));
+        const uint8_t* sub = sinm__row_blur_ring(b, pl->stride, sinm__max(0, j - r - 1));
+        uint8_t* next = sinm__row_pipeline_input(pl, stage + 1);
+        if (deep) {
+            p->kernels->boxSlideRow16(b->sums, (const uint16_t*)add, (const uint16_t*)sub, (uint16_t*)next, p->w, b->divisor);
+        } else {
+            p->kernels->boxSlideRow(b->sums, add, sub, next, p->w, b->divisor);
+        }
+        sinm__row_pipeline_push(pl, stage + 1, next);
+    }
+}
+
+//Hands "stage" its next input "row" and runs everything it makes ready downstream. "row" is only read during the
+//call, so it can be sinm__row_pipeline_input() or a row of the caller's
+static void
+sinm__row_pipeline_push(sinm__row_pipeline* pl, int32_t stage, const uint8_t* row)
+{
+    if (stage < pl->p->blurPasses) {
+        sinm__row_pipeline_blur(pl, stage, row);
+    } else {
+        sinm__row_pipeline_sobel(pl, row);
+    }
+}
+
+typedef struct
+{
+    const uint32_t* in; //RGBA input, or NULL to read raw "heights"
+    const void* heights;
+    sinm_raw_format heightFormat;
+    void* out;
+    const sinm__tile_params* p;
+    int failed;
+} sinm__row_band_args;
+
+//Output rows [ys, ye) through a pipeline of their own that starts and ends the halo further out
+static void
+sinm__row_pipeline_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__row_band_args* a = (sinm__row_band_args*)data;
+    const sinm__tile_params* p = a->p;
+    uint8_t* memory = (uint8_t*)sinm__malloc(sinm__row_pipeline_size(p));
+    if (!memory) {
+        a->failed = 1;
+        return;
+    }
+
+    int64_t ry0 = sinm__max(0, ys - p->halo);
+    int64_t ry1 = sinm__min(p->h, (int64_t)ye + p->halo);
+    sinm__row_pipeline pl;
+    sinm__row_pipeline_init(&pl, p, memory, a->out, ry0, ry1, ys, ye);
+    for (int64_t y = ry0; y < ry1; ++y) {
+        uint8_t* row = sinm__row_pipeline_input(&pl, 0);
+        if (a->in) {
+            p->kernels->greyscaleRow(&a->in[(size_t)y * p->w], row, p->w, p->greyscaleType);
+            sinm__row_pipeline_push(&pl, 0, row);
+        } else {
+            sinm__row_pipeline_push(&pl, 0, sinm__raw_row(p, a->heights, a->heightFormat, y, row));
+        }
+    }
+    sinm__free(memory);
+}
+
+SINM_DEF int
+sinm_normal_map_stream(sinm_row_reader read, sinm_row_writer write, void* user, int32_t w, int64_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_output_format format = sinm_output_rgba8)
+{
+    assert(w > 0 && h > 0);
+
+    sinm__tile_params params;
+    sinm__tile_params_init(&params, w, h, scale, blurRadius, greyscaleType, flipY);
+    params.format = format;
+
+    size_t rowSize = sinm__align_scratch(w * sizeof(uint32_t));
+    uint8_t* memory = (uint8_t*)sinm__malloc(rowSize + sinm__row_pipeline_size(&params));
+    if (!memory) {
+        return 0;
+    }
+    uint32_t* inRow = (uint32_t*)memory;
+
+    sinm__row_pipeline pl;
+    sinm__row_pipeline_init(&pl, &params, memory + rowSize, NULL, 0, h, 0, h);
+    pl.write = write;
+    pl.user = user;
+    int ok = 1;
+    for (int64_t y = 0; y < h && ok; ++y) {
+        ok = read(user, y, inRow);
+        if (ok) {
+            uint8_t* row = sinm__row_pipeline_input(&pl, 0);
+            params.kernels->greyscaleRow(inRow, row, w, greyscaleType);
+            sinm__row_pipeline_push(&pl, 0, row);
+            ok = !pl.failed;
+        }
+    }
+
+    sinm__free(memory);
+    return ok;
+}
+
+SINM_DEF int
+sinm_normal_map_buffer_rows(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY)
+{
+    assert(w > 0 && h > 0);
+    assert(in != out);
+
+    sinm__tile_params params;
+    sinm__tile_params_init(&params, w, h, scale, blurRadius, greyscaleType, flipY);
+
+    sinm__row_band_args args = { in, NULL, sinm_raw_r8, out, &params };
+    sinm__parallel_rows(h, sinm__row_pipeline_band, &args);
+    return !args.failed;
+}
+
+SINM_DEF int
+sinm_normal_map_raw(const void* heights, sinm_raw_format heightFormat, void* out, sinm_output_format format, int32_t w, int32_t h, float scale, float blurRadius, int flipY)
+{
+    assert(w > 0 && h > 0);
+    assert(heights != out);
+
+    //NOTE: past SINM__BOX_MAX_RADIUS16 the 16 bit box sums stop dividing exactly. No real blur gets near it
+    if (heightFormat != sinm_raw_r8) {
+        blurRadius = sinm__min(blurRadius, (float)SINM__BOX_MAX_RADIUS16 / 2);
+    }
+    sinm__tile_params params;
+    sinm__tile_params_init(&params, w, h, scale, blurRadius, sinm_greyscale_none, flipY);
+    params.format = format;
+    params.sampleSize = heightFormat == sinm_raw_r8 ? 1 : 2;
+
+    sinm__row_band_args args = { NULL, heights, heightFormat, out, &params };
+    sinm__parallel_rows(h, sinm__row_pipeline_band, &args);
+    return !args.failed;
+}
+
+SINM_DEF int
+sinm_map_file(sinm_mapped_file* file, const char* path)
+{
+    memset(file, 0, sizeof(*file));
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(handle, &size) && size.QuadPart > 0) {
+        mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!data) {
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(handle);
+        return 0;
+    }
+    file->size = (size_t)size.QuadPart;
+    file->file = (intptr_t)handle;
+    file->mapping = (intptr_t)mapping;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    //NOTE: rows are read once, top to bottom
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    file->size = (size_t)st.st_size;
+    file->file = fd;
+#endif
+    file->data = (uint8_t*)data;
+    return 1;
+}
+
+SINM_DEF int
+sinm_map_file_write(sinm_mapped_file* file, const char* path, size_t size)
+{
+    memset(file, 0, sizeof(*file));
+    assert(size > 0);
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    //NOTE: the mapping grows the file to "size"
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    if (!data) {
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(handle);
+        return 0;
+    }
+    file->file = (intptr_t)handle;
+    file->mapping = (intptr_t)mapping;
+#else
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    file->file = fd;
+#endif
+    file->data = (uint8_t*)data;
+    file->size = size;
+    return 1;
+}
+
+SINM_DEF void
+sinm_unmap_file(sinm_mapped_file* file)
+{
+    if (!file->data) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle((HANDLE)file->mapping);
+    CloseHandle((HANDLE)file->file);
+#else
+    munmap(file->data, file->size);
+    close((int)file->file);
+#endif
+    memset(file, 0, sizeof(*file));
+}
+
+SINM_DEF size_t
+sinm_block_compressed_size(int32_t w, int32_t h)
+{
+    return (size_t)((w + 3) / 4) * ((h + 3) / 4) * 16;
+}
+
+typedef struct
+{
+    const uint32_t* normals;
+    uint8_t* out;
+    int32_t w, h;
+    sinm_block_format format;
+    const sinm__kernel_table* kernels;
+} sinm__compress_band_args;
+
+//Rows of blocks [ys, ye)
+static void
+sinm__compress_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__compress_band_args* a = (sinm__compress_band_args*)data;
+    size_t rowSize = sinm_block_compressed_size(a->w, 4);
+    for (int32_t by = ys; by < ye; ++by) {
+        const uint32_t* rows[4];
+        for (int32_t i = 0; i < 4; ++i) {
+            rows[i] = &a->normals[(size_t)sinm__min(a->h - 1, 4 * by + i) * a->w];
+        }
+        a->kernels->compressBlockRow(rows, &a->out[by * rowSize], a->w, a->format);
+    }
+}
+
+SINM_DEF int
+sinm_compress_normal_map(const uint32_t* normals, void* out, int32_t w, int32_t h, sinm_block_format format)
 {
-    assert(inFBO != 0); //opengl context not initialized
-    assert(out);
     assert(w > 0 && h > 0);
+    assert(format >= 0 && format < sinm_block_count);
 
-    BEGIN_TIMER(gpu_to_buffer_copy)
-    glBindFramebuffer(GL_FRAMEBUFFER, inFBO);
-    glReadBuffer(GL_COLOR_ATTACHMENT0);
-    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, out);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    END_TIMER(gpu_to_buffer_copy)
+    sinm__compress_band_args args = { normals, (uint8_t*)out, w, h, format, sinm__kernels() };
+    sinm__parallel_rows((h + 3) / 4, sinm__compress_band, &args);
+    return 1;
 }
 
-SINM_DEF void
-sinm_composite_gpu(sinm_gpu_buffer outBuffer, const sinm_gpu_buffer* inBuffers, int32_t count, int32_t w, int32_t h)
+//Row writer of a row pipeline that compresses every 4 rows into a row of blocks. The pipeline encodes each row
+//straight into its slot of "rows", so nothing is copied
+typedef struct
 {
-    assert(sinm__glCtx.initialized);
-    assert(inBuffers);
+    sinm__row_pipeline* pl;
+    sinm_block_format format;
+    uint8_t* out;
+    uint32_t* rows; //4 rows of RGBA normals
+} sinm__block_writer;
+
+static int
+sinm__block_row_writer(void* user, int64_t y, const void* row)
+{
+    sinm__block_writer* bw = (sinm__block_writer*)user;
+    const sinm__tile_params* p = bw->pl->p;
+    int64_t i = y % 4;
+    if (i == 3 || y == p->h - 1) {
+        const uint32_t* rows[4];
+        for (int64_t j = 0; j < 4; ++j) {
+            rows[j] = &bw->rows[sinm__min(i, j) * p->w];
+        }
+        p->kernels->compressBlockRow(rows, &bw->out[(size_t)(y / 4) * sinm_block_compressed_size(p->w, 4)], p->w, bw->format);
+    }
+    bw->pl->encoded = (uint8_t*)&bw->rows[((i + 1) % 4) * p->w];
+    return 1;
+}
 
-    if (count <= 1) {
+typedef struct
+{
+    const uint32_t* in;
+    uint8_t* out;
+    const sinm__tile_params* p;
+    sinm_block_format format;
+    int failed;
+} sinm__block_band_args;
+
+//Rows of blocks [ys, ye) through a row pipeline of their own, see sinm__row_pipeline_band
+static void
+sinm__block_pipeline_band(void* data, int32_t ys, int32_t ye, int32_t slot)
+{
+    sinm__block_band_args* a = (sinm__block_band_args*)data;
+    const sinm__tile_params* p = a->p;
+    size_t rowsSize = sinm__align_scratch(4 * p->w * sizeof(uint32_t));
+    uint8_t* memory = (uint8_t*)sinm__malloc(rowsSize + sinm__row_pipeline_size(p));
+    if (!memory) {
+        a->failed = 1;
         return;
     }
 
-    count = sinm__min(5, count);
-    glUseProgram(sinm__glCtx.compositeShader);
-    glViewport(0, 0, w, h);
-
-#define MAX_COMPOSITE_LAYERS 5
-    int texUnis[MAX_COMPOSITE_LAYERS] = {};
-    texUnis[0] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[0]");
-    texUnis[1] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[1]");
-    texUnis[2] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[2]");
-    texUnis[3] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[3]");
-    texUnis[4] = glGetUniformLocation(sinm__glCtx.compositeShader, "images[4]");
-    for (int i = 0; i < count; ++i) {
-        glUniform1i(texUnis[i], i);
+    int64_t y0 = 4 * (int64_t)ys;
+    int64_t y1 = sinm__min(p->h, 4 * (int64_t)ye);
+    int64_t ry0 = sinm__max(0, y0 - p->halo);
+    int64_t ry1 = sinm__min(p->h, y1 + p->halo);
+    sinm__row_pipeline pl;
+    sinm__row_pipeline_init(&pl, p, memory + rowsSize, NULL, ry0, ry1, y0, y1);
+    sinm__block_writer writer = { &pl, a->format, a->out, (uint32_t*)memory };
+    pl.write = sinm__block_row_writer;
+    pl.user = &writer;
+    pl.encoded = memory;
+    for (int64_t y = ry0; y < ry1; ++y) {
+        uint8_t* row = sinm__row_pipeline_input(&pl, 0);
+        p->kernels->greyscaleRow(&a->in[(size_t)y * p->w], row, p->w, p->greyscaleType);
+        sinm__row_pipeline_push(&pl, 0, row);
     }
+    sinm__free(memory);
+}
 
-    glUniform1i(glGetUniformLocation(sinm__glCtx.compositeShader, "numImages"), count);
-    glBindVertexArray(sinm__glCtx.quadVAO);
-    glBindFramebuffer(GL_FRAMEBUFFER, outBuffer.fbo);
-    for (int i = 0; i < count; ++i) {
-        glActiveTexture(GL_TEXTURE0 + i);
-        uint32_t buffer = inBuffers[i].buffer;
-        glBindTexture(GL_TEXTURE_2D, buffer);
+SINM_DEF int
+sinm_normal_map_compressed(const uint32_t* in, void* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_block_format format)
+{
+    assert(w > 0 && h > 0);
+    assert(format >= 0 && format < sinm_block_count);
+
+    sinm__tile_params params;
+    sinm__tile_params_init(&params, w, h, scale, blurRadius, greyscaleType, flipY);
+
+    sinm__block_band_args args = { in, (uint8_t*)out, &params, format };
+    sinm__parallel_rows((h + 3) / 4, sinm__block_pipeline_band, &args);
+    return !args.failed;
+}
+
+static sinm__inline uint32_t
+sinm__fourcc(char a, char b, char c, char d)
+{
+    return (uint32_t)a | (uint32_t)b << 8 | (uint32_t)c << 16 | (uint32_t)d << 24;
+}
+
+SINM_DEF size_t
+sinm_container_header(uint8_t* out, sinm_container container, int32_t w, int32_t h, sinm_block_format format)
+{
+    assert(format >= 0 && format < sinm_block_count);
+    uint64_t size = sinm_block_compressed_size(w, h);
+
+    //NOTE: every field is little endian, like the hosts the SIMD kernels run on
+    if (container == sinm_container_dds) {
+        uint32_t dds[32 + 5] = { 0 };
+        dds[0] = sinm__fourcc('D', 'D', 'S', ' ');
+        dds[1] = 124;
+        dds[2] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000; //Caps, height, width, pixel format, linear size
+        dds[3] = h;
+        dds[4] = w;
+        dds[5] = (uint32_t)size;
+        dds[7] = 1;
+        dds[19] = 32;
+        dds[20] = 0x4; //Four CC
+        dds[27] = 0x1000; //Texture
+        if (format == sinm_block_bc3nm) {
+            dds[21] = sinm__fourcc('D', 'X', 'T', '5');
+            memcpy(out, dds, 32 * sizeof(uint32_t));
+            return 32 * sizeof(uint32_t);
+        }
+        dds[21] = sinm__fourcc('D', 'X', '1', '0');
+        dds[32] = 83; //DXGI_FORMAT_BC5_UNORM
+        dds[33] = 3; //Texture 2D
+        dds[35] = 1; //Array size
+        memcpy(out, dds, sizeof(dds));
+        return sizeof(dds);
     }
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    assert(container == sinm_container_ktx2);
+    static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    memcpy(out, identifier, sizeof(identifier));
+
+    //NOTE: header, index and level index, then the data format descriptor. The level is aligned to its 16 byte blocks
+    const uint32_t dfdOffset = 104;
+    const uint32_t dfdSize = 4 + 24 + 2 * 16;
+    const uint64_t levelOffset = (dfdOffset + dfdSize + 15) & ~15u;
+    memset(&out[sizeof(identifier)], 0, (size_t)levelOffset - sizeof(identifier));
+    uint32_t header[13] = {
+        format == sinm_block_bc5 ? 141u : 137u, //VK_FORMAT_BC5_UNORM_BLOCK, VK_FORMAT_BC3_UNORM_BLOCK
+        1, (uint32_t)w, (uint32_t)h, 0, 0, 1, 1, 0, //Type size, size, depth, layers, faces, levels, supercompression
+        dfdOffset, dfdSize, 0, 0, //No key/value data
+    };
+    memcpy(&out[12], header, sizeof(header));
+    uint64_t level[3] = { levelOffset, size, size };
+    memcpy(&out[80], level, sizeof(level));
+
+    //NOTE: one basic descriptor block, linear BT.709 with a sample per 64 bit half of the block
+    uint32_t dfd[15] = {
+        dfdSize,
+        0, //Khronos vendor, basic descriptor type
+        2 | (24 + 2 * 16) << 16, //Version 2, block size
+        (format == sinm_block_bc5 ? 132u : 130u) | 1 << 8 | 1 << 16, //KHR_DF_MODEL_BC5/BC3, BT.709 primaries, linear
+        3 | 3 << 8, //4x4 texels
+        16, 0, //Bytes in plane 0
+        0 | 63 << 16 | (format == sinm_block_bc5 ? 0u : 15u) << 24, 0, 0, UINT32_MAX, //Red, or BC3 alpha
+        64 | 63 << 16 | (format == sinm_block_bc5 ? 1u : 0u) << 24, 0, 0, UINT32_MAX, //Green, or BC3 color
+    };
+    memcpy(&out[dfdOffset], dfd, sizeof(dfd));
+    return (size_t)levelOffset;
 }
 
-//TODO optimize
-SINM_DEF void
-sinm__normal_map_gpu(const uint32_t* inBuffer, uint32_t outFBO, int32_t w, int32_t h, float scale, int numBlurPasses, sinm_greyscale_type greyscaleType, int flipY = 0)
+//Where sinm_normal_map_buffer_ctx keeps its intermediates in the context: the height plane, the blur's
+//temp plane, then one blur scratch slot per thread. Without a blur only the height plane is needed
+typedef struct
 {
-    assert(sinm__glCtx.initialized);
-    assert(outFBO != 0);
-    assert(inBuffer);
+    size_t plane;
+    size_t slot;
+    int32_t slots;
+    size_t total;
+} sinm__scratch_layout;
 
-    glBindTexture(GL_TEXTURE_2D, sinm__glCtx.inTex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, inBuffer);
+static void
+sinm__scratch_layout_init(sinm__scratch_layout* l, int32_t w, int32_t h, float blurRadius, sinm_blur_type blurType)
+{
+    float radius = sinm__min(sinm__min(w, h), sinm__max(0, blurRadius));
+    int blur = radius >= 1.0f;
+    l->plane = sinm__align_scratch((size_t)w * h);
+    l->slot = blur ? sinm__blur_slot_size(w, h, blurType) : 0;
+    l->slots = blur ? sinm_thread_count() : 0;
+    l->total = (blur ? 2 : 1) * l->plane + l->slots * l->slot;
+}
 
-    glGenFramebuffers(2, sinm__glCtx.pingpongFBO);
-    glGenTextures(2, sinm__glCtx.pingpongBuffers);
-    for (unsigned int i = 0; i < 2; i++) {
-        glBindFramebuffer(GL_FRAMEBUFFER, sinm__glCtx.pingpongFBO[i]);
-        glBindTexture(GL_TEXTURE_2D, sinm__glCtx.pingpongBuffers[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sinm__glCtx.pingpongBuffers[i], 0);
-    }
+SINM_DEF size_t
+sinm_scratch_size(int32_t w, int32_t h, float blurRadius, sinm_blur_type blurType)
+{
+    sinm__scratch_layout layout;
+    sinm__scratch_layout_init(&layout, w, h, blurRadius, blurType);
+    return layout.total;
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+SINM_DEF void
+sinm_context_init(sinm_context* ctx, void* memory, size_t size)
+{
+    assert(((uintptr_t)memory % SINM_SCRATCH_ALIGN) == 0);
+    ctx->memory = (uint8_t*)memory;
+    ctx->size = memory ? size : 0;
+    ctx->allocation = NULL;
+}
 
-    glViewport(0, 0, w, h);
-    glActiveTexture(GL_TEXTURE0);
-    glBindVertexArray(sinm__glCtx.quadVAO);
+SINM_DEF void
+sinm_context_free(sinm_context* ctx)
+{
+    sinm__free(ctx->allocation);
+    sinm_context_init(ctx, NULL, 0);
+}
 
-    if (greyscaleType != sinm_greyscale_none) {
-        switch (greyscaleType) {
-        case sinm_greyscale_average: {
-            glUseProgram(sinm__glCtx.greyscaleAverageShader);
-        } break;
-        case sinm_greyscale_luminance: {
-            glUseProgram(sinm__glCtx.greyscaleLuminanceShader);
-        } break;
-        case sinm_greyscale_lightness: {
-            glUseProgram(sinm__glCtx.greyscaleLightnessShader);
-        } break;
-        default: {
-            //INVALID OPTION
-            assert(false);
-        } break;
-        }
-        glBindFramebuffer(GL_FRAMEBUFFER, sinm__glCtx.pingpongFBO[0]);
-        glBindTexture(GL_TEXTURE_2D, sinm__glCtx.inTex);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+SINM_DEF int
+sinm_context_reserve(sinm_context* ctx, size_t size)
+{
+    if (ctx->size >= size) {
+        return 1;
+    }
+    //NOTE: over allocate instead of using an aligned allocator so the block is tracked like every other one
+    void* allocation = sinm__malloc(size + SINM_SCRATCH_ALIGN - 1);
+    if (!allocation) {
+        return 0;
     }
+    sinm__free(ctx->allocation);
+    ctx->allocation = allocation;
+    ctx->memory = (uint8_t*)(((uintptr_t)allocation + SINM_SCRATCH_ALIGN - 1) / SINM_SCRATCH_ALIGN * SINM_SCRATCH_ALIGN);
+    ctx->size = size;
+    return 1;
+}
 
-    { //Blur passes
-        glUseProgram(sinm__glCtx.blurShader);
-        GLint texUni = glGetUniformLocation(sinm__glCtx.blurShader, "image");
-        GLint horizontalUni = glGetUniformLocation(sinm__glCtx.blurShader, "horizontal");
-        glUniform1i(texUni, 0);
+SINM_DEF int
+sinm_normal_map_buffer_ctx(sinm_context* ctx, const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_blur_type blurType = sinm_blur_box)
+{
+    assert(w > 0 && h > 0);
+    sinm__scratch_layout layout;
+    sinm__scratch_layout_init(&layout, w, h, blurRadius, blurType);
+    if (ctx->size < layout.total) {
+        return 0;
+    }
 
-        int blurPasses = sinm__max(2, numBlurPasses * 2);
-        int horizontal = 1;
-        int firstIteration = 1;
-        for (int i = 0; i < blurPasses; ++i) {
-            glBindFramebuffer(GL_FRAMEBUFFER, sinm__glCtx.pingpongFBO[horizontal]);
-            glUniform1i(horizontalUni, horizontal);
-            glBindTexture(GL_TEXTURE_2D, sinm__glCtx.pingpongBuffers[!horizontal]);
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-            horizontal = !horizontal;
-            firstIteration = false;
+    //NOTE: everything between the input and the encoded normals only needs one channel, so the
+    //intermediates are 8 bit planes(a height plane and blur scratch) instead of RGBA buffers
+    uint8_t* height = ctx->memory;
+    uint8_t* temp = height + layout.plane;
+    uint8_t* scratch = temp + layout.plane;
+
+    BEGIN_TIMER(greyscale)
+    sinm__band_args greyscale = { in, NULL, NULL, w, h };
+    greyscale.greyscaleType = greyscaleType;
+    greyscale.heightOut = height;
+    sinm__parallel_rows(h, sinm__height_band, &greyscale);
+    END_TIMER(greyscale)
+
+    float radius = sinm__min(sinm__min(w, h), sinm__max(0, blurRadius));
+    if (radius >= 1.0f) {
+        //NOTE: can't fail, every band takes its scratch from the context
+        if (blurType == sinm_blur_recursive) {
+            sinm__gaussian_recursive(height, temp, scratch, w, h, radius);
+        } else {
+            sinm__gaussian_box(height, temp, scratch, w, h, radius);
         }
     }
-    assert(!glsys::report_errors());
 
-    { //Conversion to normal map
-        glUseProgram(sinm__glCtx.normalMapShader);
-        GLint texUni = glGetUniformLocation(sinm__glCtx.normalMapShader, "image");
-        GLint scaleUni = glGetUniformLocation(sinm__glCtx.normalMapShader, "scale");
-        GLint flipYUni = glGetUniformLocation(sinm__glCtx.normalMapShader, "flipY");
-        glUniform1i(texUni, 0);
-        glUniform1f(scaleUni, sinm__max(1.0f, scale));
-        float yDir = (flipY) ? -1.0f : 1.0f;
+    sinm__band_args sobel = { NULL, NULL, out, w, h };
+    sobel.scale = scale;
+    sobel.flipY = flipY;
+    sobel.height = height;
+    sinm__parallel_rows(h, sinm__sobel_band, &sobel);
+    return 1;
+}
 
-        glUniform1f(flipYUni, yDir);
-        glBindFramebuffer(GL_FRAMEBUFFER, outFBO);
-        glBindTexture(GL_TEXTURE_2D, sinm__glCtx.pingpongBuffers[1]);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        assert(!glsys::report_errors());
+SINM_DEF int
+sinm_normal_map_buffer(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_blur_type blurType = sinm_blur_box)
+{
+    sinm_context ctx;
+    sinm_context_init(&ctx, NULL, 0);
+    if (!sinm_context_reserve(&ctx, sinm_scratch_size(w, h, blurRadius, blurType))) {
+        return 0;
     }
-    assert(!glsys::report_errors());
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glUseProgram(0);
+    int result = sinm_normal_map_buffer_ctx(&ctx, in, out, w, h, scale, blurRadius, greyscaleType, flipY, blurType);
+    sinm_context_free(&ctx);
+    return result;
 }
-#endif
 
-SINM_DEF void
-sinm__sobel3x3_normals_row_range(const uint32_t* in, uint32_t* out, int32_t xs, int32_t xe, int32_t w, int32_t h, float scale, int flipY)
+//Running sums along rows [ys, ye) of "height" into rows ys + 1 to ye of the table "out"
+static void
+sinm__integral_rows_band(void* data, int32_t ys, int32_t ye, int32_t slot)
 {
-    const float xk[3][3] = {
-        { -1, 0, 1 },
-        { -2, 0, 2 },
-        { -1, 0, 1 },
-    };
-    const float yk[3][3] = {
-        { -1, -2, -1 },
-        { 0, 0, 0 },
-        { 1, 2, 1 },
-    };
-
-    float yDir = (flipY) ? -1.0f : 1.0f;
+    sinm__band_args* a = (sinm__band_args*)data;
+    int32_t stride = a->w + 1;
+    for (int32_t y = ys; y < ye; ++y) {
+        const uint8_t* src = &a->height[(size_t)y * a->w];
+        uint32_t* row = &a->out[(size_t)(y + 1) * stride];
+        row[0] = 0;
+        for (int32_t x = 0; x < a->w; ++x) {
+            row[x + 1] = row[x] + src[x];
+        }
+    }
+}
 
-    for (int32_t y = 0; y < h; ++y) {
+//Adds each row of the table "out" to the one below for columns [xs, xe). Split with sinm__parallel_rows
+//over the width since every row depends on the one above
+static void
+sinm__integral_columns_band(void* data, int32_t xs, int32_t xe, int32_t slot)
+{
+    sinm__band_args* a = (sinm__band_args*)data;
+    int32_t stride = a->w + 1;
+    for (int32_t y = 2; y <= a->h; ++y) {
+        const uint32_t* above = &a->out[(size_t)(y - 1) * stride];
+        uint32_t* row = &a->out[(size_t)y * stride];
         for (int32_t x = xs; x < xe; ++x) {
-            float xmag = 0.0f;
-            float ymag = 0.0f;
-            for (int32_t a = 0; a < 3; ++a) {
-                for (int32_t b = 0; b < 3; ++b) {
-                    int32_t xIdx = sinm__min(w - 1, sinm__max(1, x + b - 1));
-                    int32_t yIdx = sinm__min(h - 1, sinm__max(1, y + a - 1));
-                    int32_t index = yIdx * w + xIdx;
-                    uint32_t pixel = in[index] & 0xFFu;
-                    xmag += pixel * xk[a][b];
-                    ymag += pixel * yk[a][b];
-                }
-            }
-            sinm__v3 color = sinm__normalized(xmag * scale, ymag * scale * yDir, 255.0f);
-            out[y * w + x] = sinm__unit_vector_to_rgba(color);
+            row[x] += above[x];
         }
     }
 }
 
-static sinm__inline void
-sinm__sobel3x3_normals(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, int flipY)
+static void
+sinm__integral_blur_band(void* data, int32_t ys, int32_t ye, int32_t slot)
 {
-    sinm__sobel3x3_normals_row_range(in, out, 0, w, w, h, scale, flipY);
+    sinm__band_args* a = (sinm__band_args*)data;
+    uint8_t* scratch = (uint8_t*)sinm__malloc(sinm__integral_scratch_size(a->w, a->boxes));
+    if (!scratch) {
+        a->failed = 1;
+        return;
+    }
+    const sinm__kernel_table* k = sinm__kernels();
+    for (int32_t y = ys; y < ye; ++y) {
+        k->integralBlurRow(a->in, &a->heightOut[(size_t)y * a->w], y, a->w, a->h, a->boxes, scratch);
+    }
+    sinm__free(scratch);
 }
 
+//Stacked box blur and sobel normals of rows [ys, ye) in one pass. The rows a sobel kernel reads are blurred
+//into three rows of scratch as the band reaches them, so no blurred plane is written
 static void
-sinm__sobel3x3_normals_simd(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, int flipY)
+sinm__integral_normal_band(void* data, int32_t ys, int32_t ye, int32_t slot)
 {
-    const float xk[3][4] = {
-        { -1, 0, 1, 0 },
-        { -2, 0, 2, 0 },
-        { -1, 0, 1, 0 },
-    };
-    const float yk[3][4] = {
-        { -1, -2, -1, 0 },
-        { 0, 0, 0, 0 },
-        { 1, 2, 1, 0 },
-    };
-
-    simd__float simdScale = simd__set1_ps(scale);
-    simd__float simdFlipY = simd__set1_ps((flipY) ? -1.0f : 1.0f);
-    simd__float simd1 = simd__set1_ps(1.0f);
-    simd__float simd127 = simd__set1_ps(127.0f);
-
-    int32_t batchCounter = 0;
-    sinm__aligned_var(float, SINM_SIMD_WIDTH) xBatch[SINM_SIMD_WIDTH];
-    sinm__aligned_var(float, SINM_SIMD_WIDTH) yBatch[SINM_SIMD_WIDTH];
-
-    for (int32_t yIter = 0; yIter < h; ++yIter) {
-        for (int32_t xIter = SINM_SIMD_WIDTH; xIter < w - SINM_SIMD_WIDTH; ++xIter) {
-            __m128 xmag = _mm_set1_ps(0.0f);
-            __m128 ymag = _mm_set1_ps(0.0f);
-
-            for (int32_t a = 0; a < 3; ++a) {
-                int32_t xIdx = sinm__min(w - 1, sinm__max(1, xIter - 1));
-                int32_t yIdx = sinm__min(h - 1, sinm__max(1, yIter + a - 1));
-                int32_t index = yIdx * w + xIdx;
-
-                __m128i pixel = _mm_loadu_si128((__m128i*)&in[index]);
-                pixel = _mm_and_si128(pixel, _mm_set1_epi32(0xFFu));
-                __m128 pixelf = _mm_cvtepi32_ps(pixel);
-                __m128 kx = _mm_loadu_ps((float*)&xk[a]);
-                __m128 ky = _mm_loadu_ps((float*)&yk[a]);
-                xmag = _mm_add_ps(_mm_mul_ps(pixelf, kx), xmag);
-                ymag = _mm_add_ps(_mm_mul_ps(pixelf, ky), ymag);
-            }
-
-            __m128 xSum = _mm_hadd_ps(xmag, xmag);
-            __m128 ySum = _mm_hadd_ps(ymag, ymag);
-            float xn = _mm_cvtss_f32(_mm_hadd_ps(xSum, xSum));
-            float yn = _mm_cvtss_f32(_mm_hadd_ps(ySum, ySum));
-
-            xBatch[batchCounter] = xn;
-            yBatch[batchCounter++] = yn;
-            if (batchCounter == SINM_SIMD_WIDTH) {
-                batchCounter = 0;
-                simd__float x = simd__loadu_ps(xBatch);
-                simd__float y = simd__loadu_ps(yBatch);
-                simd__float z = simd__set1_ps(255.0f);
-
-                x = simd__mul_ps(simd__mul_ps(x, simdScale), simdFlipY);
-                y = simd__mul_ps(simd__mul_ps(y, simdScale), simdFlipY);
-
-                //normalize
-                simd__float len = sinm__length_simd(x, y, z);
-                simd__float invLen = simd__div_ps(simd__set1_ps(1.0f), len);
-                x = simd__mul_ps(x, invLen);
-                y = simd__mul_ps(y, invLen);
-                z = simd__mul_ps(z, invLen);
-
-                int index = yIter * w + (xIter - (SINM_SIMD_WIDTH - 1));
-                simd__storeu_ix((simd__int*)&out[index], sinm__v3_to_rgba_simd(x, y, z));
+    sinm__band_args* a = (sinm__band_args*)data;
+    int32_t w = a->w;
+    int32_t h = a->h;
+    size_t blurSize = sinm__integral_scratch_size(w, a->boxes);
+    uint8_t* scratch = (uint8_t*)sinm__malloc(blurSize + 3 * (size_t)w);
+    if (!scratch) {
+        a->failed = 1;
+        return;
+    }
+    uint8_t* blurred = scratch + blurSize;
+    int32_t blurredRows[3] = { -1, -1, -1 };
+
+    const sinm__kernel_table* k = sinm__kernels();
+    for (int32_t y = ys; y < ye; ++y) {
+        const uint8_t* rows[3];
+        for (int32_t i = 0; i < 3; ++i) {
+            //NOTE: clamped like sinm__sobel_band. Three neighbouring rows never share a slot
+            int32_t row = sinm__min(h - 1, sinm__max(1, y - 1 + i));
+            uint8_t* dst = &blurred[(size_t)(row % 3) * w];
+            if (blurredRows[row % 3] != row) {
+                k->integralBlurRow(a->in, dst, row, w, h, a->boxes, scratch);
+                blurredRows[row % 3] = row;
             }
+            rows[i] = dst;
         }
+        k->sobelRow(rows, 0, &a->out[(size_t)y * w], 0, w, w, a->scale, a->flipY);
     }
-
-    sinm__sobel3x3_normals_row_range(in, out, 0, SINM_SIMD_WIDTH, w, h, scale, flipY);
-    sinm__sobel3x3_normals_row_range(in, out, w - SINM_SIMD_WIDTH, w, w, h, scale, flipY);
+    sinm__free(scratch);
 }
 
-SINM_DEF void
-sinm__normalize(uint32_t* in, int32_t w, int32_t h, float scale, int flipY)
+//Stacked box gaussian of the plane "integral" was built from into "out"(w * h). Same cost for any sigma.
+//Returns 0 if scratch memory could not be allocated
+SINM_DEF int
+sinm__gaussian_integral(const sinm_integral* integral, uint8_t* out, float sigma)
 {
-    float invScale = 1.0f / scale;
-    float yDir = (flipY) ? -1.0f : 1.0f;
-    for (int32_t i = 0; i < w * h; ++i) {
-        sinm__v3 v = sinm__rgba_to_v3(in[i]);
-        in[i] = sinm__unit_vector_to_rgba(sinm__normalized(v.x, v.y * yDir, v.z * invScale));
-    }
+    sinm__integral_boxes boxes;
+    sinm__integral_boxes_init(&boxes, sigma);
+
+    sinm__band_args blur = { integral->sums, NULL, NULL, integral->w, integral->h };
+    blur.heightOut = out;
+    blur.boxes = &boxes;
+    sinm__parallel_rows(integral->h, sinm__integral_blur_band, &blur);
+    return !blur.failed;
 }
 
 SINM_DEF void
-sinm__normalize_simd(uint32_t* in, int32_t w, int32_t h, float scale, int flipY)
+sinm_integral_free(sinm_integral* integral)
 {
-    assert(w % SINM_SIMD_WIDTH == 0);
-    for (int32_t i = 0; i < w * h; i += SINM_SIMD_WIDTH) {
-        simd__int pixel = simd__loadu_ix((simd__int*)&in[i]);
-        simd__float x, y, z;
-        sinm__rgba_to_v3_simd(pixel, &x, &y, &z);
-        simd__float len = sinm__length_simd(x, y, z);
-        simd__float invLen = simd__div_ps(simd__set1_ps(1.0f), len);
-        x = simd__mul_ps(x, invLen);
-        y = simd__mul_ps(y, invLen);
-        z = simd__mul_ps(z, invLen);
-        simd__storeu_ix((simd__int*)&in[i], sinm__v3_to_rgba_simd(x, y, z));
-    }
+    sinm__free(integral->height);
+    sinm__free(integral->sums);
+    memset(integral, 0, sizeof(*integral));
 }
 
-#if 0
-SINM_DEF void
-sinm__normalize_gpu(uint32_t* in, )
+//NOTE: the sums are kept modulo 2^32. Box sums are differences of them so they come out exact as long as
+//the box itself sums to less than 2^32, which SINM__INTEGRAL_MAX_RADIUS guarantees(with room for a signed convert).
+//Half the memory of 64 bit sums at any image size
+SINM_DEF int
+sinm_integral_build(sinm_integral* integral, const uint32_t* in, int32_t w, int32_t h, sinm_greyscale_type greyscaleType)
 {
+    assert(w > 0 && h > 0);
+    memset(integral, 0, sizeof(*integral));
+    integral->height = (uint8_t*)sinm__malloc((size_t)w * h);
+    integral->sums = (uint32_t*)sinm__malloc((size_t)(w + 1) * (h + 1) * sizeof(uint32_t));
+    if (!integral->height || !integral->sums) {
+        sinm_integral_free(integral);
+        return 0;
+    }
+    integral->w = w;
+    integral->h = h;
+
+    sinm__band_args greyscale = { in, NULL, NULL, w, h };
+    greyscale.greyscaleType = greyscaleType;
+    greyscale.heightOut = integral->height;
+    sinm__parallel_rows(h, sinm__height_band, &greyscale);
+
+    memset(integral->sums, 0, (size_t)(w + 1) * sizeof(uint32_t));
+    sinm__band_args sums = { NULL, NULL, integral->sums, w, h };
+    sums.height = integral->height;
+    sinm__parallel_rows(h, sinm__integral_rows_band, &sums);
+    sinm__parallel_rows(w + 1, sinm__integral_columns_band, &sums);
+    return 1;
 }
-#endif
 
-SINM_DEF sinm__inline void
-sinm_normalize(uint32_t* in, int32_t w, int32_t h, float scale, int flipY)
+SINM_DEF int
+sinm_normal_map_integral(const sinm_integral* integral, uint32_t* out, float scale, float blurRadius, int flipY)
 {
-    if (w % SINM_SIMD_WIDTH == 0) {
-        sinm__normalize_simd(in, w, h, scale, flipY);
-    } else {
-        sinm__normalize(in, w, h, scale, flipY);
+    int32_t w = integral->w;
+    int32_t h = integral->h;
+    sinm__band_args normals = { integral->sums, NULL, out, w, h };
+    normals.scale = scale;
+    normals.flipY = flipY;
+    normals.height = integral->height;
+
+    float radius = sinm__min(sinm__min(w, h), sinm__max(0, blurRadius));
+    if (radius < 1.0f) {
+        sinm__parallel_rows(h, sinm__sobel_band, &normals);
+        return 1;
     }
+
+    sinm__integral_boxes boxes;
+    sinm__integral_boxes_init(&boxes, radius);
+    normals.boxes = &boxes;
+    sinm__parallel_rows(h, sinm__integral_normal_band, &normals);
+    return !normals.failed;
 }
 
-SINM_DEF void sinm__composite(const uint32_t* in1, const uint32_t* in2, uint32_t* out, int32_t w, int32_t h)
+//Output rows [ys, ye) of the 2x2 box downsample of "height"(w x h) into "heightOut". Odd sizes repeat their last row or column
+static void
+sinm__downsample_band(void* data, int32_t ys, int32_t ye, int32_t slot)
 {
-    for (int32_t i = 0; i < w * h; ++i) {
-        uint32_t c1 = in1[i];
-        uint32_t c2 = in2[i];
-        uint32_t r1 = c1 & 0xFFu;
-        uint32_t r2 = c2 & 0xFFu;
-        uint32_t g1 = (c1 >> 8) & 0xFFu;
-        uint32_t g2 = (c2 >> 8) & 0xFFu;
-        uint32_t b1 = (c1 >> 16) & 0xFFu;
-        uint32_t b2 = (c2 >> 16) & 0xFFu;
-        uint32_t r = (r1 + r2) >> 1;
-        uint32_t g = (g1 + g2) >> 1;
-        uint32_t b = (b1 + b2) >> 1;
-        out[i] = (r | g << 8u | b << 16u | 255u << 24u);
+    sinm__band_args* a = (sinm__band_args*)data;
+    int32_t dw = (a->w + 1) / 2;
+    for (int32_t y = ys; y < ye; ++y) {
+        const uint8_t* r0 = &a->height[(size_t)2 * y * a->w];
+        const uint8_t* r1 = &a->height[(size_t)sinm__min(a->h - 1, 2 * y + 1) * a->w];
+        uint8_t* o = &a->heightOut[(size_t)y * dw];
+        for (int32_t x = 0; x < dw; ++x) {
+            int32_t x0 = 2 * x;
+            int32_t x1 = sinm__min(a->w - 1, x0 + 1);
+            o[x] = (uint8_t)((r0[x0] + r0[x1] + r1[x0] + r1[x1] + 2) >> 2);
+        }
     }
 }
 
-SINM_DEF void sinm__composite_simd(const uint32_t* in1, const uint32_t* in2, uint32_t* out, int32_t w, int32_t h)
+SINM_DEF void
+sinm_pyramid_free(sinm_pyramid* pyramid)
 {
-    simd__int ff = simd__set1_epi32(0xFF);
-    simd__int alpha = simd__slli_epi32(ff, 24);
-    for (int32_t i = 0; i < w * h; i += SINM_SIMD_WIDTH) {
-        simd__int c1 = simd__loadu_ix((simd__int*)&in1[i]);
-        simd__int c2 = simd__loadu_ix((simd__int*)&in2[i]);
+    sinm__free(pyramid->planes[0]);
+    memset(pyramid, 0, sizeof(*pyramid));
+}
 
-        simd__int r1 = simd__and_ix(c1, ff);
-        simd__int r2 = simd__and_ix(c2, ff);
-        simd__int g1 = simd__and_ix(simd__srli_epi32(c1, 8), ff);
-        simd__int g2 = simd__and_ix(simd__srli_epi32(c2, 8), ff);
-        simd__int b1 = simd__and_ix(simd__srli_epi32(c1, 16), ff);
-        simd__int b2 = simd__and_ix(simd__srli_epi32(c2, 16), ff);
+SINM_DEF int
+sinm_pyramid_build(sinm_pyramid* pyramid, const uint32_t* in, int32_t w, int32_t h, sinm_greyscale_type greyscaleType)
+{
+    assert(w > 0 && h > 0);
+    memset(pyramid, 0, sizeof(*pyramid));
+
+    size_t total = 0;
+    int32_t lw = w;
+    int32_t lh = h;
+    for (;;) {
+        pyramid->w[pyramid->levels] = lw;
+        pyramid->h[pyramid->levels] = lh;
+        pyramid->levels++;
+        total += (size_t)lw * lh;
+        lw = (lw + 1) / 2;
+        lh = (lh + 1) / 2;
+        if (pyramid->levels == SINM_PYRAMID_LEVELS || sinm__min(lw, lh) < SINM__PYRAMID_MIN_SIZE) {
+            break;
+        }
+    }
 
-        simd__int r = simd__srli_epi32(simd__add_epi32(r1, r2), 1);
-        simd__int g = simd__srli_epi32(simd__add_epi32(g1, g2), 1);
-        simd__int b = simd__srli_epi32(simd__add_epi32(b1, b2), 1);
+    uint8_t* planes = (uint8_t*)sinm__malloc(total);
+    if (!planes) {
+        memset(pyramid, 0, sizeof(*pyramid));
+        return 0;
+    }
+    for (int32_t i = 0; i < pyramid->levels; ++i) {
+        pyramid->planes[i] = planes;
+        planes += (size_t)pyramid->w[i] * pyramid->h[i];
+    }
 
-        simd__int final = simd__or_ix(simd__or_ix(simd__or_ix(r, simd__slli_epi32(g, 8)), simd__slli_epi32(b, 16)), alpha);
+    sinm__band_args greyscale = { in, NULL, NULL, w, h };
+    greyscale.greyscaleType = greyscaleType;
+    greyscale.heightOut = pyramid->planes[0];
+    sinm__parallel_rows(h, sinm__height_band, &greyscale);
 
-        simd__storeu_ix((simd__int*)&out[i], final);
+    for (int32_t i = 1; i < pyramid->levels; ++i) {
+        sinm__band_args down = { NULL, NULL, NULL, pyramid->w[i - 1], pyramid->h[i - 1] };
+        down.height = pyramid->planes[i - 1];
+        down.heightOut = pyramid->planes[i];
+        sinm__parallel_rows(pyramid->h[i], sinm__downsample_band, &down);
     }
+    return 1;
 }
 
-SINM_DEF sinm__inline void
-sinm_composite(const uint32_t* in1, const uint32_t* in2, uint32_t* out, int32_t w, int32_t h)
+//Coarsest level with at least SINM_PYRAMID_MIN_SIGMA of blur left to do for a gaussian of "sigma",
+//and that blur in pixels of the level.
+//NOTE: a 2x2 box has a variance of 1/4 pixel, so the first "level" halvings already blur by
+//(4^level - 1) / 12 full resolution pixels squared
+static int32_t
+sinm__pyramid_level(const sinm_pyramid* pyramid, float sigma, float* levelSigma)
 {
-    if ((w * h) % SINM_SIMD_WIDTH == 0) {
-        sinm__composite_simd(in1, in2, out, w, h);
-    } else {
-        sinm__composite(in1, in2, out, w, h);
+    int32_t level = 0;
+    *levelSigma = sigma;
+    for (int32_t i = 1; i < pyramid->levels; ++i) {
+        float size = (float)(1 << i);
+        float residual = sigma * sigma - (size * size - 1.0f) / 12.0f;
+        float s = residual > 0.0f ? sqrtf(residual) / size : 0.0f;
+        if (s < SINM_PYRAMID_MIN_SIGMA) {
+            break;
+        }
+        level = i;
+        *levelSigma = s;
     }
+    return level;
 }
 
-SINM_DEF sinm__inline uint32_t*
-sinm_composite_alloc(const uint32_t* in1, const uint32_t* in2, int32_t w, int32_t h)
+//Sobel gradients of rows [ys, ye) of the level plane "height" into "gradients", clamped like sinm__sobel_band
+static void
+sinm__level_gradients_band(void* data, int32_t ys, int32_t ye, int32_t slot)
 {
-    uint32_t* result = (uint32_t*)malloc(sizeof(uint32_t) * w * h);
-    if (result) {
-        sinm_composite(in1, in2, result, w, h);
+    sinm__band_args* a = (sinm__band_args*)data;
+    int32_t w = a->levelW;
+    int32_t h = a->levelH;
+    float* gxOut = a->gradients;
+    float* gyOut = a->gradients + (size_t)w * h;
+    for (int32_t y = ys; y < ye; ++y) {
+        const uint8_t* r0 = &a->height[(size_t)sinm__min(h - 1, sinm__max(1, y - 1)) * w];
+        const uint8_t* r1 = &a->height[(size_t)sinm__min(h - 1, sinm__max(1, y)) * w];
+        const uint8_t* r2 = &a->height[(size_t)sinm__min(h - 1, sinm__max(1, y + 1)) * w];
+        for (int32_t x = 0; x < w; ++x) {
+            int32_t l = sinm__min(w - 1, sinm__max(1, x - 1));
+            int32_t c = sinm__min(w - 1, sinm__max(1, x));
+            int32_t r = sinm__min(w - 1, sinm__max(1, x + 1));
+            gxOut[(size_t)y * w + x] = (float)((r0[r] - r0[l]) + 2 * (r1[r] - r1[l]) + (r2[r] - r2[l]));
+            gyOut[(size_t)y * w + x] = (float)((r2[l] + 2 * r2[c] + r2[r]) - (r0[l] + 2 * r0[c] + r0[r]));
+        }
     }
-    return result;
 }
 
+//Level sample and weight of the next one for each of "n" full resolution samples "step" level pixels apart.
+//NOTE: level pixel i covers full resolution pixels [i / step, (i + 1) / step) so it sits at (i + 0.5) / step - 0.5
 static void
-sinm__greyscale(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, sinm_greyscale_type type)
-{
-    int32_t count = w * h;
-    switch (type) {
-    case sinm_greyscale_lightness: {
-        for (int32_t i = 0; i < count; ++i) {
-            uint32_t c = in[i];
-            uint32_t l = sinm__lightness_average(c & 0xFFu, (c >> 8) & 0xFFu, (c >> 16) & 0xFFu);
-            out[i] = sinm__greyscale_from_byte(l);
-        }
-    } break;
-
-    case sinm_greyscale_average: {
-        for (int32_t i = 0; i < count; ++i) {
-            uint32_t c = in[i];
-            uint32_t l = sinm__average(c & 0xFFu, (c >> 8) & 0xFFu, (c >> 16) & 0xFFu);
-            out[i] = sinm__greyscale_from_byte(l);
-        }
-    } break;
-
-    case sinm_greyscale_luminance: {
-        for (int32_t i = 0; i < count; ++i) {
-            uint32_t c = in[i];
-            uint32_t l = sinm__luminance(c & 0xFFu, (c >> 8) & 0xFFu, (c >> 16) & 0xFFu);
-            out[i] = sinm__greyscale_from_byte(l);
-        }
-    } break;
-    default: {
-        //INVALID OPTION
-        assert(false);
-    } break;
+sinm__upsample_weights(int32_t* index, float* weight, int32_t levelN, int32_t n, float step)
+{
+    for (int32_t x = 0; x < n; ++x) {
+        float u = sinm__max(0.0f, (x + 0.5f) * step - 0.5f);
+        index[x] = sinm__min(levelN - 2, (int32_t)u);
+        weight[x] = sinm__min(1.0f, u - (float)index[x]);
     }
 }
 
 static void
-sinm__simd_greyscale(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, sinm_greyscale_type type)
+sinm__upsample_line(const float* in, float* out, const int32_t* index, const float* weight, int32_t n)
 {
-    simd__int redMask = simd__set1_epi32(0xFF);
-    simd__int greenMask = simd__set1_epi32(0xFF00u);
-    simd__int blueMask = simd__set1_epi32(0xFF0000u);
-    simd__int alpha = simd__set1_epi32(0xFF000000u);
-
-    int32_t count = w * h;
-
-    switch (type) {
-    case sinm_greyscale_lightness: {
-        for (int32_t i = 0; i < count; i += SINM_SIMD_WIDTH) {
-            simd__int c = simd__loadu_ix((simd__int*)&in[i]);
-            simd__int r = simd__and_ix(c, redMask);
-            simd__int g = simd__srli_epi32(simd__and_ix(c, greenMask), 8);
-            simd__int b = simd__srli_epi32(simd__and_ix(c, blueMask), 16);
-
-            simd__int max = simd__max_epi32(simd__max_epi32(r, g), b);
-            simd__int min = simd__min_epi32(simd__min_epi32(r, g), b);
-            simd__int l = simd__srli_epi32(simd__add_epi32(min, max), 1);
-
-            l = simd__or_ix(simd__slli_epi32(l, 16),
-                simd__or_ix(simd__slli_epi32(l, 8),
-                    simd__or_ix(l, alpha)));
-
-            simd__storeu_ix((simd__int*)&out[i], l);
-        }
-    } break;
-
-    case sinm_greyscale_average: {
-        simd__float inverse3 = simd__set1_ps(1.0f / 3.0f);
-        for (int32_t i = 0; i < count; i += SINM_SIMD_WIDTH) {
-            simd__int c = simd__loadu_ix((simd__int*)&in[i]);
-            simd__int r = simd__and_ix(c, redMask);
-            simd__int g = simd__srli_epi32(simd__and_ix(c, greenMask), 8);
-            simd__int b = simd__srli_epi32(simd__and_ix(c, blueMask), 16);
-
-            simd__int s = simd__add_epi32(simd__add_epi32(r, g), b);
-            s = simd__cvtps_epi32(simd__mul_ps(simd__cvtepi32_ps(s), inverse3));
-            s = simd__or_ix(simd__slli_epi32(s, 16),
-                simd__or_ix(simd__slli_epi32(s, 8),
-                    simd__or_ix(s, alpha)));
-
-            simd__storeu_ix((simd__int*)&out[i], s);
-        }
-    } break;
-
-    case sinm_greyscale_luminance: {
-        simd__float rBias = simd__set1_ps(0.21f);
-        simd__float gBias = simd__set1_ps(0.72f);
-        simd__float bBias = simd__set1_ps(0.07f);
-
-        for (int32_t i = 0; i < count; i += SINM_SIMD_WIDTH) {
-            simd__int c = simd__loadu_ix((simd__int*)&in[i]);
-            simd__float r = simd__cvtepi32_ps(simd__and_ix(c, redMask));
-            simd__float g = simd__cvtepi32_ps(simd__srli_epi32(simd__and_ix(c, greenMask), 8));
-            simd__float b = simd__cvtepi32_ps(simd__srli_epi32(simd__and_ix(c, blueMask), 16));
-
-            r = simd__mul_ps(r, rBias);
-            g = simd__mul_ps(g, gBias);
-            b = simd__mul_ps(b, bBias);
-
-            simd__int sum = simd__cvtps_epi32(simd__add_ps(r, simd__add_ps(g, b)));
-            sum = simd__or_ix(simd__slli_epi32(sum, 16),
-                simd__or_ix(simd__slli_epi32(sum, 8),
-                    simd__or_ix(sum, alpha)));
-
-            simd__storeu_ix((simd__int*)&out[i], sum);
-        }
-    } break;
-    default: {
-        //INVALID OPTION
-        assert(false);
-    } break;
+    for (int32_t x = 0; x < n; ++x) {
+        float a = in[index[x]];
+        float b = in[index[x] + 1];
+        out[x] = a + (b - a) * weight[x];
     }
 }
 
-SINM_DEF void
-sinm_greyscale(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, sinm_greyscale_type type)
+//Full resolution normals for rows [ys, ye) from the gradients of pyramid level "level", interpolated bilinearly.
+//Each level row is widened once and reused for every output row that falls next to it
+static void
+sinm__upsample_gradients_band(void* data, int32_t ys, int32_t ye, int32_t slot)
 {
-    int32_t count = w * h;
-    if (count % SINM_SIMD_WIDTH == 0) {
-        sinm__simd_greyscale(in, out, w, h, type);
-    } else {
-        sinm__greyscale(in, out, w, h, type);
+    sinm__band_args* a = (sinm__band_args*)data;
+    int32_t w = a->w;
+    int32_t lw = a->levelW;
+    int32_t lh = a->levelH;
+    float* rows = (float*)sinm__malloc((size_t)w * (5 * sizeof(float) + sizeof(int32_t)));
+    if (!rows) {
+        a->failed = 1;
+        return;
+    }
+    float* gx[2] = { rows, rows + w };
+    float* gy[2] = { rows + 2 * w, rows + 3 * w };
+    float* weight = rows + 4 * w;
+    int32_t* index = (int32_t*)(rows + 5 * w);
+    const float* levelGx = a->gradients;
+    const float* levelGy = a->gradients + (size_t)lw * lh;
+
+    //NOTE: level gradients are per level pixel, "step" scales them back to per full resolution pixel
+    float step = 1.0f / (float)(1 << a->level);
+    sinm__upsample_weights(index, weight, lw, w, step);
+
+    const sinm__kernel_table* k = sinm__kernels();
+    int32_t widened = -2;
+    for (int32_t y = ys; y < ye; ++y) {
+        float v = sinm__max(0.0f, (y + 0.5f) * step - 0.5f);
+        int32_t j = sinm__min(lh - 2, (int32_t)v);
+        float t = sinm__min(1.0f, v - (float)j);
+        if (j == widened + 1) {
+            float* swap = gx[0];
+            gx[0] = gx[1];
+            gx[1] = swap;
+            swap = gy[0];
+            gy[0] = gy[1];
+            gy[1] = swap;
+            sinm__upsample_line(&levelGx[(size_t)(j + 1) * lw], gx[1], index, weight, w);
+            sinm__upsample_line(&levelGy[(size_t)(j + 1) * lw], gy[1], index, weight, w);
+        } else if (j != widened) {
+            sinm__upsample_line(&levelGx[(size_t)j * lw], gx[0], index, weight, w);
+            sinm__upsample_line(&levelGy[(size_t)j * lw], gy[0], index, weight, w);
+            sinm__upsample_line(&levelGx[(size_t)(j + 1) * lw], gx[1], index, weight, w);
+            sinm__upsample_line(&levelGy[(size_t)(j + 1) * lw], gy[1], index, weight, w);
+        }
+        widened = j;
+        k->gradientRow(gx[0], gy[0], gx[1], gy[1], t, &a->out[(size_t)y * w], w, a->scale * step, a->flipY);
     }
+    sinm__free(rows);
 }
 
 SINM_DEF int
-sinm_normal_map_buffer(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY)
+sinm_normal_map_pyramid(const sinm_pyramid* pyramid, uint32_t* out, float scale, float blurRadius, int flipY)
 {
-    assert(w > 0 && h > 0);
-    uint32_t* intermediate = (uint32_t*)malloc(w * h * sizeof(uint32_t));
-
-    if (intermediate) {
-        BEGIN_TIMER(greyscale)
-        if (greyscaleType != sinm_greyscale_none) {
-            sinm_greyscale(in, out, w, h, greyscaleType);
-        } else {
-            memcpy(out, in, w * h * sizeof(uint32_t));
-        }
-        END_TIMER(greyscale)
+    int32_t w = pyramid->w[0];
+    int32_t h = pyramid->h[0];
+    sinm__band_args sobel = { NULL, NULL, out, w, h };
+    sobel.scale = scale;
+    sobel.flipY = flipY;
+
+    float radius = sinm__min(sinm__min(w, h), sinm__max(0, blurRadius));
+    if (radius < 1.0f) {
+        sobel.height = pyramid->planes[0];
+        sinm__parallel_rows(h, sinm__sobel_band, &sobel);
+        return 1;
+    }
 
-        float radius = sinm__min(sinm__min(w, h), sinm__max(0, blurRadius));
-        if (radius >= 1.0f) {
-            sinm__gaussian_box(out, intermediate, w, h, radius);
-        } else {
-            memcpy(intermediate, out, w * h * sizeof(uint32_t));
-        }
+    float levelSigma;
+    int32_t level = sinm__pyramid_level(pyramid, radius, &levelSigma);
+    int32_t lw = pyramid->w[level];
+    int32_t lh = pyramid->h[level];
 
-        //TODO: support using simd on non power of 2 images
-        int32_t count = w * h;
-        if (count % SINM_SIMD_WIDTH == 0) {
-            sinm__sobel3x3_normals_simd(intermediate, out, w, h, scale, flipY);
-        } else {
-            sinm__sobel3x3_normals(intermediate, out, w, h, scale, flipY);
+    //NOTE: the blur works in place so even level 0 is copied out of the pyramid
+    uint8_t* height = (uint8_t*)sinm__malloc(2 * (size_t)lw * lh);
+    if (!height) {
+        return 0;
+    }
+    memcpy(height, pyramid->planes[level], (size_t)lw * lh);
+    int ok = sinm__gaussian_box(height, height + (size_t)lw * lh, NULL, lw, lh, sinm__min(sinm__min(lw, lh), levelSigma));
+
+    if (ok && level == 0) {
+        sobel.height = height;
+        sinm__parallel_rows(h, sinm__sobel_band, &sobel);
+    } else if (ok) {
+        float* gradients = (float*)sinm__malloc(2 * (size_t)lw * lh * sizeof(float));
+        ok = gradients != NULL;
+        if (ok) {
+            sinm__band_args levelArgs = { NULL, NULL, NULL, w, h };
+            levelArgs.height = height;
+            levelArgs.gradients = gradients;
+            levelArgs.level = level;
+            levelArgs.levelW = lw;
+            levelArgs.levelH = lh;
+            sinm__parallel_rows(lh, sinm__level_gradients_band, &levelArgs);
+
+            sobel.gradients = gradients;
+            sobel.level = level;
+            sobel.levelW = lw;
+            sobel.levelH = lh;
+            sinm__parallel_rows(h, sinm__upsample_gradients_band, &sobel);
+            ok = !sobel.failed;
+            sinm__free(gradients);
         }
-
-        free(intermediate);
-        return 1;
     }
-    return 0;
+
+    sinm__free(height);
+    return ok;
 }
 
-//Returns and opengl texture ID. To get the raw data use sinm_gpu_normal_map_to_buffer()
+#ifdef SI_NORMALMAP_GPU
+//Returns and opengl texture ID. To get the raw data use sinm_gpu_normal_map_to_buffer(), free with sinm_free_gpu_buffer()
 //For best performance keep everything in GPU memory until you really need to access the data(such as writing it to a file)
+//"format" picks the texture format, RGBA8 or RG8 are a quarter or an eighth of the default RGBA32F
 
 SINM_DEF sinm_gpu_buffer
-sinm_normal_map_gpu(const uint32_t* in, int32_t w, int32_t h, float scale, int numBlurPasses, sinm_greyscale_type greyscaleType, int flipY)
+sinm_normal_map_gpu(const uint32_t* in, int32_t w, int32_t h, float scale, int numBlurPasses, sinm_greyscale_type greyscaleType, int flipY, sinm_gpu_output_format format = sinm_gpu_output_rgba32f)
 {
     assert(sinm__glCtx.initialized);
     assert(w > 0 && h > 0);
@@ -1034,30 +3717,21 @@ sinm_normal_map_gpu(const uint32_t* in, int32_t w, int32_t h, float scale, int n
     scale = sinm__max(1.0f, scale);
 
     sinm_gpu_buffer result = {};
-    glGenFramebuffers(1, &result.fbo);
-    glGenTextures(1, &result.buffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, result.fbo);
-    glBindTexture(GL_TEXTURE_2D, result.buffer);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, result.buffer, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    result.buffer = sinm__gpu_texture_create(w, h, sinm__gpu_output_internal_format(format));
+    result.fbo = sinm__gpu_framebuffer_create(result.buffer);
 
     sinm__normal_map_gpu(in, result.fbo, w, h, scale, numBlurPasses, greyscaleType, flipY);
 
     return result;
 }
+#endif
 
 SINM_DEF sinm__inline uint32_t*
-sinm_normal_map(const uint32_t* in, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY)
+sinm_normal_map(const uint32_t* in, int32_t w, int32_t h, float scale, float blurRadius, sinm_greyscale_type greyscaleType, int flipY, sinm_blur_type blurType = sinm_blur_box)
 {
-    uint32_t* result = (uint32_t*)malloc(w * h * sizeof(uint32_t));
+    uint32_t* result = (uint32_t*)malloc((size_t)w * h * sizeof(uint32_t));
     if (result) {
-        if (!sinm_normal_map_buffer(in, result, w, h, scale, blurRadius, greyscaleType, flipY)) {
+        if (!sinm_normal_map_buffer(in, result, w, h, scale, blurRadius, greyscaleType, flipY, blurType)) {
             free(result);
             return NULL;
         }
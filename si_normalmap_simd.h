@@ -0,0 +1,1542 @@
+/***************************************************************************
+ * SIMD kernels for si_normalmap.h
+ *
+ * Do not include this directly. The implementation of si_normalmap.h
+ * includes it once per instruction set with SINM__ISA set to one of the
+ * SINM__ISA_* levels. Each pass defines the kernels inside their own namespace,
+ * compiled for that instruction set, and exports them through a
+ * sinm__kernel_table named "kernels" that is picked at runtime.
+ ***************************************************************************/
+
+#if SINM__ISA == SINM__ISA_SSE41
+#define SINM__ISA_NAMESPACE sinm__sse41
+#define SINM__ISA_TARGET "sse4.1"
+#elif SINM__ISA == SINM__ISA_AVX2
+#define SINM__ISA_NAMESPACE sinm__avx2
+#define SINM__ISA_TARGET "avx2"
+#elif SINM__ISA == SINM__ISA_AVX512
+#define SINM__ISA_NAMESPACE sinm__avx512
+#define SINM__ISA_TARGET "avx512f,avx512bw,avx512dq,avx512vl"
+#else
+#error "SINM__ISA must be set before including si_normalmap_simd.h"
+#endif
+
+#if SINM__ISA == SINM__ISA_AVX512
+#define simd_prefix_float(name) _mm512_##name
+#define SINM_SIMD_WIDTH 16
+#define SINM_SIMD_DOUBLE_WIDTH 8
+#define simd__int __m512i
+#define simd__float __m512
+#define simd__double __m512d
+#define simd__and_ix(a, b) _mm512_and_si512(a, b)
+#define simd__or_ix(a, b) _mm512_or_si512(a, b)
+#define simd__loadu_ix(a) _mm512_loadu_si512(a)
+#define simd__storeu_ix(ptr, v) _mm512_storeu_si512(ptr, v)
+
+//NOTE: partial batches are loaded and stored through a lane mask instead of a padded copy
+#define SINM__MASKED_TAILS 1
+#define simd__mask __mmask16
+#define simd__tail_mask(n) ((__mmask16)((1u << (n)) - 1u))
+#define simd__maskz_loadu_ix(m, ptr) _mm512_maskz_loadu_epi32(m, ptr)
+#define simd__mask_storeu_ix(ptr, m, v) _mm512_mask_storeu_epi32(ptr, m, v)
+#elif SINM__ISA == SINM__ISA_SSE41
+#define simd_prefix_float(name) _mm_##name
+#define SINM_SIMD_WIDTH 4
+#define SINM_SIMD_DOUBLE_WIDTH 2
+#define simd__int __m128i
+#define simd__float __m128
+#define simd__double __m128d
+#define simd__and_ix(a, b) _mm_and_si128(a, b)
+#define simd__or_ix(a, b) _mm_or_si128(a, b)
+#define simd__loadu_ix(a) _mm_loadu_si128(a)
+#define simd__storeu_ix(ptr, v) _mm_storeu_si128(ptr, v)
+#else
+//NOTE: the 256 bit integer ops(max_epi32, add_epi32 ...) need AVX2, not just AVX
+#define simd_prefix_float(name) _mm256_##name
+#define SINM_SIMD_WIDTH 8
+#define SINM_SIMD_DOUBLE_WIDTH 4
+#define simd__int __m256i
+#define simd__float __m256
+#define simd__double __m256d
+#define simd__and_ix(a, b) _mm256_and_si256(a, b)
+#define simd__or_ix(a, b) _mm256_or_si256(a, b)
+#define simd__loadu_ix(a) _mm256_loadu_si256(a)
+#define simd__storeu_ix(ptr, v) _mm256_storeu_si256(ptr, v)
+#endif
+
+#ifndef SINM__MASKED_TAILS
+#define SINM__MASKED_TAILS 0
+#endif
+
+#define simd__set1_epi32(a) simd_prefix_float(set1_epi32(a))
+#define simd__set1_epi16(a) simd_prefix_float(set1_epi16(a))
+#define simd__add_epi16(a, b) simd_prefix_float(add_epi16(a, b))
+#define simd__sub_epi16(a, b) simd_prefix_float(sub_epi16(a, b))
+#define simd__mulhi_epu16(a, b) simd_prefix_float(mulhi_epu16(a, b))
+#define simd__srl_epi16(a, count) simd_prefix_float(srl_epi16(a, count))
+#define simd__mul_epu32(a, b) simd_prefix_float(mul_epu32(a, b))
+#define simd__mullo_epi32(a, b) simd_prefix_float(mullo_epi32(a, b))
+#define simd__srl_epi64(a, count) simd_prefix_float(srl_epi64(a, count))
+#define simd__srli_epi64(a, i) simd_prefix_float(srli_epi64(a, i))
+#define simd__slli_epi64(a, i) simd_prefix_float(slli_epi64(a, i))
+#define simd__setzero_ps() simd_prefix_float(setzero_ps())
+#define simd__andnot_ps(a, b) simd_prefix_float(andnot_ps(a, b))
+#define simd__add_epi32(a, b) simd_prefix_float(add_epi32(a, b))
+#define simd__sub_epi32(a, b) simd_prefix_float(sub_epi32(a, b))
+#define simd__max_epi32(a, b) simd_prefix_float(max_epi32(a, b))
+#define simd__min_epi32(a, b) simd_prefix_float(min_epi32(a, b))
+#define simd__loadu_ps(a) simd_prefix_float(loadu_ps(a))
+#define simd__storeu_ps(ptr, v) simd_prefix_float(storeu_ps(ptr, v))
+#define simd__set1_pd(a) simd_prefix_float(set1_pd(a))
+#define simd__loadu_pd(a) simd_prefix_float(loadu_pd(a))
+#define simd__storeu_pd(ptr, v) simd_prefix_float(storeu_pd(ptr, v))
+#define simd__add_pd(a, b) simd_prefix_float(add_pd(a, b))
+#define simd__sub_pd(a, b) simd_prefix_float(sub_pd(a, b))
+#define simd__mul_pd(a, b) simd_prefix_float(mul_pd(a, b))
+#define simd__min_pd(a, b) simd_prefix_float(min_pd(a, b))
+#define simd__max_pd(a, b) simd_prefix_float(max_pd(a, b))
+#define simd__srli_epi32(a, i) simd_prefix_float(srli_epi32(a, i))
+#define simd__slli_epi32(a, i) simd_prefix_float(slli_epi32(a, i))
+#define simd__set1_ps(a) simd_prefix_float(set1_ps(a))
+#define simd__cvtepi32_ps(a) simd_prefix_float(cvtepi32_ps(a))
+#define simd__cvtps_epi32(a) simd_prefix_float(cvtps_epi32(a))
+#define simd__cvttps_epi32(a) simd_prefix_float(cvttps_epi32(a))
+#define simd__add_ps(a, b) simd_prefix_float(add_ps(a, b))
+#define simd__sub_ps(a, b) simd_prefix_float(sub_ps(a, b))
+#define simd__mul_ps(a, b) simd_prefix_float(mul_ps(a, b))
+#define simd__max_ps(a, b) simd_prefix_float(max_ps(a, b))
+#define simd__min_ps(a, b) simd_prefix_float(min_ps(a, b))
+#define simd__sqrt_ps(a) simd_prefix_float(sqrt_ps(a))
+#define simd__cmp_ps(a, b, c) simd_prefix_float(cmp_ps(a, b, c))
+#define simd__div_ps(a, b) simd_prefix_float(div_ps(a, b))
+#define simd__hadd_ps(a, b) simd_prefix_float(hadd_ps(a, b))
+#define simd__cvtss_f32(a) simd_prefix_float(cvtss_f32(a))
+
+//NOTE: MSVC emits any intrinsic regardless of /arch, gcc and clang need the functions marked
+//NOTE: #pragma doesn't expand macros, _Pragma through a second macro does
+#if defined(__clang__)
+SINM__PRAGMA(clang attribute push(__attribute__((target(SINM__ISA_TARGET))), apply_to = function))
+#elif defined(__GNUC__)
+#pragma GCC push_options
+SINM__PRAGMA(GCC target(SINM__ISA_TARGET))
+//NOTE: AVX-512 brings fused multiply-add with it. Keep gcc from contracting so every level gives the same result
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace SINM__ISA_NAMESPACE {
+
+sinm__inline static simd__float
+sinm__length_simd(simd__float x, simd__float y, simd__float z)
+{
+    return simd__sqrt_ps(simd__add_ps(simd__add_ps(simd__mul_ps(x, x), simd__mul_ps(y, y)), simd__mul_ps(z, z)));
+}
+
+static sinm__inline void
+sinm__rgba_to_v3_simd(simd__int c, simd__float* x, simd__float* y, simd__float* z)
+{
+    simd__int ff = simd__set1_epi32(0xFF);
+    simd__int v127 = simd__set1_epi32(127);
+    *x = simd__cvtepi32_ps(simd__sub_epi32(simd__and_ix(simd__srli_epi32(c, 0), ff), v127));
+    *y = simd__cvtepi32_ps(simd__sub_epi32(simd__and_ix(simd__srli_epi32(c, 8), ff), v127));
+    *z = simd__cvtepi32_ps(simd__sub_epi32(simd__and_ix(simd__srli_epi32(c, 16), ff), v127));
+}
+
+static sinm__inline simd__int
+sinm__v3_to_rgba_simd(simd__float x, simd__float y, simd__float z)
+{
+    simd__float one = simd__set1_ps(1.0f);
+    simd__float v127 = simd__set1_ps(127.0f);
+    simd__int a = simd__set1_epi32(255u << 24u);
+    simd__int r = simd__cvtps_epi32(simd__mul_ps(simd__add_ps(one, x), v127));
+    simd__int g = simd__cvtps_epi32(simd__mul_ps(simd__add_ps(one, y), v127));
+    simd__int b = simd__cvtps_epi32(simd__mul_ps(simd__add_ps(one, z), v127));
+    simd__int c = simd__or_ix(simd__or_ix(simd__or_ix(r, simd__slli_epi32(g, 8)), simd__slli_epi32(b, 16)), a);
+    return c;
+}
+
+//Packs the low byte of each 32 bit lane into "out"(SINM_SIMD_WIDTH bytes)
+static sinm__inline void
+sinm__store_bytes_simd(uint8_t* out, simd__int v)
+{
+#if SINM_SIMD_WIDTH == 16
+    //NOTE: clamp negatives first so the unsigned narrowing saturates like packus
+    _mm_storeu_si128((__m128i*)out, _mm512_cvtusepi32_epi8(_mm512_max_epi32(v, _mm512_setzero_si512())));
+#elif SINM_SIMD_WIDTH == 8
+    __m128i lo = _mm256_castsi256_si128(v);
+    __m128i hi = _mm256_extractf128_si256(v, 1);
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)out, bytes);
+#else
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(v, v), _mm_setzero_si128());
+    *(int32_t*)out = _mm_cvtsi128_si32(bytes);
+#endif
+}
+
+#if SINM__MASKED_TAILS
+//Packs the low byte of the lanes set in "m" into "out", leaving the bytes past them untouched
+static sinm__inline void
+sinm__mask_store_bytes_simd(uint8_t* out, simd__mask m, simd__int v)
+{
+    _mm512_mask_cvtusepi32_storeu_epi8(out, m, _mm512_max_epi32(v, _mm512_setzero_si512()));
+}
+#endif
+
+//Widens SINM_SIMD_WIDTH bytes from "in" to one 32 bit lane each
+static sinm__inline simd__int
+sinm__load_bytes_simd(const uint8_t* in)
+{
+#if SINM_SIMD_WIDTH == 16
+    return _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)in));
+#elif SINM_SIMD_WIDTH == 8
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)in));
+#else
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const int32_t*)in));
+#endif
+}
+
+//Widens SINM_SIMD_WIDTH 16 bit samples from "in" to one 32 bit lane each
+static sinm__inline simd__int
+sinm__load_words_simd(const uint16_t* in)
+{
+#if SINM_SIMD_WIDTH == 16
+    return _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)in));
+#elif SINM_SIMD_WIDTH == 8
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)in));
+#else
+    return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)in));
+#endif
+}
+
+//Packs the low 16 bits of each 32 bit lane, all in [0, 65535], into "out"(SINM_SIMD_WIDTH samples)
+static sinm__inline void
+sinm__store_words_simd(uint16_t* out, simd__int v)
+{
+#if SINM_SIMD_WIDTH == 16
+    _mm256_storeu_si256((__m256i*)out, _mm512_cvtepi32_epi16(v));
+#elif SINM_SIMD_WIDTH == 8
+    _mm_storeu_si128((__m128i*)out, _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+#else
+    _mm_storel_epi64((__m128i*)out, _mm_packus_epi32(v, v));
+#endif
+}
+
+//NOTE: the kernels templated on the height sample type(uint8_t, or uint16_t for 16 bit heights) pick their
+//loads and stores through these
+static sinm__inline simd__int
+sinm__load_samples_simd(const uint8_t* in)
+{
+    return sinm__load_bytes_simd(in);
+}
+
+static sinm__inline simd__int
+sinm__load_samples_simd(const uint16_t* in)
+{
+    return sinm__load_words_simd(in);
+}
+
+static sinm__inline void
+sinm__store_samples_simd(uint8_t* out, simd__int v)
+{
+    sinm__store_bytes_simd(out, v);
+}
+
+static sinm__inline void
+sinm__store_samples_simd(uint16_t* out, simd__int v)
+{
+    sinm__store_words_simd(out, v);
+}
+
+//Turns sobel gradients into packed normals
+static sinm__inline simd__int
+sinm__sobel_encode_simd(simd__float x, simd__float y, simd__float scale, simd__float flipY)
+{
+    simd__float z = simd__set1_ps(255.0f);
+
+    x = simd__mul_ps(x, scale);
+    y = simd__mul_ps(simd__mul_ps(y, scale), flipY);
+
+    //normalize
+    simd__float len = sinm__length_simd(x, y, z);
+    simd__float invLen = simd__div_ps(simd__set1_ps(1.0f), len);
+    x = simd__mul_ps(x, invLen);
+    y = simd__mul_ps(y, invLen);
+    z = simd__mul_ps(z, invLen);
+
+    return sinm__v3_to_rgba_simd(x, y, z);
+}
+
+static sinm__inline simd__int
+sinm__lightness_simd(simd__int c)
+{
+    simd__int ff = simd__set1_epi32(0xFF);
+    simd__int r = simd__and_ix(c, ff);
+    simd__int g = simd__and_ix(simd__srli_epi32(c, 8), ff);
+    simd__int b = simd__and_ix(simd__srli_epi32(c, 16), ff);
+
+    simd__int max = simd__max_epi32(simd__max_epi32(r, g), b);
+    simd__int min = simd__min_epi32(simd__min_epi32(r, g), b);
+    return simd__srli_epi32(simd__add_epi32(min, max), 1);
+}
+
+static sinm__inline simd__int
+sinm__average_simd(simd__int c)
+{
+    simd__int ff = simd__set1_epi32(0xFF);
+    simd__int r = simd__and_ix(c, ff);
+    simd__int g = simd__and_ix(simd__srli_epi32(c, 8), ff);
+    simd__int b = simd__and_ix(simd__srli_epi32(c, 16), ff);
+
+    simd__int s = simd__add_epi32(simd__add_epi32(r, g), b);
+    return simd__cvtps_epi32(simd__mul_ps(simd__cvtepi32_ps(s), simd__set1_ps(1.0f / 3.0f)));
+}
+
+static sinm__inline simd__int
+sinm__luminance_simd(simd__int c)
+{
+    simd__int ff = simd__set1_epi32(0xFF);
+    simd__float r = simd__cvtepi32_ps(simd__and_ix(c, ff));
+    simd__float g = simd__cvtepi32_ps(simd__and_ix(simd__srli_epi32(c, 8), ff));
+    simd__float b = simd__cvtepi32_ps(simd__and_ix(simd__srli_epi32(c, 16), ff));
+
+    r = simd__mul_ps(r, simd__set1_ps(0.21f));
+    g = simd__mul_ps(g, simd__set1_ps(0.72f));
+    b = simd__mul_ps(b, simd__set1_ps(0.07f));
+
+    return simd__cvtps_epi32(simd__add_ps(r, simd__add_ps(g, b)));
+}
+
+static sinm__inline simd__int
+sinm__greyscale_from_byte_simd(simd__int l)
+{
+    simd__int alpha = simd__set1_epi32(0xFF000000u);
+    return simd__or_ix(simd__slli_epi32(l, 16),
+        simd__or_ix(simd__slli_epi32(l, 8),
+            simd__or_ix(l, alpha)));
+}
+
+static sinm__inline simd__int
+sinm__greyscale_value_simd(simd__int c, sinm_greyscale_type type)
+{
+    switch (type) {
+    case sinm_greyscale_lightness: return sinm__lightness_simd(c);
+    case sinm_greyscale_average: return sinm__average_simd(c);
+    default: return sinm__luminance_simd(c);
+    }
+}
+
+static void
+sinm__simd_greyscale(const uint32_t* in, uint32_t* out, int32_t w, int32_t h, sinm_greyscale_type type)
+{
+    int64_t count = (int64_t)w * h;
+    int64_t simdCount = count - count % SINM_SIMD_WIDTH;
+
+    switch (type) {
+    case sinm_greyscale_lightness: {
+        for (int64_t i = 0; i < simdCount; i += SINM_SIMD_WIDTH) {
+            simd__int c = simd__loadu_ix((simd__int*)&in[i]);
+            simd__storeu_ix((simd__int*)&out[i], sinm__greyscale_from_byte_simd(sinm__lightness_simd(c)));
+        }
+    } break;
+
+    case sinm_greyscale_average: {
+        for (int64_t i = 0; i < simdCount; i += SINM_SIMD_WIDTH) {
+            simd__int c = simd__loadu_ix((simd__int*)&in[i]);
+            simd__storeu_ix((simd__int*)&out[i], sinm__greyscale_from_byte_simd(sinm__average_simd(c)));
+        }
+    } break;
+
+    case sinm_greyscale_luminance: {
+        for (int64_t i = 0; i < simdCount; i += SINM_SIMD_WIDTH) {
+            simd__int c = simd__loadu_ix((simd__int*)&in[i]);
+            simd__storeu_ix((simd__int*)&out[i], sinm__greyscale_from_byte_simd(sinm__luminance_simd(c)));
+        }
+    } break;
+    default: {
+        //INVALID OPTION
+        assert(false);
+    } break;
+    }
+
+    if (simdCount < count) {
+#if SINM__MASKED_TAILS
+        simd__mask m = simd__tail_mask(count - simdCount);
+        simd__int c = simd__maskz_loadu_ix(m, &in[simdCount]);
+        simd__mask_storeu_ix(&out[simdCount], m, sinm__greyscale_from_byte_simd(sinm__greyscale_value_simd(c, type)));
+#else
+        sinm__aligned_var(uint32_t, 64) tail[SINM_SIMD_WIDTH] = { 0 };
+        memcpy(tail, &in[simdCount], (count - simdCount) * sizeof(uint32_t));
+        simd__int c = simd__loadu_ix((simd__int*)tail);
+        simd__storeu_ix((simd__int*)tail, sinm__greyscale_from_byte_simd(sinm__greyscale_value_simd(c, type)));
+        memcpy(&out[simdCount], tail, (count - simdCount) * sizeof(uint32_t));
+#endif
+    }
+}
+
+//Single channel height of "n" pixels, same math as sinm__simd_greyscale
+static void
+sinm__greyscale_row(const uint32_t* in, uint8_t* out, int64_t n, sinm_greyscale_type type)
+{
+    if (type == sinm_greyscale_none) {
+        for (int64_t i = 0; i < n; ++i) {
+            out[i] = (uint8_t)(in[i] & 0xFFu);
+        }
+        return;
+    }
+
+#if SINM__MASKED_TAILS
+    for (int64_t i = 0; i < n; i += SINM_SIMD_WIDTH) {
+        int32_t remaining = (int32_t)sinm__min(n - i, SINM_SIMD_WIDTH);
+        if (remaining >= SINM_SIMD_WIDTH) {
+            simd__int c = simd__loadu_ix((const simd__int*)&in[i]);
+            sinm__store_bytes_simd(&out[i], sinm__greyscale_value_simd(c, type));
+        } else {
+            simd__mask m = simd__tail_mask(remaining);
+            simd__int c = simd__maskz_loadu_ix(m, &in[i]);
+            sinm__mask_store_bytes_simd(&out[i], m, sinm__greyscale_value_simd(c, type));
+        }
+    }
+#else
+    sinm__aligned_var(uint32_t, 64) tailIn[SINM_SIMD_WIDTH] = { 0 };
+    sinm__aligned_var(uint8_t, 64) tailOut[SINM_SIMD_WIDTH];
+    for (int64_t i = 0; i < n; i += SINM_SIMD_WIDTH) {
+        int32_t remaining = (int32_t)sinm__min(n - i, SINM_SIMD_WIDTH);
+        const uint32_t* src = &in[i];
+        uint8_t* dst = &out[i];
+        if (remaining < SINM_SIMD_WIDTH) {
+            memcpy(tailIn, src, remaining * sizeof(uint32_t));
+            src = tailIn;
+            dst = tailOut;
+        }
+
+        simd__int c = simd__loadu_ix((const simd__int*)src);
+        sinm__store_bytes_simd(dst, sinm__greyscale_value_simd(c, type));
+
+        if (remaining < SINM_SIMD_WIDTH) {
+            memcpy(&out[i], tailOut, remaining);
+        }
+    }
+#endif
+}
+
+//Widens 2 * SINM_SIMD_WIDTH bytes from "in" to one 16 bit lane each
+static sinm__inline simd__int
+sinm__load_bytes16_simd(const uint8_t* in)
+{
+#if SINM_SIMD_WIDTH == 16
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)in));
+#elif SINM_SIMD_WIDTH == 8
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)in));
+#else
+    return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)in));
+#endif
+}
+
+//Packs 2 * SINM_SIMD_WIDTH 16 bit lanes, all 255 or less, into "out"
+static sinm__inline void
+sinm__store_bytes16_simd(uint8_t* out, simd__int v)
+{
+#if SINM_SIMD_WIDTH == 16
+    _mm256_storeu_si256((__m256i*)out, _mm512_cvtepi16_epi8(v));
+#elif SINM_SIMD_WIDTH == 8
+    _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+#else
+    _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(v, v));
+#endif
+}
+
+//floor(sum / d) of each 32 bit lane, see sinm__box_divisor
+static sinm__inline simd__int
+sinm__box_divide_simd(simd__int sum, simd__int mul, __m128i shift)
+{
+    //NOTE: mul_epu32 only multiplies the even lanes, the odd ones go through a shifted copy.
+    //Quotients are below 65536 so the high half of each shifted product is already 0
+    simd__int even = simd__srl_epi64(simd__mul_epu32(sum, mul), shift);
+    simd__int odd = simd__srl_epi64(simd__mul_epu32(simd__srli_epi64(sum, 32), mul), shift);
+    return simd__or_ix(even, simd__slli_epi64(odd, 32));
+}
+
+//Writes the 16x16 block at "in" to "out" with rows and columns swapped
+static sinm__inline void
+sinm__transpose_16x16(const uint8_t* in, int32_t inStride, uint8_t* out, int32_t outStride)
+{
+    __m128i rows[16];
+    for (int i = 0; i < 16; ++i) {
+        rows[i] = _mm_loadu_si128((const __m128i*)&in[i * inStride]);
+    }
+
+    //NOTE: each step interleaves twice as many rows at twice the width, after four a register holds one column
+    __m128i pairs[16];
+    for (int i = 0; i < 8; ++i) {
+        pairs[i] = _mm_unpacklo_epi8(rows[2 * i], rows[2 * i + 1]);
+        pairs[i + 8] = _mm_unpackhi_epi8(rows[2 * i], rows[2 * i + 1]);
+    }
+    __m128i quads[16];
+    for (int i = 0; i < 4; ++i) {
+        quads[i] = _mm_unpacklo_epi16(pairs[2 * i], pairs[2 * i + 1]);
+        quads[i + 4] = _mm_unpackhi_epi16(pairs[2 * i], pairs[2 * i + 1]);
+        quads[i + 8] = _mm_unpacklo_epi16(pairs[2 * i + 8], pairs[2 * i + 9]);
+        quads[i + 12] = _mm_unpackhi_epi16(pairs[2 * i + 8], pairs[2 * i + 9]);
+    }
+    __m128i octs[16];
+    for (int g = 0; g < 4; ++g) {
+        for (int i = 0; i < 2; ++i) {
+            octs[4 * g + i] = _mm_unpacklo_epi32(quads[4 * g + 2 * i], quads[4 * g + 2 * i + 1]);
+            octs[4 * g + 2 + i] = _mm_unpackhi_epi32(quads[4 * g + 2 * i], quads[4 * g + 2 * i + 1]);
+        }
+    }
+    for (int c = 0; c < 8; ++c) {
+        _mm_storeu_si128((__m128i*)&out[(2 * c) * outStride], _mm_unpacklo_epi64(octs[2 * c], octs[2 * c + 1]));
+        _mm_storeu_si128((__m128i*)&out[(2 * c + 1) * outStride], _mm_unpackhi_epi64(octs[2 * c], octs[2 * c + 1]));
+    }
+}
+
+//Writes the "rows" x "cols" block at "in" to "out" with rows and columns swapped
+static void
+sinm__transpose_bytes(const uint8_t* in, int32_t inStride, uint8_t* out, int32_t outStride, int32_t rows, int32_t cols)
+{
+    int32_t blockRows = rows - rows % 16;
+    int32_t blockCols = cols - cols % 16;
+    for (int32_t x = 0; x < blockCols; x += 16) {
+        for (int32_t y = 0; y < blockRows; y += 16) {
+            sinm__transpose_16x16(&in[y * inStride + x], inStride, &out[x * outStride + y], outStride);
+        }
+    }
+    //NOTE: ragged right and bottom edges
+    for (int32_t y = 0; y < rows; ++y) {
+        for (int32_t x = (y < blockRows ? blockCols : 0); x < cols; ++x) {
+            out[x * outStride + y] = in[y * inStride + x];
+        }
+    }
+}
+
+//Box blur of "n" single channel samples spaced "stride" apart. Edges are clamped
+template <typename T>
+static void
+sinm__box_blur_line(const T* in, T* out, int32_t n, int32_t stride, const sinm__box_divisor* d)
+{
+    int32_t r = d->r;
+    uint32_t fv = in[0];
+    uint32_t lv = in[(n - 1) * stride];
+    uint32_t sum = (uint32_t)((r + 1) * fv);
+
+    if (r + r + 1 > n) {
+        //NOTE: kernel is wider than the line so both ends can be clamped at once
+        for (int32_t j = 0; j < r; ++j) {
+            sum += in[sinm__min(j, n - 1) * stride];
+        }
+        for (int32_t j = 0; j < n; ++j) {
+            sum += (uint32_t)in[sinm__min(j + r, n - 1) * stride] - (j - r - 1 < 0 ? fv : in[(j - r - 1) * stride]);
+            out[j * stride] = (T)sinm__box_divide(sum, d);
+        }
+        return;
+    }
+
+    int32_t li = 0;
+    int32_t ri = r * stride;
+    int32_t oi = 0;
+    for (int32_t j = 0; j < r; ++j) {
+        sum += in[j * stride];
+    }
+    for (int32_t j = 0; j <= r; ++j) {
+        sum += in[ri] - fv;
+        out[oi] = (T)sinm__box_divide(sum, d);
+        ri += stride;
+        oi += stride;
+    }
+    for (int32_t j = r + 1; j < n - r; ++j) {
+        sum += in[ri] - in[li];
+        out[oi] = (T)sinm__box_divide(sum, d);
+        li += stride;
+        ri += stride;
+        oi += stride;
+    }
+    for (int32_t j = n - r; j < n; ++j) {
+        sum += lv - in[li];
+        out[oi] = (T)sinm__box_divide(sum, d);
+        li += stride;
+        oi += stride;
+    }
+}
+
+//Vertical pass for output rows [ys, ye). Rows outside the range are only read(up to "r" rows of halo)
+//so bands can run in parallel as long as "in" and "out" differ.
+//NOTE: walks down strips of SINM__BLUR_STRIP columns with one running sum per column instead of one
+//column at a time, so every load is a contiguous row segment rather than a cache(and TLB) miss per pixel.
+//Narrow boxes keep 16 bit sums, twice the columns per register of the 32 bit ones
+static void
+sinm__box_blur_v_row_range(const uint8_t* in, uint8_t* out, int32_t ys, int32_t ye, int32_t w, int32_t h, const sinm__box_divisor* d)
+{
+    int32_t r = d->r;
+    int32_t lanes = d->narrow ? 2 * SINM_SIMD_WIDTH : SINM_SIMD_WIDTH;
+    simd__int mul16 = simd__set1_epi16((short)d->mul16);
+    __m128i shift16 = _mm_cvtsi32_si128((int)d->shift16);
+    simd__int mul32 = simd__set1_epi32((int)d->mul32);
+    __m128i shift32 = _mm_cvtsi32_si128((int)d->shift32);
+    sinm__aligned_var(uint16_t, 64) sums16[SINM__BLUR_STRIP];
+    sinm__aligned_var(uint32_t, 64) sums32[SINM__BLUR_STRIP]; //Also the scalar columns past the last full register
+
+    for (int32_t xs = 0; xs < w; xs += SINM__BLUR_STRIP) {
+        int32_t sw = sinm__min(SINM__BLUR_STRIP, w - xs);
+        int32_t simdW = sw - sw % lanes;
+        memset(sums16, 0, sizeof(sums16));
+        memset(sums32, 0, sizeof(sums32));
+
+        //NOTE: window of the row before "ys", clamped to the image
+        for (int32_t j = ys - r - 1; j < ys + r; j++) {
+            const uint8_t* row = &in[(size_t)sinm__min(h - 1, sinm__max(0, j)) * w + xs];
+            int32_t x = 0;
+            if (d->narrow) {
+                for (; x < simdW; x += lanes) {
+                    simd__int sum = simd__add_epi16(simd__loadu_ix((simd__int*)&sums16[x]), sinm__load_bytes16_simd(&row[x]));
+                    simd__storeu_ix((simd__int*)&sums16[x], sum);
+                }
+            } else {
+                for (; x < simdW; x += lanes) {
+                    simd__int sum = simd__add_epi32(simd__loadu_ix((simd__int*)&sums32[x]), sinm__load_bytes_simd(&row[x]));
+                    simd__storeu_ix((simd__int*)&sums32[x], sum);
+                }
+            }
+            for (; x < sw; ++x) {
+                sums32[x] += row[x];
+            }
+        }
+
+        for (int32_t j = ys; j < ye; j++) {
+            const uint8_t* add = &in[(size_t)sinm__min(h - 1, j + r) * w + xs];
+            const uint8_t* sub = &in[(size_t)sinm__max(0, j - r - 1) * w + xs];
+            uint8_t* o = &out[(size_t)j * w + xs];
+            int32_t x = 0;
+            if (d->narrow) {
+                for (; x < simdW; x += lanes) {
+                    simd__int sum = simd__loadu_ix((simd__int*)&sums16[x]);
+                    sum = simd__sub_epi16(simd__add_epi16(sum, sinm__load_bytes16_simd(&add[x])), sinm__load_bytes16_simd(&sub[x]));
+                    simd__storeu_ix((simd__int*)&sums16[x], sum);
+                    sinm__store_bytes16_simd(&o[x], simd__srl_epi16(simd__mulhi_epu16(sum, mul16), shift16));
+                }
+            } else {
+                for (; x < simdW; x += lanes) {
+                    simd__int sum = simd__loadu_ix((simd__int*)&sums32[x]);
+                    sum = simd__sub_epi32(simd__add_epi32(sum, sinm__load_bytes_simd(&add[x])), sinm__load_bytes_simd(&sub[x]));
+                    simd__storeu_ix((simd__int*)&sums32[x], sum);
+                    sinm__store_bytes_simd(&o[x], sinm__box_divide_simd(sum, mul32, shift32));
+                }
+            }
+            for (; x < sw; ++x) {
+                sums32[x] += add[x] - sub[x];
+                o[x] = (uint8_t)sinm__box_divide(sums32[x], d);
+            }
+        }
+    }
+}
+
+//One row of a vertical box blur whose input isn't a plane: adds "add" to the running column "sums", takes
+//away "sub" and writes the new averages to "out". Gives the same bytes as sinm__box_blur_v_row_range
+template <typename T>
+static void
+sinm__box_slide_row(uint32_t* sums, const T* add, const T* sub, T* out, int32_t n, const sinm__box_divisor* d)
+{
+    simd__int mul32 = simd__set1_epi32((int)d->mul32);
+    __m128i shift32 = _mm_cvtsi32_si128((int)d->shift32);
+    int32_t simdN = n - n % SINM_SIMD_WIDTH;
+    int32_t x = 0;
+    for (; x < simdN; x += SINM_SIMD_WIDTH) {
+        simd__int sum = simd__loadu_ix((simd__int*)&sums[x]);
+        sum = simd__sub_epi32(simd__add_epi32(sum, sinm__load_samples_simd(&add[x])), sinm__load_samples_simd(&sub[x]));
+        simd__storeu_ix((simd__int*)&sums[x], sum);
+        sinm__store_samples_simd(&out[x], sinm__box_divide_simd(sum, mul32, shift32));
+    }
+    for (; x < n; ++x) {
+        sums[x] += add[x] - sub[x];
+        out[x] = (T)sinm__box_divide(sums[x], d);
+    }
+}
+
+//NOTE: decently optimized box blur based on http://blog.ivank.net/fastest-gaussian-blur.html
+//Horizontal pass for rows [ys, ye) of a single channel plane. Transposes SINM__BOX_ROWS rows at a time so
+//the block's columns become rows of a narrow plane, and blurs that with the vertical pass, one image row per lane.
+//"scratch" holds sinm__box_blur_h_scratch_size(w) bytes
+static void
+sinm__box_blur_h_row_range(const uint8_t* in, uint8_t* out, int32_t ys, int32_t ye, int32_t w, int32_t h, const sinm__box_divisor* d, uint8_t* scratch)
+{
+    (void)h;
+    uint8_t* columns = scratch;
+    uint8_t* blurred = scratch + (size_t)w * SINM__BOX_ROWS;
+    for (int32_t y = ys; y < ye; y += SINM__BOX_ROWS) {
+        int32_t rows = sinm__min(SINM__BOX_ROWS, ye - y);
+        if (rows < SINM__BOX_ROWS) {
+            //NOTE: lanes past the last row are blurred too and thrown away, keep them defined
+            memset(columns, 0, (size_t)w * SINM__BOX_ROWS);
+        }
+        sinm__transpose_bytes(&in[(size_t)y * w], w, columns, SINM__BOX_ROWS, rows, w);
+        sinm__box_blur_v_row_range(columns, blurred, 0, w, SINM__BOX_ROWS, w, d);
+        sinm__transpose_bytes(blurred, SINM__BOX_ROWS, &out[(size_t)y * w], w, w, rows);
+    }
+}
+
+//Widens SINM_SIMD_DOUBLE_WIDTH bytes from "in" to one double lane each
+static sinm__inline simd__double
+sinm__load_bytes_pd_simd(const uint8_t* in)
+{
+#if SINM_SIMD_WIDTH == 16
+    return _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)in)));
+#elif SINM_SIMD_WIDTH == 8
+    return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const int32_t*)in)));
+#else
+    return _mm_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const uint16_t*)in)));
+#endif
+}
+
+//Clamps "v" to 0-255, rounds it like the scalar "(uint8_t)(v + 0.5)" and stores SINM_SIMD_DOUBLE_WIDTH bytes to "out"
+static sinm__inline void
+sinm__store_bytes_pd_simd(uint8_t* out, simd__double v)
+{
+    v = simd__add_pd(simd__min_pd(simd__set1_pd(255.0), simd__max_pd(simd__set1_pd(0.0), v)), simd__set1_pd(0.5));
+#if SINM_SIMD_WIDTH == 16
+    __m256i ints = _mm512_cvttpd_epi32(v);
+    __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+    _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(words, words));
+#elif SINM_SIMD_WIDTH == 8
+    __m128i words = _mm_packus_epi32(_mm256_cvttpd_epi32(v), _mm_setzero_si128());
+    *(int32_t*)out = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+#else
+    __m128i words = _mm_packus_epi32(_mm_cvttpd_epi32(v), _mm_setzero_si128());
+    *(uint16_t*)out = (uint16_t)_mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+#endif
+}
+
+//Sample "i" of SINM_SIMD_DOUBLE_WIDTH lines, lane "l" from line "l". Lines past "lines" read as 0
+static sinm__inline simd__double
+sinm__load_line_samples_simd(const uint8_t* in, int32_t lines, int32_t lineStride, int32_t i, int32_t stride)
+{
+    if (lineStride == 1 && lines == SINM_SIMD_DOUBLE_WIDTH) {
+        return sinm__load_bytes_pd_simd(&in[(size_t)i * stride]);
+    }
+    sinm__aligned_var(double, 64) samples[SINM_SIMD_DOUBLE_WIDTH] = { 0 };
+    for (int32_t l = 0; l < lines; ++l) {
+        samples[l] = in[(size_t)l * lineStride + (size_t)i * stride];
+    }
+    return simd__loadu_pd(samples);
+}
+
+//Rounds and stores sample "i" of SINM_SIMD_DOUBLE_WIDTH lines, lane "l" to line "l". Lines past "lines" are not written
+static sinm__inline void
+sinm__store_line_samples_simd(uint8_t* out, int32_t lines, int32_t lineStride, int32_t i, int32_t stride, simd__double v)
+{
+    if (lineStride == 1 && lines == SINM_SIMD_DOUBLE_WIDTH) {
+        sinm__store_bytes_pd_simd(&out[(size_t)i * stride], v);
+        return;
+    }
+    sinm__aligned_var(double, 64) samples[SINM_SIMD_DOUBLE_WIDTH];
+    simd__storeu_pd(samples, v);
+    for (int32_t l = 0; l < lines; ++l) {
+        out[(size_t)l * lineStride + (size_t)i * stride] = (uint8_t)(sinm__min(255.0, sinm__max(0.0, samples[l])) + 0.5);
+    }
+}
+
+//sinm__recursive_gaussian_lines on lines as they are laid out. Adjacent lines(lineStride 1, the columns of a
+//plane) load and store a whole register of samples at once, other lines gather them one lane at a time
+static void
+sinm__recursive_gaussian_block(const uint8_t* in, uint8_t* out, int32_t lines, int32_t lineStride, int32_t n, int32_t stride, const sinm__recursive_coefs* c, double* scratch)
+{
+    simd__double B = simd__set1_pd(c->B);
+    simd__double a1 = simd__set1_pd(c->a1);
+    simd__double a2 = simd__set1_pd(c->a2);
+    simd__double a3 = simd__set1_pd(c->a3);
+
+    for (int32_t l = 0; l < lines; l += SINM_SIMD_DOUBLE_WIDTH) {
+        const uint8_t* src = &in[l * lineStride];
+        uint8_t* dst = &out[l * lineStride];
+        int32_t count = sinm__min(SINM_SIMD_DOUBLE_WIDTH, lines - l);
+
+        //NOTE: a constant signal is a fixed point of the filter(B + a1 + a2 + a3 = 1), so starting every
+        //history tap at the edge sample clamps the edge
+        simd__double w1 = sinm__load_line_samples_simd(src, count, lineStride, 0, stride);
+        simd__double w2 = w1;
+        simd__double w3 = w1;
+        for (int32_t i = 0; i < n; ++i) {
+            simd__double x = sinm__load_line_samples_simd(src, count, lineStride, i, stride);
+            simd__double v = simd__add_pd(simd__add_pd(simd__mul_pd(B, x), simd__mul_pd(a1, w1)), simd__add_pd(simd__mul_pd(a2, w2), simd__mul_pd(a3, w3)));
+            simd__storeu_pd(&scratch[i * SINM_SIMD_DOUBLE_WIDTH], v);
+            w3 = w2;
+            w2 = w1;
+            w1 = v;
+        }
+
+        //NOTE: state of the anticausal pass after a constant tail of the last sample, see sinm__recursive_coefs
+        simd__double last = sinm__load_line_samples_simd(src, count, lineStride, n - 1, stride);
+        simd__double u0 = simd__sub_pd(w1, last);
+        simd__double u1 = simd__sub_pd(w2, last);
+        simd__double u2 = simd__sub_pd(w3, last);
+        simd__double y[3];
+        for (int32_t k = 0; k < 3; ++k) {
+            simd__double m = simd__add_pd(simd__mul_pd(simd__set1_pd(c->M[k][0]), u0), simd__mul_pd(simd__set1_pd(c->M[k][1]), u1));
+            y[k] = simd__add_pd(simd__add_pd(m, simd__mul_pd(simd__set1_pd(c->M[k][2]), u2)), last);
+        }
+        sinm__store_line_samples_simd(dst, count, lineStride, n - 1, stride, y[0]);
+        simd__double y1 = y[0];
+        simd__double y2 = y[1];
+        simd__double y3 = y[2];
+        for (int32_t i = n - 2; i >= 0; --i) {
+            simd__double x = simd__loadu_pd(&scratch[i * SINM_SIMD_DOUBLE_WIDTH]);
+            simd__double v = simd__add_pd(simd__add_pd(simd__mul_pd(B, x), simd__mul_pd(a1, y1)), simd__add_pd(simd__mul_pd(a2, y2), simd__mul_pd(a3, y3)));
+            sinm__store_line_samples_simd(dst, count, lineStride, i, stride, v);
+            y3 = y2;
+            y2 = y1;
+            y1 = v;
+        }
+    }
+}
+
+//Recursive gaussian of "lines" lines of "n" samples spaced "stride" apart. Line starts are "lineStride" apart.
+//Runs SINM_SIMD_DOUBLE_WIDTH lines at a time, one per lane, so the recursion is vectorized along any axis.
+//"scratch" holds sinm__recursive_scratch_size(n) bytes. Edges are clamped.
+//NOTE: doubles because the poles get close to 1 for large sigma and float rounding in the feedback
+//blows up(errors of 100+ levels at sigma 128)
+static void
+sinm__recursive_gaussian_lines(const uint8_t* in, uint8_t* out, int32_t lines, int32_t lineStride, int32_t n, int32_t stride, const sinm__recursive_coefs* c, double* scratch)
+{
+    if (stride != 1) {
+        sinm__recursive_gaussian_block(in, out, lines, lineStride, n, stride, c, scratch);
+        return;
+    }
+
+    //NOTE: a line's own samples are adjacent(the rows of a plane), so one sample from each of them would take a
+    //gather. SINM__RECURSIVE_ROWS lines are transposed at a time so the lanes read adjacent bytes instead
+    uint8_t* columns = (uint8_t*)(scratch + (size_t)n * SINM__MAX_SIMD_WIDTH / 2);
+    uint8_t* blurred = columns + (size_t)n * SINM__RECURSIVE_ROWS;
+    for (int32_t l = 0; l < lines; l += SINM__RECURSIVE_ROWS) {
+        int32_t rows = sinm__min(SINM__RECURSIVE_ROWS, lines - l);
+        sinm__transpose_bytes(&in[(size_t)l * lineStride], lineStride, columns, SINM__RECURSIVE_ROWS, rows, n);
+        sinm__recursive_gaussian_block(columns, blurred, rows, 1, n, SINM__RECURSIVE_ROWS, c, scratch);
+        sinm__transpose_bytes(blurred, SINM__RECURSIVE_ROWS, &out[(size_t)l * lineStride], lineStride, n, rows);
+    }
+}
+
+//Sums of rows [y - r, y + r] of the summed-area table "sums" for every table column into "strip", which starts
+//r columns left of the image and ends r columns right of it. Rows and columns past the image repeat the edge ones,
+//so strip[x + 2r + 1] - strip[x] is the clamped box around column x. Wraps modulo 2^32 like the table
+static void
+sinm__integral_strip(const uint32_t* sums, uint32_t* strip, int32_t y, int32_t r, int32_t w, int32_t h)
+{
+    int32_t stride = w + 1;
+    int32_t y0 = sinm__max(0, y - r);
+    int32_t y1 = sinm__min(h, y + r + 1);
+    const uint32_t* top = &sums[(size_t)y0 * stride];
+    const uint32_t* bottom = &sums[(size_t)y1 * stride];
+    uint32_t* columns = &strip[r];
+
+    //NOTE: rows above the image repeat row 0(table row 1) and rows below it row h - 1(table row h minus row h - 1)
+    uint32_t above = (uint32_t)(y0 - (y - r));
+    uint32_t below = (uint32_t)(y + r + 1 - y1);
+    const uint32_t* first = &sums[stride];
+    const uint32_t* last = &sums[(size_t)h * stride];
+    const uint32_t* beforeLast = &sums[(size_t)(h - 1) * stride];
+
+    int32_t x = 0;
+    if (above == 0 && below == 0) {
+        for (; x + SINM_SIMD_WIDTH <= stride; x += SINM_SIMD_WIDTH) {
+            simd__int sum = simd__sub_epi32(simd__loadu_ix((const simd__int*)&bottom[x]), simd__loadu_ix((const simd__int*)&top[x]));
+            simd__storeu_ix((simd__int*)&columns[x], sum);
+        }
+    } else {
+        simd__int aboveCount = simd__set1_epi32((int32_t)above);
+        simd__int belowCount = simd__set1_epi32((int32_t)below);
+        for (; x + SINM_SIMD_WIDTH <= stride; x += SINM_SIMD_WIDTH) {
+            simd__int sum = simd__sub_epi32(simd__loadu_ix((const simd__int*)&bottom[x]), simd__loadu_ix((const simd__int*)&top[x]));
+            simd__int lastRow = simd__sub_epi32(simd__loadu_ix((const simd__int*)&last[x]), simd__loadu_ix((const simd__int*)&beforeLast[x]));
+            sum = simd__add_epi32(sum, simd__mullo_epi32(simd__loadu_ix((const simd__int*)&first[x]), aboveCount));
+            sum = simd__add_epi32(sum, simd__mullo_epi32(lastRow, belowCount));
+            simd__storeu_ix((simd__int*)&columns[x], sum);
+        }
+    }
+    for (; x < stride; ++x) {
+        columns[x] = bottom[x] - top[x] + above * first[x] + below * (last[x] - beforeLast[x]);
+    }
+
+    //NOTE: the table's column 0 is 0, so columns left of it count column 0 backwards
+    uint32_t left = columns[1];
+    uint32_t right = columns[w] - columns[w - 1];
+    for (int32_t i = 1; i <= r; ++i) {
+        columns[-i] = 0u - (uint32_t)i * left;
+        columns[w + i] = columns[w] + (uint32_t)i * right;
+    }
+}
+
+//Stacked box blur of row "y" read from the summed-area table "sums", see sinm_integral. Edges are
+//clamped. "scratch" is sinm__integral_scratch_size() bytes
+static void
+sinm__integral_blur_row(const uint32_t* sums, uint8_t* out, int32_t y, int32_t w, int32_t h, const sinm__integral_boxes* b, uint8_t* scratch)
+{
+    const uint32_t* strips[SINM__INTEGRAL_BOXES];
+    int32_t sizes[SINM__INTEGRAL_BOXES];
+    float scales[SINM__INTEGRAL_BOXES];
+    uint32_t* strip = (uint32_t*)scratch;
+    for (int32_t k = 0; k < b->count; ++k) {
+        int32_t r = b->r[k];
+        sinm__integral_strip(sums, strip, y, r, w, h);
+        strips[k] = strip;
+        sizes[k] = 2 * r + 1;
+        //NOTE: a clamped box always covers (2r + 1)^2 samples, so one reciprocal does for the whole row
+        scales[k] = b->weight[k] / ((float)sizes[k] * (float)sizes[k]);
+        strip += w + 1 + 2 * r;
+    }
+
+    simd__float half = simd__set1_ps(0.5f);
+    int32_t x = 0;
+    for (; x + SINM_SIMD_WIDTH <= w; x += SINM_SIMD_WIDTH) {
+        simd__float acc = half;
+        for (int32_t k = 0; k < b->count; ++k) {
+            const uint32_t* s = strips[k];
+            simd__int sum = simd__sub_epi32(simd__loadu_ix((const simd__int*)&s[x + sizes[k]]), simd__loadu_ix((const simd__int*)&s[x]));
+            acc = simd__add_ps(acc, simd__mul_ps(simd__cvtepi32_ps(sum), simd__set1_ps(scales[k])));
+        }
+        sinm__store_bytes_simd(&out[x], simd__cvttps_epi32(acc));
+    }
+    for (; x < w; ++x) {
+        float acc = 0.5f;
+        for (int32_t k = 0; k < b->count; ++k) {
+            acc += (float)(int32_t)(strips[k][x + sizes[k]] - strips[k][x]) * scales[k];
+        }
+        out[x] = (uint8_t)sinm__min(255.0f, sinm__max(0.0f, acc));
+    }
+}
+
+//Sobel gradients of the pixel at "c"(relative to "rx"), the columns to either side are "c - 1" and "c + 1"
+template <typename T>
+static sinm__inline void
+sinm__sobel_gradient(const T* rows[3], int32_t l, int32_t c, int32_t r, int32_t* gx, int32_t* gy)
+{
+    *gx = (rows[0][r] - rows[0][l]) + 2 * (rows[1][r] - rows[1][l]) + (rows[2][r] - rows[2][l]);
+    *gy = (rows[2][l] + 2 * rows[2][c] + rows[2][r]) - (rows[0][l] + 2 * rows[0][c] + rows[0][r]);
+}
+
+//Sobel normal of the pixel at "c", see sinm__sobel_gradient
+template <typename T>
+static sinm__inline uint32_t
+sinm__sobel_pixel(const T* rows[3], int32_t l, int32_t c, int32_t r, float scale, float yDir)
+{
+    int32_t gx, gy;
+    sinm__sobel_gradient(rows, l, c, r, &gx, &gy);
+    sinm__v3 color = sinm__normalized((float)gx * scale, (float)gy * scale * yDir, 255.0f);
+    return sinm__unit_vector_to_rgba(color);
+}
+
+//Sobel gradients of the SINM_SIMD_WIDTH pixels starting at "c"(relative to "rx"). Each row is loaded
+//at three shifted offsets so every lane gets its neighbours without any per pixel work
+template <typename T>
+static sinm__inline void
+sinm__sobel_gradient_simd(const T* rows[3], int32_t c, simd__float* gxOut, simd__float* gyOut)
+{
+    simd__int l0 = sinm__load_samples_simd(&rows[0][c - 1]);
+    simd__int c0 = sinm__load_samples_simd(&rows[0][c]);
+    simd__int r0 = sinm__load_samples_simd(&rows[0][c + 1]);
+    simd__int l1 = sinm__load_samples_simd(&rows[1][c - 1]);
+    simd__int r1 = sinm__load_samples_simd(&rows[1][c + 1]);
+    simd__int l2 = sinm__load_samples_simd(&rows[2][c - 1]);
+    simd__int c2 = sinm__load_samples_simd(&rows[2][c]);
+    simd__int r2 = sinm__load_samples_simd(&rows[2][c + 1]);
+
+    simd__int gx = simd__add_epi32(simd__add_epi32(simd__sub_epi32(r0, l0), simd__sub_epi32(r2, l2)), simd__slli_epi32(simd__sub_epi32(r1, l1), 1));
+    simd__int top = simd__add_epi32(simd__add_epi32(l0, r0), simd__slli_epi32(c0, 1));
+    simd__int bottom = simd__add_epi32(simd__add_epi32(l2, r2), simd__slli_epi32(c2, 1));
+    simd__int gy = simd__sub_epi32(bottom, top);
+
+    *gxOut = simd__cvtepi32_ps(gx);
+    *gyOut = simd__cvtepi32_ps(gy);
+}
+
+//Sobel normals of the SINM_SIMD_WIDTH pixels starting at "c"(relative to "rx")
+template <typename T>
+static sinm__inline simd__int
+sinm__sobel_batch_simd(const T* rows[3], int32_t c, simd__float scale, simd__float flipY)
+{
+    simd__float gx, gy;
+    sinm__sobel_gradient_simd(rows, c, &gx, &gy);
+    return sinm__sobel_encode_simd(gx, gy, scale, flipY);
+}
+
+//Sobel normals for output pixels [xs, xe) of row "y". "rows" are the clamped rows above, at and below "y"
+//and are indexed from global column "rx". 16 bit rows take "scale" already divided by 257, see sinm__row_pipeline
+template <typename T>
+static void
+sinm__sobel_row(const T* rows[3], int32_t rx, uint32_t* out, int32_t xs, int32_t xe, int32_t w, float scale, int flipY)
+{
+    float yDir = (flipY) ? -1.0f : 1.0f;
+
+    //NOTE: columns 0, 1 and w - 1 clamp(column 0 like column 1), everything in [2, w - 1) reads its
+    //neighbours directly
+    int32_t interiorStart = sinm__min(xe, sinm__max(xs, 2));
+    int32_t interiorEnd = sinm__max(interiorStart, sinm__min(xe, w - 1));
+
+    for (int32_t x = xs; x < interiorStart; ++x) {
+        int32_t l = sinm__min(w - 1, sinm__max(1, x - 1)) - rx;
+        int32_t c = sinm__min(w - 1, sinm__max(1, x)) - rx;
+        int32_t r = sinm__min(w - 1, sinm__max(1, x + 1)) - rx;
+        out[x] = sinm__sobel_pixel(rows, l, c, r, scale, yDir);
+    }
+
+    if (interiorEnd - interiorStart >= SINM_SIMD_WIDTH) {
+        simd__float simdScale = simd__set1_ps(scale);
+        simd__float simdFlipY = simd__set1_ps(yDir);
+        int32_t x = interiorStart;
+        for (; x + SINM_SIMD_WIDTH <= interiorEnd; x += SINM_SIMD_WIDTH) {
+            simd__storeu_ix((simd__int*)&out[x], sinm__sobel_batch_simd(rows, x - rx, simdScale, simdFlipY));
+        }
+        if (x < interiorEnd) {
+            //NOTE: redo the last full batch of the range. The overlap is written twice with the same bytes
+            //and nothing past "interiorEnd"(which can be the end of a tile's scratch) is read
+            x = interiorEnd - SINM_SIMD_WIDTH;
+            simd__storeu_ix((simd__int*)&out[x], sinm__sobel_batch_simd(rows, x - rx, simdScale, simdFlipY));
+        }
+    } else if (interiorEnd > interiorStart) {
+        //NOTE: padded copies of the gradients so a short interior(a narrow last tile) gets the same bytes
+        //as the SIMD body instead of the scalar encode's rounding
+        sinm__aligned_var(float, 64) gx[SINM_SIMD_WIDTH] = { 0 };
+        sinm__aligned_var(float, 64) gy[SINM_SIMD_WIDTH] = { 0 };
+        sinm__aligned_var(uint32_t, 64) normals[SINM_SIMD_WIDTH];
+        int32_t n = interiorEnd - interiorStart;
+        for (int32_t i = 0; i < n; ++i) {
+            int32_t c = interiorStart + i - rx;
+            int32_t igx, igy;
+            sinm__sobel_gradient(rows, c - 1, c, c + 1, &igx, &igy);
+            gx[i] = (float)igx;
+            gy[i] = (float)igy;
+        }
+        simd__int encoded = sinm__sobel_encode_simd(simd__loadu_ps(gx), simd__loadu_ps(gy), simd__set1_ps(scale), simd__set1_ps(yDir));
+        simd__storeu_ix((simd__int*)normals, encoded);
+        memcpy(&out[interiorStart], normals, (size_t)n * sizeof(uint32_t));
+    }
+
+    for (int32_t x = interiorEnd; x < xe; ++x) {
+        int32_t l = sinm__min(w - 1, sinm__max(1, x - 1)) - rx;
+        int32_t c = sinm__min(w - 1, sinm__max(1, x)) - rx;
+        int32_t r = sinm__min(w - 1, sinm__max(1, x + 1)) - rx;
+        out[x] = sinm__sobel_pixel(rows, l, c, r, scale, yDir);
+    }
+}
+
+//Normals of "n" pixels from gradients lerped between two rows, g0 + (g1 - g0) * t, with the same encode as the sobel kernels
+static void
+sinm__gradient_row(const float* gx0, const float* gy0, const float* gx1, const float* gy1, float t, uint32_t* out, int32_t n, float scale, int flipY)
+{
+    float yDir = (flipY) ? -1.0f : 1.0f;
+    int32_t x = 0;
+    if (n >= SINM_SIMD_WIDTH) {
+        simd__float simdT = simd__set1_ps(t);
+        simd__float simdScale = simd__set1_ps(scale);
+        simd__float simdFlipY = simd__set1_ps(yDir);
+        for (;; x += SINM_SIMD_WIDTH) {
+            if (x + SINM_SIMD_WIDTH > n) {
+                //NOTE: redo the last full batch, the overlap gets the same bytes
+                x = n - SINM_SIMD_WIDTH;
+            }
+            simd__float a = simd__loadu_ps(&gx0[x]);
+            simd__float gx = simd__add_ps(a, simd__mul_ps(simd__sub_ps(simd__loadu_ps(&gx1[x]), a), simdT));
+            simd__float b = simd__loadu_ps(&gy0[x]);
+            simd__float gy = simd__add_ps(b, simd__mul_ps(simd__sub_ps(simd__loadu_ps(&gy1[x]), b), simdT));
+            simd__storeu_ix((simd__int*)&out[x], sinm__sobel_encode_simd(gx, gy, simdScale, simdFlipY));
+            if (x + SINM_SIMD_WIDTH == n) {
+                return;
+            }
+        }
+    }
+    for (; x < n; ++x) {
+        float gx = gx0[x] + (gx1[x] - gx0[x]) * t;
+        float gy = gy0[x] + (gy1[x] - gy0[x]) * t;
+        out[x] = sinm__unit_vector_to_rgba(sinm__normalized(gx * scale, gy * scale * yDir, 255.0f));
+    }
+}
+
+//Raw sobel gradients of the "w" pixels of a row, for the encodes sobelRow doesn't do. Columns clamp like sinm__sobel_row
+template <typename T>
+static void
+sinm__sobel_gradient_row(const T* rows[3], float* gx, float* gy, int32_t w)
+{
+    int32_t interiorStart = sinm__min(w, 2);
+    int32_t interiorEnd = sinm__max(interiorStart, w - 1);
+    int32_t simdEnd = interiorStart; //Columns [interiorStart, simdEnd) are done by the SIMD loop
+    if (interiorEnd - interiorStart >= SINM_SIMD_WIDTH) {
+        for (int32_t x = interiorStart;; x += SINM_SIMD_WIDTH) {
+            if (x + SINM_SIMD_WIDTH > interiorEnd) {
+                x = interiorEnd - SINM_SIMD_WIDTH;
+            }
+            simd__float bx, by;
+            sinm__sobel_gradient_simd(rows, x, &bx, &by);
+            simd__storeu_ps(&gx[x], bx);
+            simd__storeu_ps(&gy[x], by);
+            if (x + SINM_SIMD_WIDTH == interiorEnd) {
+                break;
+            }
+        }
+        simdEnd = interiorEnd;
+    }
+    for (int32_t x = 0; x < w; x = (x + 1 == interiorStart) ? simdEnd : x + 1) {
+        int32_t l = sinm__min(w - 1, sinm__max(1, x - 1));
+        int32_t c = sinm__min(w - 1, sinm__max(1, x));
+        int32_t r = sinm__min(w - 1, sinm__max(1, x + 1));
+        int32_t ix, iy;
+        sinm__sobel_gradient(rows, l, c, r, &ix, &iy);
+        gx[x] = (float)ix;
+        gy[x] = (float)iy;
+    }
+}
+
+//[-1, 1] to [0, 65535], rounded
+static sinm__inline simd__int
+sinm__unorm16_simd(simd__float v)
+{
+    simd__int q = simd__cvtps_epi32(simd__mul_ps(simd__add_ps(simd__set1_ps(1.0f), v), simd__set1_ps(32767.5f)));
+    return simd__min_epi32(simd__max_epi32(q, simd__set1_epi32(0)), simd__set1_epi32(0xFFFF));
+}
+
+//Stores a0 b0 a1 b1 ... of the 32 bit lanes of "a" and "b", 2 * SINM_SIMD_WIDTH values
+static sinm__inline void
+sinm__store_interleaved_simd(uint32_t* out, simd__int a, simd__int b)
+{
+#if SINM_SIMD_WIDTH == 16
+    simd__int lo = _mm512_unpacklo_epi32(a, b);
+    simd__int hi = _mm512_unpackhi_epi32(a, b);
+    //NOTE: unpack works within 128 bit lanes, put the 64 bit pairs back in pixel order
+    _mm512_storeu_si512(out, _mm512_permutex2var_epi64(lo, _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0), hi));
+    _mm512_storeu_si512(out + 16, _mm512_permutex2var_epi64(lo, _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4), hi));
+#elif SINM_SIMD_WIDTH == 8
+    simd__int lo = _mm256_unpacklo_epi32(a, b);
+    simd__int hi = _mm256_unpackhi_epi32(a, b);
+    _mm256_storeu_si256((__m256i*)out, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i*)(out + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+#else
+    _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi32(a, b));
+    _mm_storeu_si128((__m128i*)(out + 4), _mm_unpackhi_epi32(a, b));
+#endif
+}
+
+//Normals of SINM_SIMD_WIDTH pixels from sobel gradients, encoded as "format" into "out"
+static sinm__inline void
+sinm__encode_batch_simd(simd__float gx, simd__float gy, simd__float scale, simd__float flipY, sinm_output_format format, uint8_t* out)
+{
+    simd__float x = simd__mul_ps(gx, scale);
+    simd__float y = simd__mul_ps(simd__mul_ps(gy, scale), flipY);
+    simd__float z = simd__set1_ps(255.0f);
+    if (format == sinm_output_oct16) {
+        //NOTE: z is always positive so the upper half of the octahedron is all that's needed:
+        //n / (|x| + |y| + |z|) keeps x and y, the shader gets z back as 1 - |x| - |y|
+        simd__float absMask = simd__set1_ps(-0.0f);
+        simd__float l1 = simd__add_ps(simd__add_ps(simd__andnot_ps(absMask, x), simd__andnot_ps(absMask, y)), z);
+        simd__float inv = simd__div_ps(simd__set1_ps(1.0f), l1);
+        simd__int ox = sinm__unorm16_simd(simd__mul_ps(x, inv));
+        simd__int oy = sinm__unorm16_simd(simd__mul_ps(y, inv));
+        simd__storeu_ix((simd__int*)out, simd__or_ix(ox, simd__slli_epi32(oy, 16)));
+        return;
+    }
+
+    simd__float invLen = simd__div_ps(simd__set1_ps(1.0f), sinm__length_simd(x, y, z));
+    simd__int r = sinm__unorm16_simd(simd__mul_ps(x, invLen));
+    simd__int g = sinm__unorm16_simd(simd__mul_ps(y, invLen));
+    simd__int rg = simd__or_ix(r, simd__slli_epi32(g, 16));
+    if (format == sinm_output_rg16) {
+        simd__storeu_ix((simd__int*)out, rg);
+    } else {
+        simd__int b = sinm__unorm16_simd(simd__mul_ps(z, invLen));
+        simd__int ba = simd__or_ix(b, simd__set1_epi32((int)0xFFFF0000u));
+        sinm__store_interleaved_simd((uint32_t*)out, rg, ba);
+    }
+}
+
+//Normals of "n" pixels from sobel gradients(see sinm__sobel_gradient_row) in one of the 16 bit formats.
+//Same scale and flip as the sobel kernels
+static void
+sinm__encode_normals_row(const float* gx, const float* gy, void* out, int32_t n, float scale, int flipY, sinm_output_format format)
+{
+    assert(format == sinm_output_rgba16 || format == sinm_output_rg16 || format == sinm_output_oct16);
+    int32_t pixelSize = format == sinm_output_rgba16 ? 8 : 4;
+    simd__float simdScale = simd__set1_ps(scale);
+    simd__float simdFlipY = simd__set1_ps(flipY ? -1.0f : 1.0f);
+    uint8_t* o = (uint8_t*)out;
+    if (n < SINM_SIMD_WIDTH) {
+        //NOTE: padded copies so short rows get the same bytes as the SIMD body
+        sinm__aligned_var(float, 64) tx[SINM_SIMD_WIDTH] = { 0 };
+        sinm__aligned_var(float, 64) ty[SINM_SIMD_WIDTH] = { 0 };
+        sinm__aligned_var(uint8_t, 64) to[8 * SINM_SIMD_WIDTH];
+        memcpy(tx, gx, n * sizeof(float));
+        memcpy(ty, gy, n * sizeof(float));
+        sinm__encode_batch_simd(simd__loadu_ps(tx), simd__loadu_ps(ty), simdScale, simdFlipY, format, to);
+        memcpy(o, to, (size_t)n * pixelSize);
+        return;
+    }
+    for (int32_t x = 0;; x += SINM_SIMD_WIDTH) {
+        if (x + SINM_SIMD_WIDTH > n) {
+            //NOTE: redo the last full batch, the overlap gets the same bytes
+            x = n - SINM_SIMD_WIDTH;
+        }
+        sinm__encode_batch_simd(simd__loadu_ps(&gx[x]), simd__loadu_ps(&gy[x]), simdScale, simdFlipY, format, &o[(size_t)x * pixelSize]);
+        if (x + SINM_SIMD_WIDTH == n) {
+            return;
+        }
+    }
+}
+
+//Keeps the red and green bytes of "n" RGBA pixels, sinm_output_rg8
+static void
+sinm__pack_rg8_row(const uint32_t* in, uint8_t* out, int32_t n)
+{
+    simd__int low = simd__set1_epi32(0xFFFF);
+    int32_t simdN = n - n % SINM_SIMD_WIDTH;
+    int32_t x = 0;
+    for (; x < simdN; x += SINM_SIMD_WIDTH) {
+        sinm__store_words_simd((uint16_t*)&out[2 * x], simd__and_ix(simd__loadu_ix((const simd__int*)&in[x]), low));
+    }
+    for (; x < n; ++x) {
+        out[2 * x + 0] = (uint8_t)(in[x] & 0xFF);
+        out[2 * x + 1] = (uint8_t)((in[x] >> 8) & 0xFF);
+    }
+}
+
+static sinm__inline simd__int
+sinm__normalize_batch_simd(simd__int pixel, simd__float invScale, simd__float flipY)
+{
+    simd__float x, y, z;
+    sinm__rgba_to_v3_simd(pixel, &x, &y, &z);
+    y = simd__mul_ps(y, flipY);
+    z = simd__mul_ps(z, invScale);
+    simd__float len = sinm__length_simd(x, y, z);
+    simd__float invLen = simd__div_ps(simd__set1_ps(1.0f), len);
+    x = simd__mul_ps(x, invLen);
+    y = simd__mul_ps(y, invLen);
+    z = simd__mul_ps(z, invLen);
+    return sinm__v3_to_rgba_simd(x, y, z);
+}
+
+static void
+sinm__normalize_simd(uint32_t* in, int32_t w, int32_t h, float scale, int flipY)
+{
+    int64_t count = (int64_t)w * h;
+    int64_t simdCount = count - count % SINM_SIMD_WIDTH;
+    simd__float invScale = simd__set1_ps(1.0f / scale);
+    simd__float yDir = simd__set1_ps((flipY) ? -1.0f : 1.0f);
+    for (int64_t i = 0; i < simdCount; i += SINM_SIMD_WIDTH) {
+        simd__int pixel = simd__loadu_ix((simd__int*)&in[i]);
+        simd__storeu_ix((simd__int*)&in[i], sinm__normalize_batch_simd(pixel, invScale, yDir));
+    }
+
+    if (simdCount < count) {
+#if SINM__MASKED_TAILS
+        simd__mask m = simd__tail_mask(count - simdCount);
+        simd__int pixel = simd__maskz_loadu_ix(m, &in[simdCount]);
+        simd__mask_storeu_ix(&in[simdCount], m, sinm__normalize_batch_simd(pixel, invScale, yDir));
+#else
+        sinm__aligned_var(uint32_t, 64) tail[SINM_SIMD_WIDTH] = { 0 };
+        memcpy(tail, &in[simdCount], (count - simdCount) * sizeof(uint32_t));
+        simd__int pixel = simd__loadu_ix((simd__int*)tail);
+        simd__storeu_ix((simd__int*)tail, sinm__normalize_batch_simd(pixel, invScale, yDir));
+        memcpy(&in[simdCount], tail, (count - simdCount) * sizeof(uint32_t));
+#endif
+    }
+}
+
+static sinm__inline simd__int
+sinm__composite_batch_simd(simd__int c1, simd__int c2)
+{
+    simd__int ff = simd__set1_epi32(0xFF);
+    simd__int alpha = simd__slli_epi32(ff, 24);
+
+    simd__int r1 = simd__and_ix(c1, ff);
+    simd__int r2 = simd__and_ix(c2, ff);
+    simd__int g1 = simd__and_ix(simd__srli_epi32(c1, 8), ff);
+    simd__int g2 = simd__and_ix(simd__srli_epi32(c2, 8), ff);
+    simd__int b1 = simd__and_ix(simd__srli_epi32(c1, 16), ff);
+    simd__int b2 = simd__and_ix(simd__srli_epi32(c2, 16), ff);
+
+    simd__int r = simd__srli_epi32(simd__add_epi32(r1, r2), 1);
+    simd__int g = simd__srli_epi32(simd__add_epi32(g1, g2), 1);
+    simd__int b = simd__srli_epi32(simd__add_epi32(b1, b2), 1);
+
+    return simd__or_ix(simd__or_ix(simd__or_ix(r, simd__slli_epi32(g, 8)), simd__slli_epi32(b, 16)), alpha);
+}
+
+static void
+sinm__composite_simd(const uint32_t* in1, const uint32_t* in2, uint32_t* out, int32_t w, int32_t h)
+{
+    int64_t count = (int64_t)w * h;
+    int64_t simdCount = count - count % SINM_SIMD_WIDTH;
+    for (int64_t i = 0; i < simdCount; i += SINM_SIMD_WIDTH) {
+        simd__int c1 = simd__loadu_ix((simd__int*)&in1[i]);
+        simd__int c2 = simd__loadu_ix((simd__int*)&in2[i]);
+        simd__storeu_ix((simd__int*)&out[i], sinm__composite_batch_simd(c1, c2));
+    }
+
+    if (simdCount < count) {
+#if SINM__MASKED_TAILS
+        simd__mask m = simd__tail_mask(count - simdCount);
+        simd__int c1 = simd__maskz_loadu_ix(m, &in1[simdCount]);
+        simd__int c2 = simd__maskz_loadu_ix(m, &in2[simdCount]);
+        simd__mask_storeu_ix(&out[simdCount], m, sinm__composite_batch_simd(c1, c2));
+#else
+        sinm__aligned_var(uint32_t, 64) tail1[SINM_SIMD_WIDTH] = { 0 };
+        sinm__aligned_var(uint32_t, 64) tail2[SINM_SIMD_WIDTH] = { 0 };
+        memcpy(tail1, &in1[simdCount], (count - simdCount) * sizeof(uint32_t));
+        memcpy(tail2, &in2[simdCount], (count - simdCount) * sizeof(uint32_t));
+        simd__int c1 = simd__loadu_ix((simd__int*)tail1);
+        simd__int c2 = simd__loadu_ix((simd__int*)tail2);
+        simd__storeu_ix((simd__int*)tail1, sinm__composite_batch_simd(c1, c2));
+        memcpy(&out[simdCount], tail1, (count - simdCount) * sizeof(uint32_t));
+#endif
+    }
+}
+
+//Float heights in [0, 1] to 16 bit samples, rounded to nearest. Below 0(and NaN) gives 0, above 1 gives 65535
+static void
+sinm__float_height_row(const float* in, uint16_t* out, int64_t n)
+{
+    simd__float zero = simd__setzero_ps();
+    simd__float one = simd__set1_ps(1.0f);
+    simd__float top = simd__set1_ps(65535.0f);
+    int64_t simdN = n - n % SINM_SIMD_WIDTH;
+    int64_t x = 0;
+    for (; x < simdN; x += SINM_SIMD_WIDTH) {
+        //NOTE: max_ps returns its second operand when either is NaN
+        simd__float v = simd__min_ps(simd__max_ps(simd__loadu_ps(&in[x]), zero), one);
+        sinm__store_words_simd(&out[x], simd__cvtps_epi32(simd__mul_ps(v, top)));
+    }
+    for (; x < n; ++x) {
+        float v = in[x] > 0.0f ? sinm__min(1.0f, in[x]) : 0.0f;
+        out[x] = (uint16_t)lrintf(v * 65535.0f);
+    }
+}
+
+//Lowest and highest of the 16 bytes in "v"
+static sinm__inline void
+sinm__byte_range_simd(__m128i v, int32_t* lo, int32_t* hi)
+{
+    __m128i mn = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+    __m128i mx = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+    mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+    mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+    mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 2));
+    mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 2));
+    mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 1));
+    mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 1));
+    *lo = _mm_cvtsi128_si32(mn) & 0xFF;
+    *hi = _mm_cvtsi128_si32(mx) & 0xFF;
+}
+
+//round(d * steps / range) of the 16 bytes of "d" given as 16 bit lanes in "d0"(first 8) and "d1", clamped to
+//[0, steps]. Counts the thresholds each lane is past instead of dividing, so the result is exact
+static sinm__inline __m128i
+sinm__palette_steps_simd(__m128i d0, __m128i d1, int32_t range, int32_t steps)
+{
+    __m128i scale = _mm_set1_epi16((short)(2 * steps));
+    d0 = _mm_mullo_epi16(d0, scale);
+    d1 = _mm_mullo_epi16(d1, scale);
+    __m128i t0 = _mm_setzero_si128();
+    __m128i t1 = _mm_setzero_si128();
+    for (int32_t k = 1; k <= steps; ++k) {
+        //NOTE: d * 2 * steps >= (2k - 1) * range, cmpgt against one less
+        __m128i threshold = _mm_set1_epi16((short)((2 * k - 1) * range - 1));
+        t0 = _mm_sub_epi16(t0, _mm_cmpgt_epi16(d0, threshold));
+        t1 = _mm_sub_epi16(t1, _mm_cmpgt_epi16(d1, threshold));
+    }
+    return _mm_packus_epi16(t0, t1);
+}
+
+//The 16 bytes of one channel of a 4x4 block as a BC4 block: the highest and lowest value as endpoints(8 value
+//mode) and every pixel on its nearest palette entry
+static sinm__inline uint64_t
+sinm__bc4_block_simd(__m128i v)
+{
+    int32_t lo, hi;
+    sinm__byte_range_simd(v, &lo, &hi);
+    __m128i zero = _mm_setzero_si128();
+    __m128i top = _mm_set1_epi16((short)hi);
+    __m128i t = sinm__palette_steps_simd(_mm_sub_epi16(top, _mm_unpacklo_epi8(v, zero)), _mm_sub_epi16(top, _mm_unpackhi_epi8(v, zero)), hi - lo, 7);
+
+    //NOTE: step 0 is endpoint 0 and step 7 endpoint 1, the steps between are indices 2 to 7:
+    //m = (t + 1) & 7 gets everything but the endpoints right, which it swaps
+    __m128i m = _mm_and_si128(_mm_add_epi8(t, _mm_set1_epi8(1)), _mm_set1_epi8(7));
+    __m128i index = _mm_xor_si128(m, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(2), m), _mm_set1_epi8(1)));
+
+    //NOTE: 3 bit indices: pairs to 6 bits, then pairs of those to 12 bits per 32 bit lane
+    __m128i pairs = _mm_maddubs_epi16(index, _mm_set1_epi16(0x0801));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00400001));
+    uint64_t bits = (uint64_t)(uint32_t)_mm_cvtsi128_si32(quads)
+        | (uint64_t)(uint32_t)_mm_extract_epi32(quads, 1) << 12
+        | (uint64_t)(uint32_t)_mm_extract_epi32(quads, 2) << 24
+        | (uint64_t)(uint32_t)_mm_extract_epi32(quads, 3) << 36;
+    return (uint64_t)hi | (uint64_t)lo << 8 | bits << 16;
+}
+
+//The 16 bytes of one channel of a 4x4 block as the green of a BC1 block, red and blue are 0. Endpoints are the
+//highest and lowest value rounded to 6 bits(4 value mode unless they round to the same value)
+static sinm__inline uint64_t
+sinm__bc1_green_block_simd(__m128i v)
+{
+    int32_t lo, hi;
+    sinm__byte_range_simd(v, &lo, &hi);
+    int32_t g0 = (hi * 63 + 127) / 255;
+    int32_t g1 = (lo * 63 + 127) / 255;
+    uint64_t endpoints = (uint64_t)(g0 << 5) | (uint64_t)(g1 << 5) << 16;
+    if (g0 == g1) {
+        return endpoints;
+    }
+
+    //NOTE: the palette is made of the endpoints expanded back to 8 bits
+    int32_t e0 = (g0 << 2) | (g0 >> 4);
+    int32_t e1 = (g1 << 2) | (g1 >> 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i top = _mm_set1_epi16((short)e0);
+    __m128i t = sinm__palette_steps_simd(_mm_sub_epi16(top, _mm_unpacklo_epi8(v, zero)), _mm_sub_epi16(top, _mm_unpackhi_epi8(v, zero)), e0 - e1, 3);
+
+    //NOTE: steps 0 to 3 are indices 0, 2, 3, 1, the same swap as the BC4 one
+    __m128i m = _mm_and_si128(_mm_add_epi8(t, _mm_set1_epi8(1)), _mm_set1_epi8(3));
+    __m128i index = _mm_xor_si128(m, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(2), m), _mm_set1_epi8(1)));
+
+    //NOTE: 2 bit indices: pairs to 4 bits, pairs of those to 8 bits per 32 bit lane, then one byte from each lane
+    __m128i pairs = _mm_maddubs_epi16(index, _mm_set1_epi16(0x0401));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00100001));
+    __m128i bytes = _mm_shuffle_epi8(quads, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    return endpoints | (uint64_t)(uint32_t)_mm_cvtsi128_si32(bytes) << 32;
+}
+
+//Channel "c" of the 4x4 block whose rows start at "rows", in raster order
+static sinm__inline __m128i
+sinm__block_channel_simd(const __m128i rows[4], int32_t c)
+{
+    __m128i select = _mm_setr_epi8((char)c, (char)(c + 4), (char)(c + 8), (char)(c + 12), -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i r0 = _mm_shuffle_epi8(rows[0], select);
+    __m128i r1 = _mm_shuffle_epi8(rows[1], select);
+    __m128i r2 = _mm_shuffle_epi8(rows[2], select);
+    __m128i r3 = _mm_shuffle_epi8(rows[3], select);
+    return _mm_unpacklo_epi64(_mm_unpacklo_epi32(r0, r1), _mm_unpacklo_epi32(r2, r3));
+}
+
+//Compresses the row of 4x4 blocks whose pixel rows are "rows"(the last one repeated past the bottom of the image)
+//from RGBA normals into 16 byte "format" blocks. Columns past "w" repeat the last one.
+//NOTE: a block channel is 16 bytes, so every instruction set works on 128 bit registers here
+static void
+sinm__compress_block_row(const uint32_t* rows[4], uint8_t* out, int32_t w, sinm_block_format format)
+{
+    int32_t blocks = (w + 3) / 4;
+    for (int32_t b = 0; b < blocks; ++b) {
+        int32_t x = 4 * b;
+        __m128i pixels[4];
+        if (x + 4 <= w) {
+            for (int i = 0; i < 4; ++i) {
+                pixels[i] = _mm_loadu_si128((const __m128i*)&rows[i][x]);
+            }
+        } else {
+            for (int i = 0; i < 4; ++i) {
+                uint32_t edge[4];
+                for (int j = 0; j < 4; ++j) {
+                    edge[j] = rows[i][sinm__min(w - 1, x + j)];
+                }
+                pixels[i] = _mm_loadu_si128((const __m128i*)edge);
+            }
+        }
+
+        uint64_t block[2];
+        if (format == sinm_block_bc3nm) {
+            //NOTE: X goes in alpha and Y in green, where BC3 keeps the most bits
+            block[0] = sinm__bc4_block_simd(sinm__block_channel_simd(pixels, 0));
+            block[1] = sinm__bc1_green_block_simd(sinm__block_channel_simd(pixels, 1));
+        } else {
+            block[0] = sinm__bc4_block_simd(sinm__block_channel_simd(pixels, 0));
+            block[1] = sinm__bc4_block_simd(sinm__block_channel_simd(pixels, 1));
+        }
+        memcpy(&out[(size_t)b * 16], block, sizeof(block));
+    }
+}
+
+static const sinm__kernel_table kernels = {
+    (sinm_isa)SINM__ISA,
+    SINM_SIMD_WIDTH,
+    sinm__simd_greyscale,
+    sinm__greyscale_row,
+    sinm__float_height_row,
+    sinm__box_blur_line<uint8_t>,
+    sinm__box_blur_line<uint16_t>,
+    sinm__box_blur_h_row_range,
+    sinm__box_blur_v_row_range,
+    sinm__box_slide_row<uint8_t>,
+    sinm__box_slide_row<uint16_t>,
+    sinm__recursive_gaussian_lines,
+    sinm__integral_blur_row,
+    sinm__sobel_row<uint8_t>,
+    sinm__sobel_row<uint16_t>,
+    sinm__sobel_gradient_row<uint8_t>,
+    sinm__sobel_gradient_row<uint16_t>,
+    sinm__encode_normals_row,
+    sinm__pack_rg8_row,
+    sinm__compress_block_row,
+    sinm__gradient_row,
+    sinm__normalize_simd,
+    sinm__composite_simd,
+};
+
+} //namespace SINM__ISA_NAMESPACE
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#undef simd_prefix_float
+#undef SINM_SIMD_WIDTH
+#undef SINM_SIMD_DOUBLE_WIDTH
+#undef simd__int
+#undef simd__float
+#undef simd__double
+#undef simd__and_ix
+#undef simd__or_ix
+#undef simd__loadu_ix
+#undef simd__storeu_ix
+#undef simd__set1_epi32
+#undef simd__set1_epi16
+#undef simd__add_epi16
+#undef simd__sub_epi16
+#undef simd__mulhi_epu16
+#undef simd__srl_epi16
+#undef simd__mul_epu32
+#undef simd__mullo_epi32
+#undef simd__srl_epi64
+#undef simd__srli_epi64
+#undef simd__slli_epi64
+#undef simd__setzero_ps
+#undef simd__andnot_ps
+#undef simd__add_epi32
+#undef simd__sub_epi32
+#undef simd__max_epi32
+#undef simd__min_epi32
+#undef simd__loadu_ps
+#undef simd__storeu_ps
+#undef simd__set1_pd
+#undef simd__loadu_pd
+#undef simd__storeu_pd
+#undef simd__add_pd
+#undef simd__sub_pd
+#undef simd__mul_pd
+#undef simd__min_pd
+#undef simd__max_pd
+#undef simd__srli_epi32
+#undef simd__slli_epi32
+#undef simd__set1_ps
+#undef simd__cvtepi32_ps
+#undef simd__cvtps_epi32
+#undef simd__cvttps_epi32
+#undef simd__add_ps
+#undef simd__sub_ps
+#undef simd__mul_ps
+#undef simd__max_ps
+#undef simd__min_ps
+#undef simd__sqrt_ps
+#undef simd__cmp_ps
+#undef simd__div_ps
+#undef simd__hadd_ps
+#undef simd__cvtss_f32
+#undef SINM__MASKED_TAILS
+#undef simd__mask
+#undef simd__tail_mask
+#undef simd__maskz_loadu_ix
+#undef simd__mask_storeu_ix
+#undef SINM__ISA_NAMESPACE
+#undef SINM__ISA_TARGET
+#undef SINM__ISA
@@ -0,0 +1,829 @@
+#define FMT_HEADER_ONLY
+#include <fmt/core.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define SI_NORMALMAP_STATIC
+#define SI_NORMALMAP_IMPLEMENTATION
+#include "si_normalmap.h"
+
+//Benchmarks for the CPU side of si_normalmap.h
+//
+//  sinm_bench [bench] [sizes...]
+//
+//  bench: tiled   multi pass vs tiled pipeline on one and every hardware thread(default sizes 4096 8192 16384)
+//         threads sinm_normal_map_buffer scaling from 1 to every hardware thread(default size 8192)
+//         isa     every CPU stage with each instruction set the CPU supports(default sizes 1024 2048 4096)
+//         blur    box vs recursive vs summed-area table gaussian for radii 1 to 200(default size 2048)
+//         layers  1 to 8 layers regenerated from scratch vs from one summed-area table(default size 2048)
+//         pyramid sinm_normal_map_buffer vs a cached pyramid for radii 1 to 200(default size 2048)
+//         context sinm_normal_map_buffer vs sinm_normal_map_buffer_ctx with a reused context(default sizes 512 2048 8192)
+//         memory  time and peak memory of the buffer, tiled and rows paths(default sizes 4096 16384)
+//         stream  sinm_normal_map_stream of a 4096 wide image this tall(default 65536, 600000 is past 2^31 pixels)
+//         raw     .r16 heightmap file to raw RGBA8 file: read + expand to RGBA + write vs memory mapped(default sizes 2048 8192)
+//         bc      BC5/BC3nm compression speed and error, compressing a finished normal map vs inside the row pipeline(default sizes 2048 8192)
+//         passes  one horizontal vs one vertical box blur pass on a single thread(default sizes 2048 4096 8192)
+//  sizes: square image edge lengths
+
+namespace bench {
+using clock = std::chrono::steady_clock;
+
+static double elapsed_ms(clock::time_point begin)
+{
+    return std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+}
+
+//Deterministic noisy texture so the blur and sobel stages do real work
+static std::vector<uint32_t> make_test_image(int32_t w, int32_t h)
+{
+    std::vector<uint32_t> result((size_t)w * h);
+    uint32_t seed = 0x9E3779B9u;
+    for (int32_t y = 0; y < h; ++y) {
+        for (int32_t x = 0; x < w; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            uint32_t r = ((x * 7 + y * 3) & 0xFFu) ^ ((seed >> 24) & 0x1Fu);
+            uint32_t g = (seed >> 8) & 0xFFu;
+            uint32_t b = (uint32_t)(x ^ y) & 0xFFu;
+            result[(size_t)y * w + x] = r | g << 8u | b << 16u | 255u << 24u;
+        }
+    }
+    return result;
+}
+
+template <typename F>
+static double best_of(int runs, F&& f)
+{
+    double best = 1e30;
+    for (int i = 0; i < runs; ++i) {
+        auto begin = clock::now();
+        f();
+        best = std::min(best, elapsed_ms(begin));
+    }
+    return best;
+}
+
+//Modelled main memory traffic per pixel of the multi pass path: greyscale reads 4 bytes and writes
+//a 1 byte height, 3x(horizontal + vertical) blur read and write 1 byte and sobel reads 1 and writes 4
+static double multipass_bytes_per_pixel()
+{
+    return (4 + 1) + 6 * (1 + 1) + (1 + 4);
+}
+
+//The tiled path reads each tile plus its halo once and writes the tile once
+static double tiled_bytes_per_pixel(int32_t w, int32_t h, float blurRadius)
+{
+    sinm__tile_params params;
+    sinm__tile_params_init(&params, w, h, 1.0f, blurRadius, sinm_greyscale_luminance, 0);
+    double readPixels = 0.0;
+    for (int32_t ty = 0; ty < h; ty += SINM_TILE_SIZE) {
+        for (int32_t tx = 0; tx < w; tx += SINM_TILE_SIZE) {
+            int32_t rw = std::min(w, tx + SINM_TILE_SIZE + params.halo) - std::max(0, tx - params.halo);
+            int32_t rh = std::min(h, ty + SINM_TILE_SIZE + params.halo) - std::max(0, ty - params.halo);
+            readPixels += (double)rw * rh;
+        }
+    }
+    return 4.0 * readPixels / ((double)w * h) + 4.0;
+}
+
+static void tiled(const std::vector<int32_t>& sizes)
+{
+    const float blurRadius = 4.0f;
+    const float scale = 2.0f;
+    int32_t maxThreads = std::max(1, (int32_t)std::thread::hardware_concurrency());
+    std::vector<int32_t> threadCounts = { 1 };
+    if (maxThreads > 1) {
+        threadCounts.push_back(maxThreads);
+    }
+    fmt::print("{:>7} {:>8} {:>10} {:>12} {:>12} {:>10} {:>10} {:>8}\n",
+        "size", "threads", "path", "ms", "MPix/s", "B/px", "GB/s", "match");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> reference((size_t)size * size);
+        std::vector<uint32_t> out((size_t)size * size);
+        double mpix = (double)size * size / 1e6;
+        int runs = size > 8192 ? 1 : 3;
+        double multipassBytes = multipass_bytes_per_pixel();
+        double tiledBytes = tiled_bytes_per_pixel(size, size, blurRadius);
+
+        for (int32_t threads : threadCounts) {
+            sinm_initialize_threads(threads);
+            double multipassMs = best_of(runs, [&] {
+                sinm_normal_map_buffer(in.data(), reference.data(), size, size, scale, blurRadius, sinm_greyscale_luminance, 0);
+            });
+            double tiledMs = best_of(runs, [&] {
+                sinm_normal_map_buffer_tiled(in.data(), out.data(), size, size, scale, blurRadius, sinm_greyscale_luminance, 0);
+            });
+            bool match = memcmp(reference.data(), out.data(), out.size() * sizeof(uint32_t)) == 0;
+
+            fmt::print("{:>7} {:>8} {:>10} {:>12.2f} {:>12.1f} {:>10.1f} {:>10.2f} {:>8}\n",
+                size, threads, "multipass", multipassMs, mpix / (multipassMs / 1000.0), multipassBytes, multipassBytes * mpix / 1e3 / (multipassMs / 1000.0), "-");
+            fmt::print("{:>7} {:>8} {:>10} {:>12.2f} {:>12.1f} {:>10.1f} {:>10.2f} {:>8}\n",
+                size, threads, "tiled", tiledMs, mpix / (tiledMs / 1000.0), tiledBytes, tiledBytes * mpix / 1e3 / (tiledMs / 1000.0), match ? "yes" : "NO");
+        }
+    }
+    sinm_shutdown_threads();
+}
+
+//Peak memory of one call as sinm_memory_high_water() sees it, plus the input and output every path needs
+static void memory(const std::vector<int32_t>& sizes)
+{
+    const float blurRadius = 4.0f;
+    const float scale = 2.0f;
+    fmt::print("{:>7} {:>10} {:>12} {:>12} {:>12} {:>8}\n", "size", "path", "ms", "scratch MB", "peak MB", "match");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> reference((size_t)size * size);
+        std::vector<uint32_t> out((size_t)size * size);
+        double imageMB = 2.0 * in.size() * sizeof(uint32_t) / 1e6;
+        int runs = size > 8192 ? 1 : 3;
+
+        auto measure = [&](const char* path, std::vector<uint32_t>& result, auto&& f) {
+            size_t scratch = 0;
+            double ms = best_of(runs, [&] {
+                sinm_memory_reset_high_water();
+                f(result.data());
+                scratch = sinm_memory_high_water();
+            });
+            bool match = memcmp(reference.data(), result.data(), result.size() * sizeof(uint32_t)) == 0;
+            fmt::print("{:>7} {:>10} {:>12.2f} {:>12.2f} {:>12.1f} {:>8}\n", size, path, ms, scratch / 1e6, imageMB + scratch / 1e6, match ? "yes" : "NO");
+        };
+        measure("buffer", reference, [&](uint32_t* o) { sinm_normal_map_buffer(in.data(), o, size, size, scale, blurRadius, sinm_greyscale_luminance, 0); });
+        measure("tiled", out, [&](uint32_t* o) { sinm_normal_map_buffer_tiled(in.data(), o, size, size, scale, blurRadius, sinm_greyscale_luminance, 0); });
+        measure("rows", out, [&](uint32_t* o) { sinm_normal_map_buffer_rows(in.data(), o, size, size, scale, blurRadius, sinm_greyscale_luminance, 0); });
+    }
+}
+
+struct stream_state {
+    int32_t w;
+    int64_t h;
+    size_t rowBytes; //Of an output row
+    std::vector<uint32_t> period; //Input rows repeat every "periodRows"
+    std::vector<uint8_t> reference; //Output of one period away from the edges, later periods must match it
+    int64_t periodRows;
+    int64_t mismatches;
+};
+
+static int stream_read(void* user, int64_t y, uint32_t* row)
+{
+    stream_state* s = (stream_state*)user;
+    memcpy(row, &s->period[(size_t)(y % s->periodRows) * s->w], s->w * sizeof(uint32_t));
+    return 1;
+}
+
+static int stream_write(void* user, int64_t y, const void* row)
+{
+    stream_state* s = (stream_state*)user;
+    uint8_t* expected = &s->reference[(size_t)(y % s->periodRows) * s->rowBytes];
+    if (y >= s->periodRows && y < 2 * s->periodRows) {
+        memcpy(expected, row, s->rowBytes);
+    } else if (y >= 2 * s->periodRows && y < s->h - s->periodRows) {
+        s->mismatches += memcmp(expected, row, s->rowBytes) != 0;
+    }
+    return 1;
+}
+
+static const char* output_format_name(sinm_output_format format)
+{
+    switch (format) {
+    case sinm_output_rgba8: return "rgba8";
+    case sinm_output_rg8: return "rg8";
+    case sinm_output_rgba16: return "rgba16";
+    case sinm_output_rg16: return "rg16";
+    case sinm_output_oct16: return "oct16";
+    default: return "?";
+    }
+}
+
+//A tall image that is never in memory: rows are generated on the fly and checked as they come out. The
+//input repeats every 1024 rows so every output row away from the top and bottom has to match the one a
+//period before, which catches any row index that wraps past 2^31 pixels. Every output format is streamed,
+//"out GB" is what the writer would have to store
+static void stream(const std::vector<int32_t>& heights)
+{
+    const float blurRadius = 4.0f;
+    fmt::print("{:>7} {:>9} {:>7} {:>10} {:>12} {:>10} {:>12} {:>8} {:>10}\n", "width", "height", "format", "GPix", "ms", "MPix/s", "scratch MB", "out GB", "mismatch");
+
+    for (int32_t height : heights) {
+        for (int f = 0; f < sinm_output_count; ++f) {
+            sinm_output_format format = (sinm_output_format)f;
+            stream_state s;
+            s.w = 4096;
+            s.h = height;
+            s.rowBytes = s.w * sinm_output_pixel_size(format);
+            s.periodRows = 1024;
+            s.period = make_test_image(s.w, (int32_t)s.periodRows);
+            s.reference.resize(s.rowBytes * s.periodRows);
+            s.mismatches = 0;
+
+            sinm_memory_reset_high_water();
+            auto begin = clock::now();
+            sinm_normal_map_stream(stream_read, stream_write, &s, s.w, s.h, 2.0f, blurRadius, sinm_greyscale_luminance, 0, format);
+            double ms = elapsed_ms(begin);
+            double mpix = (double)s.w * s.h / 1e6;
+            fmt::print("{:>7} {:>9} {:>7} {:>10.2f} {:>12.0f} {:>10.1f} {:>12.2f} {:>8.2f} {:>10}\n",
+                s.w, s.h, output_format_name(format), mpix / 1e3, ms, mpix / (ms / 1000.0), sinm_memory_high_water() / 1e6, s.rowBytes * s.h / 1e9, s.mismatches);
+        }
+    }
+}
+
+//Thread counts to measure: powers of two up to and including the hardware thread count
+static std::vector<int32_t> thread_counts()
+{
+    int32_t maxThreads = std::max(1, (int32_t)std::thread::hardware_concurrency());
+    std::vector<int32_t> result;
+    for (int32_t t = 1; t < maxThreads; t *= 2) {
+        result.push_back(t);
+    }
+    result.push_back(maxThreads);
+    return result;
+}
+
+static void threads(const std::vector<int32_t>& sizes)
+{
+    const float blurRadius = 4.0f;
+    const float scale = 2.0f;
+    fmt::print("{:>7} {:>8} {:>12} {:>12} {:>9} {:>11}\n",
+        "size", "threads", "ms", "MPix/s", "speedup", "efficiency");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> out((size_t)size * size);
+        double mpix = (double)size * size / 1e6;
+        double singleMs = 0.0;
+
+        for (int32_t t : thread_counts()) {
+            sinm_initialize_threads(t);
+            double ms = best_of(3, [&] {
+                sinm_normal_map_buffer(in.data(), out.data(), size, size, scale, blurRadius, sinm_greyscale_luminance, 0);
+            });
+            if (t == 1) {
+                singleMs = ms;
+            }
+            fmt::print("{:>7} {:>8} {:>12.2f} {:>12.1f} {:>8.2f}x {:>10.0f}%\n",
+                size, t, ms, mpix / (ms / 1000.0), singleMs / ms, 100.0 * singleMs / ms / t);
+        }
+        sinm_shutdown_threads();
+    }
+}
+
+static int32_t max_channel_diff(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b)
+{
+    int32_t result = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (uint32_t shift = 0; shift < 32; shift += 8) {
+            int32_t d = (int32_t)((a[i] >> shift) & 0xFFu) - (int32_t)((b[i] >> shift) & 0xFFu);
+            result = std::max(result, d < 0 ? -d : d);
+        }
+    }
+    return result;
+}
+
+//Times each stage with every kernel set the CPU can run. Stages are fed the previous stage's output
+//so they see realistic data. "max diff" is the largest per channel difference of the full pipeline
+//against the sse4.1 result and should be 0: every level runs the same math, only the lane count differs
+static void isa(const std::vector<int32_t>& sizes)
+{
+    const float blurRadius = 4.0f;
+    const float scale = 2.0f;
+    const char* stages[] = { "greyscale", "blur", "sobel", "normalize", "composite", "full" };
+    fmt::print("{:>7} {:>8}", "size", "isa");
+    for (const char* stage : stages) {
+        fmt::print(" {:>10}", stage);
+    }
+    fmt::print(" {:>9}\n", "max diff");
+
+    sinm_isa detected = sinm_detect_isa();
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> grey((size_t)size * size);
+        std::vector<uint8_t> height((size_t)size * size);
+        std::vector<uint8_t> blurred((size_t)size * size);
+        std::vector<uint8_t> blurTemp((size_t)size * size);
+        std::vector<uint32_t> temp((size_t)size * size);
+        std::vector<uint32_t> normals((size_t)size * size);
+        std::vector<uint32_t> reference((size_t)size * size);
+        std::vector<uint32_t> out((size_t)size * size);
+
+        for (int i = 0; i <= detected; ++i) {
+            sinm_force_isa((sinm_isa)i);
+            double ms[6];
+            ms[0] = best_of(3, [&] { sinm_greyscale(in.data(), grey.data(), size, size, sinm_greyscale_luminance); });
+            for (size_t p = 0; p < grey.size(); ++p) {
+                height[p] = (uint8_t)(grey[p] & 0xFFu);
+            }
+            ms[1] = best_of(3, [&] {
+                memcpy(blurred.data(), height.data(), height.size());
+                sinm__gaussian_box(blurred.data(), blurTemp.data(), NULL, size, size, blurRadius);
+            });
+            ms[2] = best_of(3, [&] {
+                sinm__band_args args = { NULL, NULL, normals.data(), size, size };
+                args.scale = scale;
+                args.height = blurred.data();
+                sinm__parallel_rows(size, sinm__sobel_band, &args);
+            });
+            ms[3] = best_of(3, [&] {
+                memcpy(temp.data(), normals.data(), normals.size() * sizeof(uint32_t));
+                sinm_normalize(temp.data(), size, size, scale, 0);
+            });
+            ms[4] = best_of(3, [&] { sinm_composite(normals.data(), temp.data(), out.data(), size, size); });
+            ms[5] = best_of(3, [&] {
+                sinm_normal_map_buffer(in.data(), out.data(), size, size, scale, blurRadius, sinm_greyscale_luminance, 0);
+            });
+            if (i == 0) {
+                reference = out;
+            }
+
+            fmt::print("{:>7} {:>8}", size, sinm_isa_name((sinm_isa)i));
+            for (double m : ms) {
+                fmt::print(" {:>10.2f}", m);
+            }
+            fmt::print(" {:>9}\n", max_channel_diff(reference, out));
+        }
+        sinm_force_isa(detected);
+    }
+}
+
+//The vertical pass used to walk the image a column at a time. Both passes should take about as long
+static void passes(const std::vector<int32_t>& sizes)
+{
+    const int32_t radii[] = { 1, 4, 16 };
+    fmt::print("{:>7} {:>7} {:>10} {:>10} {:>8}\n", "size", "radius", "h ms", "v ms", "v / h");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint8_t> height((size_t)size * size);
+        for (size_t p = 0; p < in.size(); ++p) {
+            height[p] = (uint8_t)(in[p] & 0xFFu);
+        }
+        std::vector<uint8_t> out((size_t)size * size);
+
+        for (int32_t r : radii) {
+            double hMs = best_of(3, [&] { sinm__box_blur_h(height.data(), out.data(), size, size, r); });
+            double vMs = best_of(3, [&] { sinm__box_blur_v(height.data(), out.data(), size, size, r); });
+            fmt::print("{:>7} {:>7} {:>10.2f} {:>10.2f} {:>8.2f}\n", size, r, hMs, vMs, vMs / hMs);
+        }
+    }
+}
+
+//Exact gaussian(kernel cut at 4 sigma, clamped edges) of a single channel plane in double precision
+static std::vector<double> reference_gaussian(const std::vector<uint8_t>& in, int32_t w, int32_t h, float sigma)
+{
+    int32_t reach = (int32_t)ceilf(4.0f * sigma);
+    std::vector<double> kernel(2 * reach + 1);
+    double sum = 0.0;
+    for (int32_t i = -reach; i <= reach; ++i) {
+        kernel[i + reach] = exp(-(double)i * i / (2.0 * sigma * sigma));
+        sum += kernel[i + reach];
+    }
+    for (double& k : kernel) {
+        k /= sum;
+    }
+
+    std::vector<double> temp((size_t)w * h);
+    std::vector<double> result((size_t)w * h);
+    for (int32_t y = 0; y < h; ++y) {
+        for (int32_t x = 0; x < w; ++x) {
+            double v = 0.0;
+            for (int32_t i = -reach; i <= reach; ++i) {
+                v += kernel[i + reach] * in[(size_t)y * w + std::min(w - 1, std::max(0, x + i))];
+            }
+            temp[(size_t)y * w + x] = v;
+        }
+    }
+    for (int32_t y = 0; y < h; ++y) {
+        for (int32_t x = 0; x < w; ++x) {
+            double v = 0.0;
+            for (int32_t i = -reach; i <= reach; ++i) {
+                v += kernel[i + reach] * temp[(size_t)std::min(h - 1, std::max(0, y + i)) * w + x];
+            }
+            result[(size_t)y * w + x] = v;
+        }
+    }
+    return result;
+}
+
+//Times each blur on "size" images and measures its error against an exact gaussian on a 512x512
+//image(the reference convolution is too slow for large radii on big images). "sat" is the stacked box
+//blur of sinm_normal_map_integral, timed without building the table
+static void blur(const std::vector<int32_t>& sizes)
+{
+    const float radii[] = { 1, 2, 4, 8, 16, 32, 64, 128, 200 };
+    const int32_t qualitySize = 512;
+    const char* names[] = { "box", "rec", "sat" };
+    fmt::print("{:>7} {:>7}", "size", "radius");
+    for (const char* suffix : { "ms", "rmse", "max" }) {
+        for (const char* name : names) {
+            fmt::print(" {:>9}", fmt::format("{} {}", name, suffix));
+        }
+    }
+    fmt::print("\n");
+
+    std::vector<uint32_t> qualityIn = make_test_image(qualitySize, qualitySize);
+    std::vector<uint8_t> qualityHeight((size_t)qualitySize * qualitySize);
+    for (size_t p = 0; p < qualityIn.size(); ++p) {
+        qualityHeight[p] = (uint8_t)(qualityIn[p] & 0xFFu);
+    }
+    sinm_integral qualityIntegral;
+    sinm_integral_build(&qualityIntegral, qualityIn.data(), qualitySize, qualitySize, sinm_greyscale_none);
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint8_t> height((size_t)size * size);
+        for (size_t p = 0; p < in.size(); ++p) {
+            height[p] = (uint8_t)(in[p] & 0xFFu);
+        }
+        std::vector<uint8_t> blurred((size_t)size * size);
+        std::vector<uint8_t> temp((size_t)size * size);
+        sinm_integral integral;
+        sinm_integral_build(&integral, in.data(), size, size, sinm_greyscale_none);
+
+        for (float r : radii) {
+            double ms[3];
+            ms[0] = best_of(3, [&] {
+                memcpy(blurred.data(), height.data(), height.size());
+                sinm__gaussian_box(blurred.data(), temp.data(), NULL, size, size, r);
+            });
+            ms[1] = best_of(3, [&] {
+                memcpy(blurred.data(), height.data(), height.size());
+                sinm__gaussian_recursive(blurred.data(), temp.data(), NULL, size, size, r);
+            });
+            ms[2] = best_of(3, [&] { sinm__gaussian_integral(&integral, blurred.data(), r); });
+
+            std::vector<double> reference = reference_gaussian(qualityHeight, qualitySize, qualitySize, r);
+            double rmse[3] = {};
+            double maxError[3] = {};
+            for (int type = 0; type < 3; ++type) {
+                std::vector<uint8_t> q = qualityHeight;
+                std::vector<uint8_t> qTemp(q.size());
+                if (type == 0) {
+                    sinm__gaussian_box(q.data(), qTemp.data(), NULL, qualitySize, qualitySize, r);
+                } else if (type == 1) {
+                    sinm__gaussian_recursive(q.data(), qTemp.data(), NULL, qualitySize, qualitySize, r);
+                } else {
+                    sinm__gaussian_integral(&qualityIntegral, q.data(), r);
+                }
+                for (size_t p = 0; p < q.size(); ++p) {
+                    double e = fabs(q[p] - reference[p]);
+                    rmse[type] += e * e;
+                    maxError[type] = std::max(maxError[type], e);
+                }
+                rmse[type] = sqrt(rmse[type] / q.size());
+            }
+
+            fmt::print("{:>7} {:>7.0f} {:>9.2f} {:>9.2f} {:>9.2f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.2f} {:>9.2f} {:>9.2f}\n",
+                size, r, ms[0], ms[1], ms[2], rmse[0], rmse[1], rmse[2], maxError[0], maxError[1], maxError[2]);
+        }
+        sinm_integral_free(&integral);
+    }
+    sinm_integral_free(&qualityIntegral);
+}
+
+//Regenerating several layers of the same image that only differ in blur radius: one
+//sinm_normal_map_buffer per layer vs one summed-area table shared by every layer
+static void layers(const std::vector<int32_t>& sizes)
+{
+    const float radii[] = { 2, 5, 11, 23, 47, 97, 13, 7 };
+    const int32_t counts[] = { 1, 2, 4, 8 };
+    fmt::print("{:>7} {:>7} {:>12} {:>12} {:>12}\n", "size", "layers", "buffer ms", "integral ms", "build ms");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> out((size_t)size * size);
+        for (int32_t count : counts) {
+            double bufferMs = best_of(3, [&] {
+                for (int32_t i = 0; i < count; ++i) {
+                    sinm_normal_map_buffer(in.data(), out.data(), size, size, 2.0f, radii[i], sinm_greyscale_luminance, 0);
+                }
+            });
+            double buildMs = 0.0;
+            double integralMs = best_of(3, [&] {
+                auto begin = clock::now();
+                sinm_integral integral;
+                sinm_integral_build(&integral, in.data(), size, size, sinm_greyscale_luminance);
+                buildMs = elapsed_ms(begin);
+                for (int32_t i = 0; i < count; ++i) {
+                    sinm_normal_map_integral(&integral, out.data(), 2.0f, radii[i], 0);
+                }
+                sinm_integral_free(&integral);
+            });
+            fmt::print("{:>7} {:>7} {:>12.2f} {:>12.2f} {:>12.2f}\n", size, count, bufferMs, integralMs, buildMs);
+        }
+    }
+}
+
+//Cost of one slider tweak once the pyramid is cached vs a full sinm_normal_map_buffer. "max diff" is the largest
+//per channel difference of the normals against sinm_normal_map_buffer, 0 until the radius is big enough to leave level 0
+static void pyramid(const std::vector<int32_t>& sizes)
+{
+    const float radii[] = { 1, 2, 5, 10, 20, 50, 100, 200 };
+    fmt::print("{:>7} {:>7} {:>12} {:>12} {:>8} {:>10}\n", "size", "radius", "buffer ms", "pyramid ms", "speedup", "max diff");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> reference((size_t)size * size);
+        std::vector<uint32_t> out((size_t)size * size);
+
+        sinm_pyramid cached;
+        double buildMs = best_of(3, [&] {
+            sinm_pyramid_build(&cached, in.data(), size, size, sinm_greyscale_luminance);
+            sinm_pyramid_free(&cached);
+        });
+        sinm_pyramid_build(&cached, in.data(), size, size, sinm_greyscale_luminance);
+
+        for (float radius : radii) {
+            double bufferMs = best_of(3, [&] { sinm_normal_map_buffer(in.data(), reference.data(), size, size, 2.0f, radius, sinm_greyscale_luminance, 0); });
+            double pyramidMs = best_of(3, [&] { sinm_normal_map_pyramid(&cached, out.data(), 2.0f, radius, 0); });
+            fmt::print("{:>7} {:>7.0f} {:>12.2f} {:>12.2f} {:>7.2f}x {:>10}\n",
+                size, radius, bufferMs, pyramidMs, bufferMs / pyramidMs, max_channel_diff(reference, out));
+        }
+        fmt::print("{:>7} build {:.2f} ms, {} levels\n", size, buildMs, cached.levels);
+        sinm_pyramid_free(&cached);
+    }
+}
+
+//Back to back images on every hardware thread, like a batch service sees them. sinm_normal_map_buffer
+//allocates and faults in fresh scratch every call, the context is reserved once and reused
+static void context(const std::vector<int32_t>& sizes)
+{
+    const float blurRadius = 4.0f;
+    const int32_t images = 8;
+    sinm_initialize_threads(0);
+    fmt::print("{:>7} {:>12} {:>12} {:>8} {:>12}\n", "size", "buffer ms", "context ms", "speedup", "scratch MB");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> out((size_t)size * size);
+        size_t scratchSize = sinm_scratch_size(size, size, blurRadius, sinm_blur_box);
+        sinm_context ctx;
+        sinm_context_init(&ctx, nullptr, 0);
+        sinm_context_reserve(&ctx, scratchSize);
+
+        double bufferMs = best_of(3, [&] {
+            for (int32_t i = 0; i < images; ++i) {
+                sinm_normal_map_buffer(in.data(), out.data(), size, size, 2.0f, blurRadius, sinm_greyscale_luminance, 0);
+            }
+        });
+        double contextMs = best_of(3, [&] {
+            for (int32_t i = 0; i < images; ++i) {
+                sinm_normal_map_buffer_ctx(&ctx, in.data(), out.data(), size, size, 2.0f, blurRadius, sinm_greyscale_luminance, 0);
+            }
+        });
+        fmt::print("{:>7} {:>12.2f} {:>12.2f} {:>7.2f}x {:>12.1f}\n",
+            size, bufferMs / images, contextMs / images, bufferMs / contextMs, scratchSize / 1e6);
+        sinm_context_free(&ctx);
+    }
+    sinm_shutdown_threads();
+}
+
+//A .r16 heightmap file to a raw RGBA8 normal map file, both in the page cache after the first run. "copy" reads the
+//file, widens it to RGBA like converting to PNG and loading with stbi_load does, and writes the result out.
+//"mapped" hands sinm_normal_map_raw the mapped files, which also keeps all 16 bits of height. "8 bit diff" is the
+//largest per channel difference squashing the heights to 8 bits makes
+static void raw(const std::vector<int32_t>& sizes)
+{
+    const char* heightPath = "sinm_bench_raw.r16";
+    const char* normalPath = "sinm_bench_raw_normal.rgba8";
+    sinm_initialize_threads(0);
+    fmt::print("{:>7} {:>12} {:>12} {:>8} {:>12}\n", "size", "copy ms", "mapped ms", "speedup", "8 bit diff");
+
+    for (int32_t size : sizes) {
+        size_t pixels = (size_t)size * size;
+        std::vector<uint16_t> heights(pixels);
+        std::vector<uint32_t> image = make_test_image(size, size);
+        for (size_t i = 0; i < pixels; ++i) {
+            heights[i] = (uint16_t)(((image[i] & 0xFF) << 8) | ((image[i] >> 8) & 0xFF));
+        }
+        FILE* file = fopen(heightPath, "wb");
+        if (!file || fwrite(heights.data(), sizeof(uint16_t), pixels, file) != pixels) {
+            fmt::print(stderr, "can't write {}\n", heightPath);
+            return;
+        }
+        fclose(file);
+
+        std::vector<uint32_t> reference(pixels);
+        double copyMs = best_of(3, [&] {
+            FILE* in = fopen(heightPath, "rb");
+            fread(heights.data(), sizeof(uint16_t), pixels, in);
+            fclose(in);
+            for (size_t i = 0; i < pixels; ++i) {
+                uint32_t v = (heights[i] + 128) / 257;
+                image[i] = v | (v << 8) | (v << 16) | 0xFF000000u;
+            }
+            sinm_normal_map_buffer_rows(image.data(), reference.data(), size, size, 2.0f, 2.0f, sinm_greyscale_none, 0);
+            FILE* out = fopen(normalPath, "wb");
+            fwrite(reference.data(), sizeof(uint32_t), pixels, out);
+            fclose(out);
+        });
+
+        double mappedMs = best_of(3, [&] {
+            sinm_mapped_file in, out;
+            if (sinm_map_file(&in, heightPath) && sinm_map_file_write(&out, normalPath, pixels * sizeof(uint32_t))) {
+                sinm_normal_map_raw(in.data, sinm_raw_r16, out.data, sinm_output_rgba8, size, size, 2.0f, 2.0f, 0);
+            }
+            sinm_unmap_file(&out);
+            sinm_unmap_file(&in);
+        });
+
+        std::vector<uint32_t> mapped(pixels);
+        file = fopen(normalPath, "rb");
+        fread(mapped.data(), sizeof(uint32_t), pixels, file);
+        fclose(file);
+        fmt::print("{:>7} {:>12.2f} {:>12.2f} {:>7.2f}x {:>12}\n", size, copyMs, mappedMs, copyMs / mappedMs, max_channel_diff(reference, mapped));
+    }
+    remove(heightPath);
+    remove(normalPath);
+    sinm_shutdown_threads();
+}
+
+//Decodes one BC4 block(or the BC3 alpha block) into 16 values
+static void decode_bc4(const uint8_t* block, uint8_t* values)
+{
+    int32_t e0 = block[0];
+    int32_t e1 = block[1];
+    int32_t palette[8] = { e0, e1 };
+    if (e0 > e1) {
+        for (int32_t i = 1; i < 7; ++i) {
+            palette[i + 1] = ((7 - i) * e0 + i * e1) / 7;
+        }
+    } else {
+        for (int32_t i = 1; i < 5; ++i) {
+            palette[i + 1] = ((5 - i) * e0 + i * e1) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    uint64_t bits = 0;
+    memcpy(&bits, block + 2, 6);
+    for (int32_t i = 0; i < 16; ++i) {
+        values[i] = (uint8_t)palette[(bits >> (3 * i)) & 7];
+    }
+}
+
+//Decodes the green of one BC1 block into 16 values
+static void decode_bc1_green(const uint8_t* block, uint8_t* values)
+{
+    uint16_t c0, c1;
+    uint32_t bits;
+    memcpy(&c0, block, 2);
+    memcpy(&c1, block + 2, 2);
+    memcpy(&bits, block + 4, 4);
+    int32_t g0 = (c0 >> 5) & 63;
+    int32_t g1 = (c1 >> 5) & 63;
+    g0 = (g0 << 2) | (g0 >> 4);
+    g1 = (g1 << 2) | (g1 >> 4);
+    int32_t palette[4] = { g0, g1, (2 * g0 + g1) / 3, (g0 + 2 * g1) / 3 };
+    if (c0 <= c1) {
+        palette[2] = (g0 + g1) / 2;
+        palette[3] = 0;
+    }
+    for (int32_t i = 0; i < 16; ++i) {
+        values[i] = (uint8_t)palette[(bits >> (2 * i)) & 3];
+    }
+}
+
+static double reconstructed_z(double x, double y)
+{
+    return std::sqrt(std::max(0.0, 1.0 - x * x - y * y));
+}
+
+//Error of "blocks" against the RGBA normals they were compressed from: RMSE of X and Y in 8 bit steps and the
+//mean and largest angle between the normals the shader rebuilds from the compressed and uncompressed X and Y
+struct block_error {
+    double rmse;
+    double meanDegrees;
+    double maxDegrees;
+};
+
+static block_error measure_block_error(const std::vector<uint32_t>& normals, const std::vector<uint8_t>& blocks, int32_t w, int32_t h, sinm_block_format format)
+{
+    double squares = 0.0;
+    double degrees = 0.0;
+    double maxDegrees = 0.0;
+    int32_t blocksPerRow = (w + 3) / 4;
+    for (int32_t by = 0; by < (h + 3) / 4; ++by) {
+        for (int32_t bx = 0; bx < blocksPerRow; ++bx) {
+            const uint8_t* block = &blocks[((size_t)by * blocksPerRow + bx) * 16];
+            uint8_t xs[16], ys[16];
+            decode_bc4(block, xs);
+            if (format == sinm_block_bc5) {
+                decode_bc4(block + 8, ys);
+            } else {
+                decode_bc1_green(block + 8, ys);
+            }
+            for (int32_t i = 0; i < 16; ++i) {
+                int32_t x = bx * 4 + i % 4;
+                int32_t y = by * 4 + i / 4;
+                if (x >= w || y >= h) {
+                    continue;
+                }
+                uint32_t n = normals[(size_t)y * w + x];
+                double dx = (double)(n & 0xFF) - xs[i];
+                double dy = (double)((n >> 8) & 0xFF) - ys[i];
+                squares += dx * dx + dy * dy;
+
+                double ax = (n & 0xFF) / 127.5 - 1.0, ay = ((n >> 8) & 0xFF) / 127.5 - 1.0;
+                double bx2 = xs[i] / 127.5 - 1.0, by2 = ys[i] / 127.5 - 1.0;
+                double az = reconstructed_z(ax, ay), bz = reconstructed_z(bx2, by2);
+                double dot = (ax * bx2 + ay * by2 + az * bz) / std::sqrt((ax * ax + ay * ay + az * az) * (bx2 * bx2 + by2 * by2 + bz * bz));
+                double angle = std::acos(std::min(1.0, dot)) * 180.0 / 3.14159265358979;
+                degrees += angle;
+                maxDegrees = std::max(maxDegrees, angle);
+            }
+        }
+    }
+    double pixels = (double)w * h;
+    return { std::sqrt(squares / (2.0 * pixels)), degrees / pixels, maxDegrees };
+}
+
+//Block compression of the normal map. "compress" is sinm_compress_normal_map on a finished RGBA normal map,
+//"separate" is sinm_normal_map_buffer_rows followed by it and "fused" is sinm_normal_map_compressed, which
+//compresses rows as the pipeline makes them. Error is of the compressed blocks against the RGBA normals
+static void bc(const std::vector<int32_t>& sizes)
+{
+    const float blurRadius = 2.0f;
+    const float scale = 2.0f;
+    const char* formatNames[sinm_block_count] = { "bc5", "bc3nm" };
+    sinm_initialize_threads(0);
+    fmt::print("{:>7} {:>6} {:>12} {:>14} {:>12} {:>10} {:>8} {:>8} {:>10} {:>9}\n",
+        "size", "format", "compress ms", "compress MPix/s", "separate ms", "fused ms", "speedup", "rmse", "mean deg", "max deg");
+
+    for (int32_t size : sizes) {
+        std::vector<uint32_t> in = make_test_image(size, size);
+        std::vector<uint32_t> normals((size_t)size * size);
+        std::vector<uint8_t> blocks(sinm_block_compressed_size(size, size));
+        std::vector<uint8_t> fused(blocks.size());
+        double mpix = (double)size * size / 1e6;
+        double rowsMs = best_of(3, [&] {
+            sinm_normal_map_buffer_rows(in.data(), normals.data(), size, size, scale, blurRadius, sinm_greyscale_luminance, 0);
+        });
+
+        for (int f = 0; f < sinm_block_count; ++f) {
+            sinm_block_format format = (sinm_block_format)f;
+            double compressMs = best_of(3, [&] {
+                sinm_compress_normal_map(normals.data(), blocks.data(), size, size, format);
+            });
+            double fusedMs = best_of(3, [&] {
+                sinm_normal_map_compressed(in.data(), fused.data(), size, size, scale, blurRadius, sinm_greyscale_luminance, 0, format);
+            });
+            if (fused != blocks) {
+                fmt::print(stderr, "fused {} blocks differ from compressing the RGBA result\n", formatNames[f]);
+            }
+            block_error e = measure_block_error(normals, blocks, size, size, format);
+            fmt::print("{:>7} {:>6} {:>12.2f} {:>14.1f} {:>12.2f} {:>10.2f} {:>7.2f}x {:>8.3f} {:>10.3f} {:>9.2f}\n",
+                size, formatNames[f], compressMs, mpix / (compressMs / 1000.0), rowsMs + compressMs, fusedMs, (rowsMs + compressMs) / fusedMs, e.rmse, e.meanDegrees, e.maxDegrees);
+        }
+    }
+    sinm_shutdown_threads();
+}
+}
+
+int main(int argc, char** argv)
+{
+    std::string_view name = argc > 1 ? argv[1] : "tiled";
+    std::vector<int32_t> sizes;
+    for (int i = 2; i < argc; ++i) {
+        sizes.push_back(atoi(argv[i]));
+    }
+    if (name == "tiled") {
+        bench::tiled(sizes.empty() ? std::vector<int32_t> { 4096, 8192, 16384 } : sizes);
+    } else if (name == "threads") {
+        bench::threads(sizes.empty() ? std::vector<int32_t> { 8192 } : sizes);
+    } else if (name == "isa") {
+        bench::isa(sizes.empty() ? std::vector<int32_t> { 1024, 2048, 4096 } : sizes);
+    } else if (name == "passes") {
+        bench::passes(sizes.empty() ? std::vector<int32_t> { 2048, 4096, 8192 } : sizes);
+    } else if (name == "blur") {
+        bench::blur(sizes.empty() ? std::vector<int32_t> { 2048 } : sizes);
+    } else if (name == "layers") {
+        bench::layers(sizes.empty() ? std::vector<int32_t> { 2048 } : sizes);
+    } else if (name == "pyramid") {
+        bench::pyramid(sizes.empty() ? std::vector<int32_t> { 2048 } : sizes);
+    } else if (name == "memory") {
+        bench::memory(sizes.empty() ? std::vector<int32_t> { 4096, 16384 } : sizes);
+    } else if (name == "stream") {
+        bench::stream(sizes.empty() ? std::vector<int32_t> { 65536 } : sizes);
+    } else if (name == "raw") {
+        bench::raw(sizes.empty() ? std::vector<int32_t> { 2048, 8192 } : sizes);
+    } else if (name == "bc") {
+        bench::bc(sizes.empty() ? std::vector<int32_t> { 2048, 8192 } : sizes);
+    } else if (name == "context") {
+        bench::context(sizes.empty() ? std::vector<int32_t> { 512, 2048, 8192 } : sizes);
+    } else {
+        fmt::print(stderr, "unknown bench \"{}\"\n", name);
+        return 1;
+    }
+
+    return 0;
+}